@@ -0,0 +1,120 @@
+#include "BallTree.h"
+#include "Utility.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * pruning rate and query latency of ball bounds against cone bounds, for
+ * top-1 and top-10 searches of a stored and of a flat tree
+ *
+ * the pruning rate is the share of the children of the branches visited
+ * whose bound could not beat the result. Run from the BallTree directory
+ * after placing the datasets under <Dataset>/src/, the indexes are rebuilt
+ * into <Dataset>/index/ and <Dataset>/index/cone/
+ */
+
+constexpr int kQN = 1000;
+constexpr int kTopKs[] = {1, 10};
+
+struct DataSet {
+    const char* name;
+    int scale;
+    int dimension;
+};
+
+constexpr DataSet kDataSets[] = {
+    {"Netflix", 17770, 50},
+    {"Yahoo", 10000, 300},
+    {"Mnist", 60000, 50},
+};
+
+struct Bound {
+    const char* name;
+    NodeBound bound;
+    const char* sub_dir;
+};
+
+constexpr Bound kBounds[] = {
+    {"ball", NodeBound::ball, ""},
+    {"cone", NodeBound::cone, "cone/"},
+};
+
+template <typename F>
+double Seconds(const F& f) {
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+void BenchTree(BallTree& tree, const char* layout, const Bound& bound,
+               const DataSet& dataset, float** queries) {
+    std::vector<int> indices(kTopKs[1]);
+    for (auto k : kTopKs) {
+        auto before = tree.stats().query;
+        double seconds = Seconds([&] {
+            for (int i = 0; i < kQN; ++i) {
+                tree.mipSearchTopK(dataset.dimension, queries[i], k,
+                                   indices.data(), nullptr);
+            }
+        });
+        auto stats = tree.stats().query;
+        stats -= before;
+        double children = 2.0 * stats.branches_visited;
+        std::printf("%6s %6s %4d %10.1f %10.1f %10.1f %9.1f%% %10.1f\n",
+                    layout, bound.name, k,
+                    static_cast<double>(stats.branches_visited) / kQN,
+                    static_cast<double>(stats.leaves_scanned) / kQN,
+                    static_cast<double>(stats.records_scored) / kQN,
+                    children > 0 ? 100.0 * stats.subtrees_pruned / children : 0.0,
+                    seconds * 1e6 / kQN);
+    }
+}
+
+void BenchDataSet(const DataSet& dataset) {
+    std::string data_path = dataset.name + std::string("/src/dataset.txt");
+    std::string query_path = dataset.name + std::string("/src/query.txt");
+    std::string index_dir = dataset.name + std::string("/index/");
+    float **data = nullptr, **queries = nullptr;
+    if (not read_data(dataset.scale, dataset.dimension, data, data_path.data()) or
+        not read_data(kQN, dataset.dimension, queries, query_path.data())) {
+        return;
+    }
+
+    std::printf("%s: %d records, %d dimension, %d queries\n", dataset.name,
+                dataset.scale, dataset.dimension, kQN);
+    std::printf("%6s %6s %4s %10s %10s %10s %10s %10s\n", "tree", "bound",
+                "k", "branches", "leaves", "records", "pruned", "us/query");
+    for (const auto& bound : kBounds) {
+        std::string index_path = index_dir + bound.sub_dir;
+        {
+            BallTree tree;
+            tree.buildTree(dataset.scale, dataset.dimension, data, 0,
+                           bound.bound);
+            tree.storeTree(index_path.data());
+        }
+        BallTree tree;
+        tree.restoreTree(index_path.data());
+        BenchTree(tree, "stored", bound, dataset, queries);
+        tree.flattenTree();
+        BenchTree(tree, "flat", bound, dataset, queries);
+    }
+    std::printf("\n");
+
+    for (int i = 0; i < dataset.scale; ++i) {
+        delete[] data[i];
+    }
+    delete[] data;
+    for (int i = 0; i < kQN; ++i) {
+        delete[] queries[i];
+    }
+    delete[] queries;
+}
+
+int main() {
+    for (const auto& dataset : kDataSets) {
+        BenchDataSet(dataset);
+    }
+}
@@ -0,0 +1,97 @@
+#include "SimdKernels.h"
+#include "Utility.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+/**
+ * nanoseconds per call of the generic Utility.h templates against every
+ * kernel flavour this CPU supports, for d = 50 and d = 300
+ */
+
+constexpr int kDimensions[] = {50, 300};
+constexpr int kVectors = 1024;
+constexpr int kRounds = 2000;
+
+using Vectors = std::vector<std::vector<float>>;
+
+Vectors RandomVectors(int d) {
+    std::mt19937 engine(2017);
+    std::normal_distribution<float> dist;
+    Vectors ret(kVectors, std::vector<float>(d));
+    for (auto& v : ret) {
+        for (auto& x : v) {
+            x = dist(engine);
+        }
+    }
+    return ret;
+}
+
+/**
+ * @return nanoseconds per call of f(a, b) over all pairs of neighbours
+ */
+template <typename F>
+double NanosPerCall(const Vectors& vs, const F& f) {
+    volatile double sink = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int round = 0; round < kRounds; ++round) {
+        double acc = 0;
+        for (int i = 0; i + 1 < kVectors; ++i) {
+            acc += f(vs[i], vs[i + 1]);
+        }
+        sink = sink + acc;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double calls = static_cast<double>(kRounds) * (kVectors - 1);
+    return std::chrono::duration<double, std::nano>(end - start).count() /
+           calls;
+}
+
+void BenchDimension(int d) {
+    Vectors vs(RandomVectors(d));
+    using Vector = std::vector<float>;
+    std::printf("d = %d\n", d);
+    std::printf("%-10s %14s %14s %14s\n", "kernel", "dot (ns)", "l2 (ns)",
+                "norm (ns)");
+    std::printf(
+        "%-10s %14.2f %14.2f %14.2f\n", "template",
+        NanosPerCall(vs, [](const Vector& a, const Vector& b) {
+            return InnerProduct<double, Vector>(a, b);
+        }),
+        NanosPerCall(vs, [](const Vector& a, const Vector& b) {
+            return Distance<double, Vector>(a, b);
+        }),
+        NanosPerCall(vs, [](const Vector& a, const Vector&) {
+            return Norm<double, Vector>(a);
+        }));
+    for (auto isa : {kernels::Isa::scalar, kernels::Isa::sse,
+                     kernels::Isa::avx2, kernels::Isa::avx512}) {
+        auto kernel_set = kernels::Select(isa);
+        if (not kernel_set) {
+            std::printf("%-10s %14s\n", "", "(unsupported)");
+            continue;
+        }
+        auto dot = kernel_set->dot;
+        auto squared_l2 = kernel_set->squared_l2;
+        std::printf(
+            "%-10s %14.2f %14.2f %14.2f%s\n", kernel_set->name,
+            NanosPerCall(vs, [dot](const Vector& a, const Vector& b) {
+                return dot(a.data(), b.data(), a.size());
+            }),
+            NanosPerCall(vs, [squared_l2](const Vector& a, const Vector& b) {
+                return std::sqrt(squared_l2(a.data(), b.data(), a.size()));
+            }),
+            NanosPerCall(vs, [dot](const Vector& a, const Vector&) {
+                return std::sqrt(dot(a.data(), a.data(), a.size()));
+            }),
+            kernel_set == &kernels::Active() ? "  <- active" : "");
+    }
+    std::printf("\n");
+}
+
+int main() {
+    for (int d : kDimensions) {
+        BenchDimension(d);
+    }
+}
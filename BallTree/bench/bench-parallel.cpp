@@ -0,0 +1,93 @@
+#include "BallTree.h"
+#include "Utility.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * throughput of BallTree::mipSearchParallel at 1/2/4/8/16 threads
+ *
+ * run from the BallTree directory after placing the datasets under
+ * <Dataset>/src/, the index is rebuilt into <Dataset>/index/
+ */
+
+constexpr int kQN = 1000;
+constexpr int kThreads[] = {1, 2, 4, 8, 16};
+
+struct DataSet {
+    const char* name;
+    int scale;
+    int dimension;
+};
+
+constexpr DataSet kDataSets[] = {
+    {"Netflix", 17770, 50},
+    {"Mnist", 60000, 50},
+};
+
+template <typename F>
+double Seconds(const F& f) {
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+void BenchDataSet(const DataSet& dataset) {
+    std::string data_path = dataset.name + std::string("/src/dataset.txt");
+    std::string query_path = dataset.name + std::string("/src/query.txt");
+    std::string index_path = dataset.name + std::string("/index/");
+    float **data = nullptr, **queries = nullptr;
+    if (not read_data(dataset.scale, dataset.dimension, data, data_path.data()) or
+        not read_data(kQN, dataset.dimension, queries, query_path.data())) {
+        return;
+    }
+    {
+        BallTree tree;
+        tree.buildTree(dataset.scale, dataset.dimension, data);
+        tree.storeTree(index_path.data());
+    }
+
+    std::printf("%s: %d records, %d dimension, %d queries\n", dataset.name,
+                dataset.scale, dataset.dimension, kQN);
+    std::printf("%8s %12s %14s %10s\n", "threads", "seconds", "queries/sec",
+                "speedup");
+    std::vector<int> baseline(kQN), result(kQN);
+    double base_seconds = 0;
+    for (int threads : kThreads) {
+        BallTree tree;
+        tree.restoreTree(index_path.data());
+        // warm up the pool and the per-worker readers
+        tree.mipSearchParallel(kQN, dataset.dimension, queries, result.data(),
+                               threads);
+        double seconds = Seconds([&] {
+            tree.mipSearchParallel(kQN, dataset.dimension, queries,
+                                   result.data(), threads);
+        });
+        if (threads == kThreads[0]) {
+            base_seconds = seconds;
+            baseline = result;
+        } else if (result != baseline) {
+            std::printf("WARNING! results with %d threads differ\n", threads);
+        }
+        std::printf("%8d %12.3f %14.1f %10.2f\n", threads, seconds,
+                    kQN / seconds, base_seconds / seconds);
+    }
+    std::printf("\n");
+
+    for (int i = 0; i < dataset.scale; ++i) {
+        delete[] data[i];
+    }
+    delete[] data;
+    for (int i = 0; i < kQN; ++i) {
+        delete[] queries[i];
+    }
+    delete[] queries;
+}
+
+int main() {
+    for (const auto& dataset : kDataSets) {
+        BenchDataSet(dataset);
+    }
+}
@@ -0,0 +1,104 @@
+#include "BallTree.h"
+#include "Utility.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * buffer pool hit rate and query latency of BallTree::mipSearch against
+ * pool size, for every replacement policy
+ *
+ * run from the BallTree directory after placing the datasets under
+ * <Dataset>/src/, the index is rebuilt into <Dataset>/index/
+ */
+
+constexpr int kQN = 1000;
+// frames of each of the branch, leaf and record pools
+constexpr std::size_t kFrames[] = {2, 4, 8, 16, 64, 256};
+
+struct DataSet {
+    const char* name;
+    int scale;
+    int dimension;
+};
+
+constexpr DataSet kDataSets[] = {
+    {"Netflix", 17770, 50},
+    {"Mnist", 60000, 50},
+};
+
+struct Policy {
+    const char* name;
+    ReplacementPolicy policy;
+};
+
+constexpr Policy kPolicies[] = {
+    {"clock", ReplacementPolicy::clock},
+    {"lru", ReplacementPolicy::lru},
+    {"2q", ReplacementPolicy::two_queue},
+};
+
+template <typename F>
+double Seconds(const F& f) {
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+void BenchDataSet(const DataSet& dataset) {
+    std::string data_path = dataset.name + std::string("/src/dataset.txt");
+    std::string query_path = dataset.name + std::string("/src/query.txt");
+    std::string index_path = dataset.name + std::string("/index/");
+    float **data = nullptr, **queries = nullptr;
+    if (not read_data(dataset.scale, dataset.dimension, data, data_path.data()) or
+        not read_data(kQN, dataset.dimension, queries, query_path.data())) {
+        return;
+    }
+    {
+        BallTree tree;
+        tree.buildTree(dataset.scale, dataset.dimension, data);
+        tree.storeTree(index_path.data());
+    }
+
+    std::printf("%s: %d records, %d dimension, %d queries\n", dataset.name,
+                dataset.scale, dataset.dimension, kQN);
+    std::printf("%8s %8s %10s %12s %14s\n", "policy", "frames", "hit rate",
+                "misses", "us/query");
+    for (const auto& policy : kPolicies) {
+        for (auto frames : kFrames) {
+            BufferPoolConfig pool;
+            pool.node_frames = frames;
+            pool.record_frames = frames;
+            pool.policy = policy.policy;
+            BallTree tree;
+            tree.restoreTree(index_path.data(), StorageBackend::buffered, pool);
+            double seconds = Seconds([&] {
+                for (int i = 0; i < kQN; ++i) {
+                    tree.mipSearch(dataset.dimension, queries[i]);
+                }
+            });
+            auto stats = tree.stats().Pools();
+            std::printf("%8s %8zu %9.2f%% %12zu %14.1f\n", policy.name, frames,
+                        stats.HitRate() * 100, stats.misses,
+                        seconds * 1e6 / kQN);
+        }
+    }
+    std::printf("\n");
+
+    for (int i = 0; i < dataset.scale; ++i) {
+        delete[] data[i];
+    }
+    delete[] data;
+    for (int i = 0; i < kQN; ++i) {
+        delete[] queries[i];
+    }
+    delete[] queries;
+}
+
+int main() {
+    for (const auto& dataset : kDataSets) {
+        BenchDataSet(dataset);
+    }
+}
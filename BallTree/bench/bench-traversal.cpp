@@ -0,0 +1,130 @@
+#include "BallTree.h"
+#include "Utility.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * nodes touched and query latency of depth-first against best-first
+ * traversal, for top-1 and top-10 searches of a stored tree with small and
+ * large buffer pools and of a flat tree
+ *
+ * run from the BallTree directory after placing the datasets under
+ * <Dataset>/src/, the index is rebuilt into <Dataset>/index/
+ */
+
+constexpr int kQN = 1000;
+constexpr int kTopKs[] = {1, 10};
+// frames of each pool of the "pooled" runs, the "stored" ones use the
+// default BufferPoolConfig
+constexpr std::size_t kLargePoolFrames = 1024;
+
+struct DataSet {
+    const char* name;
+    int scale;
+    int dimension;
+};
+
+constexpr DataSet kDataSets[] = {
+    {"Netflix", 17770, 50},
+    {"Yahoo", 10000, 300},
+    {"Mnist", 60000, 50},
+};
+
+struct Order {
+    const char* name;
+    SearchOrder order;
+};
+
+constexpr Order kOrders[] = {
+    {"depth", SearchOrder::depth_first},
+    {"best", SearchOrder::best_first},
+};
+
+template <typename F>
+double Seconds(const F& f) {
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+void BenchTree(BallTree& tree, const char* layout, const DataSet& dataset,
+               float** queries) {
+    std::vector<int> indices(kTopKs[1]);
+    for (auto k : kTopKs) {
+        for (const auto& order : kOrders) {
+            tree.setSearchOrder(order.order);
+            auto before = tree.stats().query;
+            double seconds = Seconds([&] {
+                for (int i = 0; i < kQN; ++i) {
+                    tree.mipSearchTopK(dataset.dimension, queries[i], k,
+                                       indices.data(), nullptr);
+                }
+            });
+            auto stats = tree.stats().query;
+            stats -= before;
+            std::printf("%8s %4d %6s %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                        layout, k, order.name,
+                        static_cast<double>(stats.branches_visited) / kQN,
+                        static_cast<double>(stats.leaves_scanned) / kQN,
+                        static_cast<double>(stats.records_scored) / kQN,
+                        static_cast<double>(stats.subtrees_pruned) / kQN,
+                        seconds * 1e6 / kQN);
+        }
+    }
+    tree.setSearchOrder(SearchOrder::depth_first);
+}
+
+void BenchDataSet(const DataSet& dataset) {
+    std::string data_path = dataset.name + std::string("/src/dataset.txt");
+    std::string query_path = dataset.name + std::string("/src/query.txt");
+    std::string index_path = dataset.name + std::string("/index/");
+    float **data = nullptr, **queries = nullptr;
+    if (not read_data(dataset.scale, dataset.dimension, data, data_path.data()) or
+        not read_data(kQN, dataset.dimension, queries, query_path.data())) {
+        return;
+    }
+    {
+        BallTree tree;
+        tree.buildTree(dataset.scale, dataset.dimension, data);
+        tree.storeTree(index_path.data());
+    }
+
+    std::printf("%s: %d records, %d dimension, %d queries\n", dataset.name,
+                dataset.scale, dataset.dimension, kQN);
+    std::printf("%8s %4s %6s %10s %10s %10s %10s %10s\n", "tree", "k",
+                "order", "branches", "leaves", "records", "pruned",
+                "us/query");
+    {
+        BallTree tree;
+        tree.restoreTree(index_path.data());
+        BenchTree(tree, "stored", dataset, queries);
+    }
+    // a frontier spread over the tree needs more frames than one path
+    BufferPoolConfig pool;
+    pool.node_frames = kLargePoolFrames;
+    pool.record_frames = kLargePoolFrames;
+    BallTree tree;
+    tree.restoreTree(index_path.data(), StorageBackend::buffered, pool);
+    BenchTree(tree, "pooled", dataset, queries);
+    tree.flattenTree();
+    BenchTree(tree, "flat", dataset, queries);
+    std::printf("\n");
+
+    for (int i = 0; i < dataset.scale; ++i) {
+        delete[] data[i];
+    }
+    delete[] data;
+    for (int i = 0; i < kQN; ++i) {
+        delete[] queries[i];
+    }
+    delete[] queries;
+}
+
+int main() {
+    for (const auto& dataset : kDataSets) {
+        BenchDataSet(dataset);
+    }
+}
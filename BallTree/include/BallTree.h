@@ -20,28 +20,140 @@ class BallTree {
   public:
     static Records ArrayToVector(int n, int d, float** data);
 
-    bool buildTree(int n, int d, float** data);
+    /**
+     * @param threads number of threads to build with, 0 for one per core;
+     * the tree built does not depend on it
+     * @param bound NodeBound::cone to prune by cones as well as balls, the
+     * index stored from the tree keeps them
+     */
+    bool buildTree(
+        int n, int d, float** data, int threads = 0,
+        NodeBound bound = NodeBound::ball);
 
-    bool storeTree(const char* index_path);
+    bool storeTree(
+        const char* index_path, const IndexFormat& format = IndexFormat());
 
-    bool restoreTree(const char* index_path);
+    /**
+     * @param backend StorageBackend::mapped to serve the index read only
+     * from memory-mapped files
+     * @param pool frames and replacement policy of the buffer pools, only
+     * used by the buffered backend, and whether searches prefetch pages
+     */
+    bool restoreTree(
+        const char* index_path,
+        StorageBackend backend = StorageBackend::buffered,
+        const BufferPoolConfig& pool = BufferPoolConfig());
 
     int mipSearch(int d, float* query);
 
+    /**
+     * finds the k records with the largest inner products with query
+     * @param out_indices receives the record indices, best first
+     * @param out_scores receives the inner products, may be nullptr
+     * @return number of records written, at most k
+     */
+    int mipSearchTopK(
+        int d, float* query, int k, int* out_indices, float* out_scores);
+
+    /**
+     * mipSearchTopK that stops once budget is spent, e.g. at a deadline,
+     * and returns the best records found by then
+     * @param exact receives whether they are what mipSearchTopK returns,
+     * may be nullptr
+     */
+    int mipSearchTopK(
+        int d, float* query, int k, int* out_indices, float* out_scores,
+        const SearchBudget& budget, bool* exact = nullptr);
+
+    /**
+     * answers nq queries at once, out[i] receives the answer of queries[i]
+     */
+    bool mipSearchBatch(int nq, int d, float** queries, int* out);
+
+    /**
+     * mipSearchBatch spread over a pool of threads
+     * @param threads number of worker threads, 0 for one per core
+     */
+    bool mipSearchParallel(
+        int nq, int d, float** queries, int* out, int threads = 0);
+
+
+
+    /**
+     * loads the whole tree into one flat in-memory arena that answers every
+     * later search, call after buildTree or restoreTree
+     */
+    bool flattenTree();
+
+    /**
+     * trains product-quantization codebooks on the records of the tree,
+     * i.e. the data given to buildTree, and keeps a one byte code per
+     * subspace of every record in the flat tree, flattening it first if
+     * needed
+     * @param subspaces number of codebooks, 0 for one per four dimensions
+     */
+    bool buildQuantizer(int subspaces = 0);
 
+    /**
+     * mipSearchTopK scoring the records of the leaves from lookup tables
+     * of the query instead of with full inner products, and only the best
+     * candidates exactly; faster but approximate, the best records may be
+     * missed; call after buildQuantizer
+     * @param candidates records scored exactly, 0 for 4 * k; more trade
+     * speed for recall
+     */
+    int mipSearchApproximateTopK(
+        int d, float* query, int k, int* out_indices, float* out_scores,
+        int candidates = 0);
 
     /**
-     * Additional task (not written now)
+     * buffer pool and search counters of this tree so far, cheap enough to
+     * call between queries
      */
+    TreeStats stats() const;
 
-    bool insertData(int d, float* data);
+    /**
+     * Additional task
+     */
 
+    /**
+     * adds data to a built or restored tree without rebuilding it; updates
+     * are collected in memory, searched by brute force and merged into the
+     * tree in the background, a restored index is changed in place
+     * @param index of the new record, 0 for one past the largest so far
+     */
+    bool insertData(int d, float* data, int index = 0);
+
+    /**
+     * removes one record equal to data from a built or restored tree,
+     * searches leave it out at once
+     */
     bool deleteData(int d, float* data);
 
+    /**
+     * number of pending updates that starts a background merge
+     */
+    bool setMergeThreshold(std::size_t updates);
+
+    /**
+     * SearchOrder::best_first to have mipSearch and mipSearchTopK expand the
+     * most promising node of the whole frontier first; the answers do not
+     * change
+     */
+    bool setSearchOrder(SearchOrder order);
+
+    /**
+     * merges every pending update into the tree before returning
+     */
+    bool mergeUpdates();
+
     bool buildQuadTree(int n, int d, float** data);
 
   private:
+    ThreadPool& Pool(int threads);
+
     std::unique_ptr<BallTreeImpl> impl_;
+    std::unique_ptr<ThreadPool> pool_;
     int dim;
 };
 
@@ -3,19 +3,28 @@
 
 
 #include <algorithm>
+#include <cstdio>
 #include <iostream>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <vector>
 #include <stack>
+#include <thread>
 #include <queue>
 #include "Utility.h"
 #include "BallTreeNode.h"
 #include "record.h"
 #include "storage.h"
 #include "MIPSearcher.h"
+#include "BatchMIPSearcher.h"
 #include "NodeBuilder.h"
+#include "ThreadPool.h"
+#include "FlatBallTree.h"
+#include "Stats.h"
+#include "DeltaSegment.h"
 
 
 class BallTreeImpl {
@@ -24,30 +33,73 @@ class BallTreeImpl {
   public:
     /**
      * build the balltree from index file
+     * @param backend how the index is read, a mapped tree is read only
+     * @param pool sizes and policy of the buffer pools of a buffered tree
      */
-    BallTreeImpl(Path& index_path);
+    BallTreeImpl(
+        Path& index_path, StorageBackend backend = StorageBackend::buffered,
+        const BufferPoolConfig& pool = BufferPoolConfig());
+
+    /**
+     * subtrees with more records than this are built as separate tasks
+     */
+    static constexpr std::size_t kParallelBuildCutoff = 4096;
+
+    /**
+     * nodes with more records than this scan their records in parallel
+     */
+    static constexpr std::size_t kParallelScanCutoff = 65536;
+
+    /**
+     * updates collected before they are merged into the tree
+     */
+    static constexpr std::size_t kMergeThreshold = 1024;
 
     /**
      * build the balltree from plain index and vector data
+     *
+     * with a pool, the tree is built fork-join; the result is identical to
+     * the serial build down to the order of records in every leaf
+     * @param bound NodeBound::cone to keep a ConeBound in every node, a
+     * store then writes them into the index
+     */
+    BallTreeImpl(
+        Records&& records, ThreadPool* pool = nullptr,
+        std::size_t parallel_build_cutoff = kParallelBuildCutoff,
+        std::size_t parallel_scan_cutoff = kParallelScanCutoff,
+        NodeBound bound = NodeBound::ball);
+
+    /**
+     * merges the updates still pending into a restored tree, so that the
+     * index holds them
      */
-    BallTreeImpl(Records&& records);
+    ~BallTreeImpl();
 
     /**
      * functions for calculations
+     *
+     * with a pool, the scans are split into chunks whose partial results
+     * are combined in record order, so they return exactly what the serial
+     * versions return
      */
-    static std::vector<float> CalculateCenter(const Records& records);
+    static std::vector<float> CalculateCenter(
+        const Records& records, ThreadPool* pool = nullptr);
 
     static double CalculateRadius(
-        const Records& records, const std::vector<float>& center);
+        const Records& records, const std::vector<float>& center,
+        ThreadPool* pool = nullptr);
 
-    static Record* ChooseFarthest(const Records& records, Record* pivot);
+    static Record* ChooseFarthest(
+        const Records& records, Record* pivot, ThreadPool* pool = nullptr);
 
-    static std::pair<Record*, Record*> PickPivots(const Records& records);
+    static std::pair<Record*, Record*> PickPivots(
+        const Records& records, ThreadPool* pool = nullptr);
 
     static std::pair<Records, Records> SplitRecord(
-        Records&& records, Record* a, Record* b);
+        Records&& records, Record* a, Record* b, ThreadPool* pool = nullptr);
 
-    static std::pair<Records, Records> SplitRecord(Records&& records);
+    static std::pair<Records, Records> SplitRecord(
+        Records&& records, ThreadPool* pool = nullptr);
 
     /**
      *  Functions for building Ball Tree Node 
@@ -65,7 +117,7 @@ class BallTreeImpl {
     /**
      * store the balltree to an index file
      */
-    bool StoreTree(Path& index_path);
+    bool StoreTree(Path& index_path, const IndexFormat& format = IndexFormat());
 
     /**
      * returns the index of the vector with the maximum inner product with the
@@ -73,25 +125,297 @@ class BallTreeImpl {
      */
     std::pair<int, double> Search(const std::vector<float>& v);
 
+    /**
+     * returns at most k (index, inner product) pairs with the largest inner
+     * products with the vector given, best first
+     */
+    std::vector<std::pair<int, double>> SearchTopK(
+        const std::vector<float>& v, int k);
+
+    /**
+     * SearchTopK that stops once budget is spent and returns the best
+     * records found by then; pending insertions are always scanned whole
+     * @param exact receives whether the results are those of SearchTopK,
+     * may be nullptr
+     */
+    std::vector<std::pair<int, double>> SearchTopK(
+        const std::vector<float>& v, int k, const SearchBudget& budget,
+        bool* exact = nullptr);
+
+    /**
+     * returns the index of the vector with the maximum inner product for
+     * every vector given, the queries traverse the tree block by block
+     */
+    std::vector<int> SearchBatch(const std::vector<std::vector<float>>& vs);
+
+    /**
+     * SearchBatch spread over the workers of pool
+     *
+     * storages are not thread safe, so every worker searches through its
+     * own reader restored from the index path, each with its own buffer
+     *
+     * may be called from a worker of pool: the caller holds the lock of the
+     * tree and joins the tasks, running queued tasks of pool meanwhile, so
+     * tasks queued on pool must not call into this tree while it runs
+     */
+    std::vector<int> SearchParallel(
+        const std::vector<std::vector<float>>& vs, ThreadPool& pool);
+
 
     bool SetDimension(int d);
 
     /**
-     * insert given vector to the balltree (not written now)
+     * counters of the record, branch and leaf buffer pools and of the
+     * searches answered so far, parallel readers included
+     */
+    TreeStats Stats() const;
+
+    /**
+     * copies the whole tree, records included, into a FlatBallTree that
+     * answers every later search; works on a built tree as well as on a
+     * restored one. A merge changes the tree under the copy, so searches
+     * go back to the tree while one runs and the copy is made again once
+     * it has finished
      */
-    bool Insert(const std::vector<float>& v);
+    bool Flatten();
 
     /**
-     * delete given vector from the balltree (not written now)
+     * trains product-quantization codebooks on the records of the tree and
+     * encodes them into the flat tree, flattening the tree first if needed;
+     * the copy made after a merge is encoded with the same codebooks, call
+     * again to train them on the records as they are then
+     * @param subspaces as for ProductQuantizer
+     */
+    bool Quantize(int subspaces = 0);
+
+    /**
+     * at most k (index, inner product) pairs, best first, with the records
+     * of the tree scored from product-quantization tables and the best
+     * candidates re-ranked exactly; the results may miss the best records.
+     * While a merge has dropped the flat tree the search is exact
+     * @param candidates as for FlatBallTree::SearchApproximate
+     */
+    std::vector<std::pair<int, double>> SearchApproximate(
+        const std::vector<float>& v, int k, std::size_t candidates = 0);
+
+    const BallTreeNode* Root() const {
+        return root_.get();
+    }
+
+    /**
+     * inserts v as a record; it lands in the delta segment, which searches
+     * scan by brute force, and is merged into the tree later
+     * @param index 0 for one past the largest index in the tree
+     * @return false if there is no tree or it is mapped, i.e. read only, or
+     * if index is that of a deleted record not merged out yet; tombstones
+     * go by index, so the new record would be left out of searches
+     */
+    bool Insert(const std::vector<float>& v, int index = 0);
+
+    /**
+     * deletes one record equal to v; a record of the delta segment goes at
+     * once, one of the tree is left out of searches by a tombstone until
+     * the merge deletes it
+     * @return false if no record equals v or the tree is read only
      */
     bool Delete(const std::vector<float>& v);
 
+    /**
+     * once this many updates are pending they are merged into the tree in
+     * the background, searches go on meanwhile and see every update
+     */
+    void SetMergeThreshold(std::size_t updates);
+
+    /**
+     * merges every pending update into the tree now
+     */
+    bool Merge();
+
+    /**
+     * order in which Search and SearchTopK expand the tree, depth first by
+     * default; batch and parallel searches always go depth first
+     */
+    void SetSearchOrder(SearchOrder order);
+
 
   private:
+    /**
+     * copies the tree into flat_ after merging every pending update, and
+     * keeps it copied after later merges; called with the lock held
+     */
+    void BuildFlat();
+
+    /**
+     * copies the tree as it is into flat_, encoded by quantizer_ if set
+     */
+    void MakeFlat();
+
+    /**
+     * answers vs from the flat tree, the work done is added to stats
+     */
+    std::vector<std::pair<int, double>> SearchFlat(
+        const std::vector<std::vector<float>>& vs, QueryStats& stats,
+        const Tombstones* skip) const;
+
+    /**
+     * the tree alone, tombstones left out, is searched; results are
+     * (index, inner product) pairs best first
+     * @param budget and exact as for SearchTopK, may be nullptr
+     */
+    std::vector<std::pair<int, double>> SearchTree(
+        const std::vector<float>& v, std::size_t k,
+        const SearchBudget* budget = nullptr, bool* exact = nullptr);
+    std::vector<std::pair<int, double>> SearchBatchTree(
+        const std::vector<std::vector<float>>& vs, const Tombstones* skip);
+
+    /**
+     * SearchBatch without taking the lock
+     */
+    std::vector<int> AnswerBatch(const std::vector<std::vector<float>>& vs);
+
+    /**
+     * the best record of v among tree_result and the pending insertions
+     */
+    int AnswerWithDelta(
+        const std::vector<float>& v, const std::pair<int, double>& tree_result) const;
+
+    const Tombstones* Skip() const {
+        return tombstones_.empty() ? nullptr : &tombstones_;
+    }
+
+    /**
+     * starts merging in the background once enough updates are pending,
+     * called with the lock held
+     */
+    void MaybeStartMerge();
+    void MergeInBackground();
+
+    /**
+     * applies one update of merging_ to the tree
+     * @return false if there was none left
+     */
+    bool MergeStep();
+
+    /**
+     * applies every pending update, called with the lock held
+     */
+    void MergeAll();
+
+    /**
+     * called with the lock held once merging_ has run empty: the index
+     * keeps the next index, and the flat tree is copied again if one is
+     * kept
+     */
+    void FinishMerge();
+
+    void ApplyInsert(Record::Pointer record);
+    void ApplyDelete(const Record& record);
+
+    bool InsertStored(const std::vector<float>& v, int index);
+    bool InsertInMemory(Record::Pointer record);
+
+    /**
+     * replaces the overfull leaf stored at rid by a branch over two leaves,
+     * the first of them takes over the slot of the leaf
+     * @param root whether the leaf is the root, the branch then becomes it
+     * @return rid of the new branch
+     */
+    Rid SplitStoredLeaf(Rid rid, BallTreeLeaf& leaf, bool root);
+
+    /**
+     * @param index of the record to delete, 0 for any record equal to v
+     * that is not tombstoned
+     */
+    bool DeleteStored(const std::vector<float>& v, int index);
+    bool DeleteInMemory(const std::vector<float>& v, int index);
+
+    /**
+     * the record of the tree Delete would remove, nullptr if there is none
+     */
+    Record::Pointer FindInTree(const std::vector<float>& v);
+
+    /**
+     * whether the record is the one DeleteStored or DeleteInMemory look for
+     */
+    bool Matches(int record_index, const float* data,
+                 const std::vector<float>& v, int index) const;
+
+    /**
+     * looks for a record equal to v below rid, only through balls that
+     * contain v
+     * @param path receives the rids from rid down to the leaf holding it
+     * @param position receives its position among the rids of the leaf
+     */
+    bool FindStored(Rid rid, const std::vector<float>& v, int index,
+                    std::vector<Rid>& path, std::size_t& position);
+
+    /**
+     * the leaf of the in-memory tree holding the record, with the slot
+     * owning it and the slot of the branch above it, nullptr if none
+     */
+    struct Found {
+        BallTreeNode::Pointer* slot = nullptr;
+        BallTreeNode::Pointer* parent = nullptr;
+        std::size_t position = 0;
+    };
+    Found FindInMemory(const std::vector<float>& v, int index);
+
+    /**
+     * largest record index in the tree and the delta segments, every record
+     * is read once; only needed for an index that does not keep the next
+     * index
+     */
+    int MaxIndex();
+
+    /**
+     * drops the parallel readers, their counters are kept
+     */
+    void CloseReaders();
+
     std::unique_ptr<RecordStorage> record_storage_;
     std::unique_ptr<NodeStorage> node_storage_;
     std::unique_ptr<BallTreeNode> root_;
+    std::unique_ptr<FlatBallTree> flat_;
+    // set by Flatten, flat_ is copied again after every merge
+    bool keep_flat_ = false;
+    // set by Quantize, kept across the copies of flat_
+    std::shared_ptr<const ProductQuantizer> quantizer_;
     int dim;
+    ThreadPool* pool_ = nullptr;
+    std::size_t parallel_build_cutoff_ = kParallelBuildCutoff;
+    std::size_t parallel_scan_cutoff_ = kParallelScanCutoff;
+    Path index_path_;
+    StorageBackend backend_ = StorageBackend::buffered;
+    BufferPoolConfig pool_config_;
+    std::vector<std::unique_ptr<BallTreeImpl>> readers_;
+    QueryStats query_stats_;
+    // searches of the flat tree by each worker, they share this instance
+    std::vector<QueryStats> worker_query_stats_;
+    // counters of readers closed so far
+    TreeStats closed_reader_stats_;
+    // index of the next record inserted without one, known from the build
+    // or kept by the index; 0 for an index written before it was kept,
+    // until an insertion needs it
+    int next_index_ = 0;
+    // pages changed by a merge since the readers were opened
+    bool changed_ = false;
+    // updates taking new writes, and updates being merged into the tree
+    DeltaSegment delta_;
+    DeltaSegment merging_;
+    // indices of the records of both segments that wait to be deleted
+    Tombstones tombstones_;
+    std::size_t merge_threshold_ = kMergeThreshold;
+    SearchOrder search_order_ = SearchOrder::depth_first;
+    // of the tree built or restored, new nodes get the same bounds
+    NodeBound bound_ = NodeBound::ball;
+    bool merge_running_ = false;
+    std::future<void> merge_;
+    // held by every public call and by each merge step, so that a search
+    // never sees an update half applied
+    mutable std::mutex mutex_;
+    // held by a thread outside the pool while it runs a task of
+    // SearchParallel, they share the last reader
+    std::mutex outside_mutex_;
 };
 
 #endif
\ No newline at end of file
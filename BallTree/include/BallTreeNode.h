@@ -1,13 +1,19 @@
 #ifndef __BALL_TREE_NODE_H
 #define __BALL_TREE_NODE_H
 
+#include <limits>
 #include <memory>
 #include <vector>
 #include "rid.h"
 #include "record.h"
 #include "BallTreeVisitor.h"
+#include "ConeBound.h"
 
 
+// the max_norm of a node whose norms are not known, too large for the
+// bound it gives to prune anything
+constexpr double kUnknownNorm = std::numeric_limits<double>::max();
+
 struct BallTreeNode {
     using Pointer = std::unique_ptr<BallTreeNode>;
 
@@ -16,6 +22,11 @@ struct BallTreeNode {
     std::vector<float> center;
     double radius;
     Rid rid;
+    // smallest and largest norm of the records below, see
+    // IndexFormat::node_norms; kUnknownNorm if the index does not keep them
+    double min_norm = 0, max_norm = kUnknownNorm;
+    // empty unless the tree is built with NodeBound::cone
+    ConeBound cone;
 
     virtual ~BallTreeNode() {}
 
@@ -96,8 +107,40 @@ struct BallTreeLeaf : BallTreeNode {
     }
 
     std::vector<Rid> data;
+    // norms of the records of data, descending; empty when the index does
+    // not keep them
+    std::vector<float> norms;
+    // the records of a leaf in memory; a stored leaf has them, in the order
+    // of data, only if its index carries them, see
+    // IndexFormat::clustered_leaves
     Records raw_data;
 };
 
+/**
+ * a branch or a leaf read in place from a storage page, the pointers are
+ * only valid while the page stays pinned
+ */
+struct NodeView {
+    Rid::DataType type;
+    const float* center;
+    std::size_t center_size;
+    double radius;
+    // branch only
+    Rid left{0, 0}, right{0, 0};
+    // leaf only
+    const Rid* rids;
+    // nullptr unless the index keeps the norms of the records, descending
+    const float* norms;
+    std::size_t rid_size;
+    // nullptr unless the index carries the records in the leaves, the
+    // record of rids[i] is indices[i] with vectors[i * center_size, ...)
+    const int* indices;
+    const float* vectors;
+    // as in BallTreeNode
+    double min_norm, max_norm;
+    // nullptr unless the index keeps cone bounds, see ConeBound
+    const float* axis;
+    double cos_spread, sin_spread;
+};
 
 #endif  // __BALL_TREE_NODE
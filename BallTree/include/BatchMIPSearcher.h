@@ -0,0 +1,86 @@
+#ifndef __BATCH_MIP_SEARCHER_H
+#define __BATCH_MIP_SEARCHER_H
+
+#include <vector>
+#include "storage.h"
+#include "Stats.h"
+#include "BallTreeNode.h"
+
+
+
+/**
+ * searches a block of queries in one traversal
+ *
+ * the block descends the tree together: every node is fetched once per
+ * block, and only the queries whose PossibleMip still beats their current
+ * best inner product follow it into a subtree
+ */
+class BatchMIPSearcher : public BallTreeVisitor {
+    using Needles = std::vector<std::vector<float>>;
+    using QuerySet = std::vector<std::size_t>;
+
+  public:
+    /**
+     * number of queries that descend the tree together
+     */
+    static constexpr std::size_t kBlockSize = 64;
+
+    /**
+     * @param prefetch, skip as for MIPSearcher
+     */
+    BatchMIPSearcher(const Needles& needles, RecordStorage* r_storage,
+        NodeStorage* n_storage, bool prefetch = false,
+        const Tombstones* skip = nullptr);
+
+    virtual void Visit(BallTreeBranch* branch);
+
+    virtual void Visit(BallTreeLeaf* leaf);
+
+    const std::vector<int>& ResultIndices() const {
+        return cur_max_idx_;
+    }
+    const std::vector<double>& ResultMIPs() const {
+        return cur_mip_;
+    }
+
+    /**
+     * nodes once per block, records and pruned subtrees once per query
+     */
+    const QueryStats& Stats() const {
+        return stats_;
+    }
+
+  private:
+    double PossibleMip(std::size_t query, const BallTreeNode& node) const;
+
+    /**
+     * a leaf of quantized records: every active query scores the codes, the
+     * full record is read once for the queries whose estimate may beat
+     * their result, see MIPSearcher::ScoreQuantized
+     */
+    void ScanQuantized(const std::vector<Rid>& rids);
+
+    /**
+     * the queries in active_ that may find a better record in node
+     */
+    QuerySet Filter(const std::vector<double>& possible_mips) const;
+
+    const Needles& needles;
+    std::vector<double> needle_norms;
+    // MIPSearcher::NormBound of every needle
+    std::vector<double> norm_bounds;
+    // MIPSearcher::QuantizationError of every needle
+    std::vector<double> quantization_errors;
+    std::vector<int> cur_max_idx_;
+    std::vector<double> cur_mip_;
+    QuerySet active_;
+    QueryStats stats_;
+    bool prefetch_;
+    const Tombstones* skip_;
+    RecordStorage* record_storage_;
+    NodeStorage* node_storage_;
+};
+
+
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __CONE_BOUND_H
+#define __CONE_BOUND_H
+
+#include <cstddef>
+#include <vector>
+#include "record.h"
+
+/**
+ * which bound the nodes of a tree are pruned by
+ *
+ * ball bounds a node by its center and radius, and by the largest norm
+ * below it. cone keeps, besides, a unit axis and the largest angle between
+ * it and any record below the node; with the range of their norms a
+ * search then prunes by the smallest of the bounds, the cone one being
+ * tighter when the records differ more in direction than in position
+ */
+enum class NodeBound { ball, cone };
+
+/**
+ * the cone of a node, empty, i.e. without an axis, in a ball tree
+ */
+struct ConeBound {
+    // unit length
+    std::vector<float> axis;
+    // cosine and sine of the largest angle between axis and a record
+    double cos_spread = 1, sin_spread = 0;
+
+    /**
+     * the cone around the mean direction of records, which must not be
+     * empty
+     */
+    static ConeBound Of(const std::vector<Record::Pointer>& records);
+
+    bool Empty() const {
+        return axis.empty();
+    }
+
+    /**
+     * widens the cone to hold the direction of v
+     * @return whether it changed
+     */
+    bool Cover(const std::vector<float>& v);
+
+    /**
+     * an upper bound of the inner product of q with any record in the cone
+     * whose norm is between min_norm and max_norm, as the float kernels
+     * compute it, their rounding included
+     */
+    static double Mip(
+        const float* q, double q_norm, const float* axis, std::size_t size,
+        double cos_spread, double sin_spread, double min_norm,
+        double max_norm);
+
+    double Mip(const std::vector<float>& q, double q_norm, double min_norm,
+               double max_norm) const {
+        return Mip(q.data(), q_norm, axis.data(), axis.size(), cos_spread,
+                   sin_spread, min_norm, max_norm);
+    }
+};
+
+#endif  // __CONE_BOUND_H
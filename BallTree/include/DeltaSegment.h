@@ -0,0 +1,70 @@
+#ifndef __DELTA_SEGMENT_H
+#define __DELTA_SEGMENT_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "record.h"
+
+/**
+ * updates of a ball tree that are not merged into it yet
+ *
+ * inserted records are kept in memory and scanned by brute force; records
+ * deleted from the tree are kept as tombstones, with their data so that a
+ * merge can find them in the tree, and searches of the tree leave them out
+ */
+class DeltaSegment {
+    using Records = std::vector<Record::Pointer>;
+
+  public:
+    // (record index, inner product), best first
+    using Results = std::vector<std::pair<int, double>>;
+
+    void Insert(Record::Pointer record) {
+        inserted_.push_back(std::move(record));
+    }
+
+    /**
+     * drops one inserted record equal to v
+     * @return false if there is none
+     */
+    bool EraseInserted(const std::vector<float>& v);
+
+    /**
+     * record is stored in the tree and has to be deleted from it
+     */
+    void Delete(Record::Pointer record) {
+        deleted_.push_back(std::move(record));
+    }
+
+    /**
+     * offers the inserted records to results, which stays sorted best first
+     * and at most k long
+     */
+    void Scan(const std::vector<float>& v, std::size_t k,
+              Results& results) const;
+
+    std::size_t Size() const {
+        return inserted_.size() + deleted_.size();
+    }
+
+    bool Empty() const {
+        return Size() == 0;
+    }
+
+    /**
+     * the updates in the order a merge takes them, from the back
+     */
+    Records& Inserted() {
+        return inserted_;
+    }
+    Records& Deleted() {
+        return deleted_;
+    }
+
+  private:
+    Records inserted_;
+    Records deleted_;
+};
+
+#endif  // __DELTA_SEGMENT_H
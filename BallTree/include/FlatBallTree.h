@@ -0,0 +1,189 @@
+#ifndef __FLAT_BALL_TREE_H
+#define __FLAT_BALL_TREE_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include "BallTreeNode.h"
+#include "ProductQuantizer.h"
+#include "SearchBudget.h"
+#include "storage.h"
+#include "Stats.h"
+
+/**
+ * allocator handing out Alignment-byte aligned blocks
+ */
+template <typename T, std::size_t Alignment>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(std::size_t n) {
+        void* p = nullptr;
+        if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, std::size_t) {
+        std::free(p);
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const {
+        return false;
+    }
+};
+
+/**
+ * the whole ball tree in three flat arrays
+ *
+ * node headers are laid out in DFS pre-order, so a branch's left child is
+ * the next header. Centers live in one 64-byte aligned matrix, one row per
+ * node, and the records of every leaf are stored contiguously, in leaf
+ * order, in a second matrix with the same row stride. The records of a
+ * leaf are sorted by descending norm. The cones of a tree built with
+ * NodeBound::cone are kept in a third matrix of axes and an array of their
+ * spreads, both by node.
+ */
+class FlatBallTree {
+  public:
+    static constexpr std::size_t kAlignment = 64;
+
+    struct Node {
+        double radius;
+        double max_norm;  // as in BallTreeNode
+        std::int32_t left, right;  // child node indices, -1 for leaves
+        std::int32_t first, last;  // record range of a leaf
+    };
+
+    /**
+     * the scalars of a ConeBound and the smallest norm below its node, only
+     * the cone needs it; the axis is a row of axes_
+     */
+    struct Cone {
+        double cos_spread, sin_spread, min_norm;
+    };
+
+    /**
+     * flattens the tree rooted at root, children and records not held in
+     * memory are fetched from the storages
+     */
+    FlatBallTree(
+        BallTreeNode& root, int dimension, NodeStorage* n_storage = nullptr,
+        RecordStorage* r_storage = nullptr);
+
+    /**
+     * @param stats receives the nodes and records touched, may be nullptr
+     * @param skip records left out of the results, may be nullptr
+     */
+    std::pair<int, double> Search(
+        const std::vector<float>& v, QueryStats* stats = nullptr,
+        const Tombstones* skip = nullptr) const;
+
+    /**
+     * @param budget work after which the search stops early, may be nullptr
+     * @param exact receives MIPSearcher::Exact of the search, may be nullptr
+     */
+    std::vector<std::pair<int, double>> SearchTopK(
+        const std::vector<float>& v, std::size_t k,
+        QueryStats* stats = nullptr, const Tombstones* skip = nullptr,
+        const SearchBudget* budget = nullptr, bool* exact = nullptr,
+        SearchOrder order = SearchOrder::depth_first) const;
+
+    /**
+     * trains a ProductQuantizer on the records of the tree and encodes
+     * them, leaf by leaf in the order of the records
+     * @param subspaces as for ProductQuantizer
+     */
+    void Quantize(int subspaces = 0);
+
+    /**
+     * encodes the records with a quantizer trained before, e.g. on an
+     * earlier copy of the same tree
+     */
+    void Quantize(std::shared_ptr<const ProductQuantizer> quantizer);
+
+    bool Quantized() const {
+        return quantizer_ != nullptr;
+    }
+
+    /**
+     * nullptr until Quantize; may be shared with a later copy of the tree
+     */
+    std::shared_ptr<const ProductQuantizer> Quantizer() const {
+        return quantizer_;
+    }
+
+    /**
+     * candidates kept per result by default, see SearchApproximate
+     */
+    static constexpr std::size_t kCandidatesPerResult = 4;
+
+    /**
+     * SearchTopK with the records scored from the lookup table of v instead
+     * of with full inner products; branches are still pruned by their balls
+     * but against the estimates. The best candidates by estimate are scored
+     * again with full inner products, so the answer may miss the best
+     * records but the inner products returned are exact.
+     * @param candidates records re-ranked, at least k; 0 for
+     * kCandidatesPerResult * k
+     */
+    std::vector<std::pair<int, double>> SearchApproximate(
+        const std::vector<float>& v, std::size_t k, std::size_t candidates = 0,
+        QueryStats* stats = nullptr, const Tombstones* skip = nullptr) const;
+
+    std::size_t NodeCount() const {
+        return nodes_.size();
+    }
+
+    const float* Center(std::size_t node) const {
+        return centers_.data() + node * stride_;
+    }
+
+    const float* RecordData(std::size_t record) const {
+        return records_.data() + record * stride_;
+    }
+
+    bool HasCones() const {
+        return not cones_.empty();
+    }
+
+  private:
+    using Matrix = std::vector<float, AlignedAllocator<float, kAlignment>>;
+    class Builder;
+    class Searcher;
+
+    int dimension_;
+    std::size_t stride_;
+    std::vector<Node> nodes_;
+    Matrix centers_;
+    Matrix records_;
+    // empty unless the tree has cones
+    Matrix axes_;
+    std::vector<Cone> cones_;
+    std::vector<int> indices_;
+    // norms of the records, by row
+    std::vector<float> norms_;
+    // nullptr until Quantize, then the codes of record i start at
+    // i * quantizer_->CodeSize()
+    std::shared_ptr<const ProductQuantizer> quantizer_;
+    std::vector<std::uint8_t> codes_;
+};
+
+#endif  // __FLAT_BALL_TREE_H
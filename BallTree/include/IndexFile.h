@@ -0,0 +1,211 @@
+#ifndef __INDEX_FILE_H
+#define __INDEX_FILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "rid.h"
+#include "Utility.h"
+
+/**
+ * how an index is laid out on disk, chosen when the tree is stored and read
+ * back from the index when it is restored
+ */
+struct IndexFormat {
+    /**
+     * every leaf slot carries the vectors and indexes of its records next to
+     * their rids, a search scores a leaf from the leaf page alone and reads
+     * no record page. Leaf slots grow by N0 records, at 64k pages a leaf
+     * over more than about 740 dimensions does not fit and StoreTree fails;
+     * the record pages are still written, deletes and Find read them. With
+     * quantized_records as well the leaves are scored from these exact
+     * vectors, the int8 copies are not read by searches
+     */
+    bool clustered_leaves = false;
+
+    /**
+     * keep every page of the index in one IndexFile instead of one file per
+     * page plus root, dimension.bin and *.index
+     */
+    bool single_file = false;
+
+    /**
+     * lay branches out in blocks of the top levels of a subtree, one block
+     * per page, so that a root to leaf descent touches O(log_B n) branch
+     * pages instead of up to one per level; only a bulk store of a freshly
+     * built tree applies it and readers do not need to know about it
+     */
+    bool clustered_subtrees = false;
+
+    /**
+     * leaves point at int8 copies of the records, QuantizedRecord, that
+     * take about a quarter of the bytes; the full records are kept in pages
+     * of their own and only read to re-rank the records whose estimate may
+     * beat the result, so the answers stay exact
+     */
+    bool quantized_records = false;
+
+    /**
+     * keep the records of every leaf sorted by descending norm, with the
+     * norms stored next to the rids; a leaf scan stops at the first record
+     * whose norm times the norm of the query can not beat the result. Leaf
+     * slots grow by N0 floats, indexes written before the flag existed read
+     * back without it
+     */
+    bool norm_sorted_leaves = true;
+
+    /**
+     * every branch and leaf keeps the smallest and largest norm of the
+     * records below it; a search prunes a node whose max norm times the
+     * norm of the query can not beat the result, even if its ball could.
+     * Leaves then keep the norms of their records as well, indexes written
+     * before the flag existed read back without it
+     */
+    bool node_norms = true;
+
+    /**
+     * every branch and leaf keeps a ConeBound next to its ball, see
+     * NodeBound::cone; nodes then keep their norms as well. Set by
+     * BallTreeImpl::StoreTree from the bound the tree was built with
+     */
+    bool cone_bounds = false;
+};
+
+/**
+ * one file holding every page of an index, read and written with
+ * pread/pwrite through a descriptor kept open for the life of the object
+ *
+ * +--------+--------+--------+-----+-----------------+
+ * | header | page 0 | page 1 | ... | page directory  |
+ * +--------+--------+--------+-----+-----------------+
+ *
+ * the header takes one page, page p of the file starts at (p + 1) *
+ * page_size; record, branch, leaf and quantized record pages share the file
+ * and the directory maps the page_id of each storage to its page of the
+ * file, followed by the free-space map holding the number of free slots of
+ * every page
+ */
+class IndexFile {
+  public:
+    static constexpr const char* kFileName = "index.bin";
+
+    static bool Exists(const Path& dest_dir);
+
+    /**
+     * @param create truncates and starts a new index instead of opening the
+     * existing one
+     */
+    IndexFile(const Path& dest_dir, std::size_t page_size, bool create);
+    IndexFile(const IndexFile&) = delete;
+    IndexFile& operator=(const IndexFile&) = delete;
+
+    /**
+     * writes the header and the directory back when they have changed
+     */
+    ~IndexFile();
+
+    bool IsOpen() const {
+        return fd != -1;
+    }
+
+    int PageCount(Rid::DataType type) const {
+        return directory[type].size();
+    }
+
+    /**
+     * adds a page to the storage of type
+     * @return the page_id of the new page in that storage
+     */
+    int AllocatePage(Rid::DataType type);
+
+    /**
+     * @return byte offset of the page in the file
+     */
+    std::int64_t PageOffset(Rid::DataType type, int page_id) const {
+        return (directory[type][page_id] + 1) * static_cast<std::int64_t>(page_size);
+    }
+
+    bool ReadPage(Rid::DataType type, int page_id, Byte* buffer) const;
+    bool WritePage(Rid::DataType type, int page_id, const Byte* buffer);
+
+    /**
+     * writes count pages of type from buffer with one pwrite, the pages have
+     * to be consecutive in the file as well, e.g. allocated one after another
+     */
+    bool WritePages(
+        Rid::DataType type, int first_page_id, std::size_t count,
+        const Byte* buffer);
+
+    /**
+     * starts reading the page into the page cache in the background, a
+     * later ReadPage of it does not wait on the disk
+     */
+    void Prefetch(Rid::DataType type, int page_id) const;
+
+    std::size_t PageSize() const { return page_size; }
+
+    int GetDimension() const { return header.dimension; }
+    void SetDimension(int dimension);
+
+    Rid GetRoot() const { return header.root; }
+    void SetRoot(const Rid& root);
+
+    IndexFormat GetFormat() const;
+    void SetFormat(const IndexFormat& format);
+
+    /**
+     * the index an insertion without one gets next
+     */
+    int GetNextIndex() const { return header.next_index; }
+    void SetNextIndex(int index);
+
+    /**
+     * free slots of every page of the storage of type, by page_id
+     */
+    const std::vector<std::int32_t>& GetFreeSlots(Rid::DataType type) const {
+        return free_slots[type];
+    }
+    void SetFreeSlots(
+        Rid::DataType type, const std::vector<std::int32_t>& free);
+
+    /**
+     * writes the header, the directory and the free-space map out now when
+     * they have changed, instead of when the file is closed
+     * @return false if a write failed, the next Flush tries again
+     */
+    bool Flush();
+
+  private:
+    struct Header {
+        char magic[8] = {'B', 'T', 'I', 'N', 'D', 'E', 'X', '\0'};
+        // a file of another version is not read
+        std::uint32_t version = 1;
+        std::uint32_t page_size = 0;
+        std::int32_t dimension = -1;
+        Rid root{0, 0};
+        // pages of the whole file, the directory follows the last one
+        std::int32_t file_page_num = 0;
+        std::int64_t directory_offset = 0;
+        std::int32_t next_index = 0;
+        std::uint8_t clustered_leaves = 0;
+        std::uint8_t quantized_records = 0;
+        std::uint8_t norm_sorted_leaves = 0;
+        std::uint8_t cone_bounds = 0;
+        std::uint8_t node_norms = 0;
+    };
+
+    // record, branch, leaf and quantized, indexed by Rid::DataType
+    static constexpr int kStorageNum = 4;
+
+    bool ReadHeader();
+    bool WriteHeader();
+
+    int fd = -1;
+    std::size_t page_size;
+    bool changed = false;
+    Header header;
+    std::vector<std::int32_t> directory[kStorageNum];
+    std::vector<std::int32_t> free_slots[kStorageNum];
+};
+
+#endif
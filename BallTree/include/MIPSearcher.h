@@ -1,19 +1,48 @@
 #ifndef __MIP_SEARCHER_H
 #define __MIP_SEARCHER_H
 
+#include <functional>
+#include <queue>
+#include <utility>
 #include <vector>
 #include "storage.h"
+#include "Stats.h"
 #include "BallTreeNode.h"
+#include "SearchBudget.h"
 
 
 
 
 class MIPSearcher : public BallTreeVisitor {
+    // (inner product, record index), ordered so that the worst candidate
+    // sits on top of the heap
+    using Candidate = std::pair<double, int>;
+    using CandidateHeap = std::priority_queue<
+        Candidate, std::vector<Candidate>, std::greater<Candidate>>;
+
   public:
+    /**
+     * @param k number of records to keep, the searcher prunes every subtree
+     * that can not beat the k-th best inner product found so far
+     * @param prefetch start reading both children of a branch and the
+     * record pages of a leaf before waiting for any of them
+     * @param skip records left out of the results, may be nullptr
+     * @param budget work after which the search stops early, nullptr for
+     * none; the searcher keeps its own copy
+     * @param order order in which the nodes are expanded, the results do
+     * not depend on it unless the budget stops the search
+     */
     MIPSearcher(const std::vector<float>& v, RecordStorage* r_storage,
-        NodeStorage* n_storage)
-        : needle(v), needle_norm(Norm(needle)), record_storage_(r_storage),
-          node_storage_(n_storage) {}
+        NodeStorage* n_storage, std::size_t k = 1, bool prefetch = false,
+        const Tombstones* skip = nullptr,
+        const SearchBudget* budget = nullptr,
+        SearchOrder order = SearchOrder::depth_first)
+        : needle(v), needle_norm(Norm(needle)), norm_bound_(NormBound(needle)),
+          quantization_error_(QuantizationError(needle)), k_(k),
+          prefetch_(prefetch), skip_(skip), order_(order),
+          budgeted_(budget and not budget->Unlimited()),
+          budget_(budget ? *budget : SearchBudget()),
+          record_storage_(r_storage), node_storage_(n_storage) {}
 
     virtual void Visit(BallTreeBranch* branch);
 
@@ -26,17 +55,124 @@ class MIPSearcher : public BallTreeVisitor {
         return cur_mip_;
     }
 
+    /**
+     * @return at most k (record index, inner product) pairs, best first
+     */
+    std::vector<std::pair<int, double>> Results() const;
+
+    /**
+     * false if the budget stopped the search or its slack pruned a subtree
+     * the exact bound would have visited, the results may then miss better
+     * records
+     */
+    bool Exact() const {
+        return exact_;
+    }
+
+    /**
+     * nodes and records this searcher has touched, queries is left 0
+     */
+    const QueryStats& Stats() const {
+        return stats_;
+    }
+
+    /**
+     * how far the inner product of v with the codes of a QuantizedRecord,
+     * times its scale, may be from the one with the full record, per unit of
+     * scale: every component is off by at most scale / 2, and both float
+     * sums round by at most n * epsilon of the sum of absolute products
+     */
+    static double QuantizationError(const std::vector<float>& v);
+
+    /**
+     * a bound on the inner product of v with a record of norm 1 as the float
+     * kernels compute it, Cauchy-Schwarz widened by their rounding and that
+     * of the stored norm
+     */
+    static double NormBound(const std::vector<float>& v);
+
   private:
-    double PossibleMip(const std::unique_ptr<BallTreeNode> node);
+    /**
+     * descends into the children worth visiting, best bound first; nodes and
+     * records are read through pinned views, nothing is allocated per node
+     */
+    void VisitChildren(Rid r_left, Rid r_right);
+
+    void VisitNode(Rid rid);
+
+    /**
+     * SearchOrder::best_first below a branch with children r_left and
+     * r_right; a node is viewed once to bound it and once to expand it, no
+     * pin is held across iterations
+     */
+    void VisitBestFirst(Rid r_left, Rid r_right);
+
+    /**
+     * @param norms norms of the records, descending, or nullptr if the
+     * records are in no particular order; the scan stops at the first
+     * record whose norm can not beat the threshold
+     * @param indices, vectors the records of the rids carried by the leaf,
+     * see NodeView, or nullptr to read them from the record storage
+     */
+    void ScanRecords(const Rid* rids, const float* norms, std::size_t size,
+                     const int* indices = nullptr,
+                     const float* vectors = nullptr);
+
+    /**
+     * offers the record index with vector data unless it is skipped or can
+     * not beat the threshold
+     */
+    void Score(int index, const float* data);
+
+    /**
+     * scores the int8 codes of rid and, only if the estimate may beat the
+     * threshold, the full record
+     */
+    void ScoreQuantized(const Rid& rid);
+
+    /**
+     * the ball bound of the node, or the cone bound if the node has a cone
+     * and it is smaller
+     */
+    double PossibleMip(const NodeView& node) const;
+
+    /**
+     * the inner product a subtree has to exceed to be worth visiting
+     */
+    double Threshold() const;
+
+    /**
+     * whether a subtree bounded by possible_mip is visited, with the slack
+     * of the budget applied
+     */
+    bool WorthVisiting(double possible_mip);
+
+    /**
+     * whether the budget is spent, no more nodes are entered once it is
+     */
+    bool OutOfBudget();
+
+    void Offer(int index, double innerproduct);
 
     const std::vector<float>& needle;
     const double needle_norm;
+    const double norm_bound_;
+    const double quantization_error_;
+    const std::size_t k_;
+    const bool prefetch_;
+    const Tombstones* skip_;
+    const SearchOrder order_;
+    const bool budgeted_;
+    const SearchBudget budget_;
+    bool exact_ = true;
     int cur_max_idx_ = -1;
     double cur_mip_ = 0;
+    CandidateHeap top_k_;
+    QueryStats stats_;
     RecordStorage* record_storage_;
     NodeStorage* node_storage_;
 };
 
 
 
-#endif
\ No newline at end of file
+#endif
@@ -30,4 +30,58 @@ class NodeStorer : public BallTreeVisitor {
     RecordStorage* record_storage_;
 };
 
+/**
+ * stores a freshly built tree in one sequential pass
+ *
+ * every slot size is known from the dimension, so records, leaves and
+ * branches are packed into full pages and streamed out through PageStreams,
+ * in the order NodeStorer would Put them or, with clustered_subtrees, block
+ * by block; the index reads back exactly like one written by NodeStorer
+ */
+class BulkStorer : public BallTreeVisitor {
+    using RecordStream = PageStream<64, Rid::record>;
+    using BranchStream = PageStream<64, Rid::branch>;
+    using LeafStream = PageStream<64, Rid::leaf>;
+    using QuantizedStream = PageStream<64, Rid::quantized>;
+
+  public:
+    /**
+     * writes a one-file-per-page index into dest_dir, or every page into
+     * file when it is given
+     */
+    BulkStorer(const Path& dest_dir, int dimension, const IndexFormat& format,
+               std::shared_ptr<IndexFile> file = nullptr);
+
+    virtual void Visit(BallTreeBranch* branch);
+
+    virtual void Visit(BallTreeLeaf* leaf);
+
+    /**
+     * writes the whole tree, its last pages and the root
+     * @param next_index see NodeStorage::GetNextIndex
+     */
+    void Store(BallTreeNode& root, int next_index);
+
+  private:
+    /**
+     * cuts the branches into blocks of at most one page each, breadth first
+     * inside a block and depth first from block to block; leaves and
+     * records keep the depth first order a search scans them in
+     */
+    void StoreBlocked(BallTreeBranch& root);
+
+    void StoreRecords(BallTreeLeaf& leaf);
+
+    Path dest_dir_;
+    int dimension_;
+    IndexFormat format_;
+    // declared before the streams so that they flush into it first
+    std::shared_ptr<IndexFile> file_;
+    std::unique_ptr<RecordStream> records_;
+    std::unique_ptr<BranchStream> branches_;
+    std::unique_ptr<LeafStream> leaves_;
+    // nullptr unless format_.quantized_records
+    std::unique_ptr<QuantizedStream> quantized_;
+};
+
 #endif
\ No newline at end of file
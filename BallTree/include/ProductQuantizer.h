@@ -0,0 +1,107 @@
+#ifndef __PRODUCT_QUANTIZER_H
+#define __PRODUCT_QUANTIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * product quantization of vectors for approximate inner products
+ *
+ * the dimensions are cut into subspaces of nearly equal width and each
+ * subspace gets a codebook of kCentroids centroids, trained by k-means; a
+ * vector is stored as the centroid it is closest to in every subspace, one
+ * byte per subspace. A query computes its inner product with every
+ * centroid once, after that scoring a vector costs one table lookup per
+ * subspace instead of one multiply-add per dimension.
+ */
+class ProductQuantizer {
+  public:
+    static constexpr int kCentroids = 256;
+    // dimensions of a subspace unless the number of subspaces is given
+    static constexpr int kSubspaceWidth = 4;
+    // rows k-means is run on at most, evenly spread over the data
+    static constexpr std::size_t kTrainingSample = 8192;
+    static constexpr int kIterations = 8;
+
+    /**
+     * @param subspaces 0 for one subspace per kSubspaceWidth dimensions
+     */
+    ProductQuantizer(int dimension, int subspaces = 0);
+
+    /**
+     * trains the codebooks on n rows, row i starts at rows + i * stride
+     */
+    void Train(const float* rows, std::size_t n, std::size_t stride);
+
+    int Subspaces() const {
+        return subspaces_;
+    }
+
+    /**
+     * bytes of the codes of one vector
+     */
+    std::size_t CodeSize() const {
+        return subspaces_;
+    }
+
+    void Encode(const float* v, std::uint8_t* codes) const;
+
+    /**
+     * floats of the table of one query
+     */
+    std::size_t TableSize() const {
+        return static_cast<std::size_t>(subspaces_) * kCentroids;
+    }
+
+    /**
+     * table[m * kCentroids + c]: inner product of the part of v in subspace
+     * m with centroid c of it
+     */
+    void Table(const float* v, float* table) const;
+
+    /**
+     * the inner product of the query of table with the vector of codes,
+     * approximately
+     */
+    float Score(const float* table, const std::uint8_t* codes) const {
+        // four sums so that the lookups do not wait on each other's adds
+        float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+        int m = 0;
+        for (; m + 4 <= subspaces_; m += 4, table += 4 * kCentroids) {
+            sum0 += table[codes[m]];
+            sum1 += table[kCentroids + codes[m + 1]];
+            sum2 += table[2 * kCentroids + codes[m + 2]];
+            sum3 += table[3 * kCentroids + codes[m + 3]];
+        }
+        for (; m < subspaces_; ++m, table += kCentroids) {
+            sum0 += table[codes[m]];
+        }
+        return (sum0 + sum1) + (sum2 + sum3);
+    }
+
+  private:
+    /**
+     * first dimension of subspace m, Begin(subspaces_) == dimension_
+     */
+    int Begin(int m) const {
+        return dimension_ * m / subspaces_;
+    }
+
+    /**
+     * centroid c of subspace m, Begin(m + 1) - Begin(m) floats
+     */
+    const float* Centroid(int m, int c) const {
+        return centroids_.data() +
+               Begin(m) * kCentroids + c * (Begin(m + 1) - Begin(m));
+    }
+
+    int Nearest(int m, const float* sub) const;
+
+    int dimension_;
+    int subspaces_;
+    // the codebook of subspace m starts at Begin(m) * kCentroids
+    std::vector<float> centroids_;
+};
+
+#endif  // __PRODUCT_QUANTIZER_H
@@ -0,0 +1,104 @@
+#ifndef __REPLACER_H
+#define __REPLACER_H
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <vector>
+
+/**
+ * which frame a buffer pool gives up when it needs room for another page
+ */
+enum class ReplacementPolicy {
+    // second chance sweep over reference bits
+    clock,
+    // least recently used
+    lru,
+    // pages seen once wait in a FIFO and are evicted before pages that have
+    // been hit again, so one pass over the records can not flush the tree
+    two_queue,
+};
+
+/**
+ * replacement policy of one buffer pool, frames are identified by index
+ */
+class Replacer {
+  public:
+    /**
+     * @param frame_num at least 1
+     */
+    static std::unique_ptr<Replacer> Create(
+        ReplacementPolicy policy, std::size_t frame_num);
+
+    virtual ~Replacer() {}
+
+    /**
+     * a new page was loaded into frame_id
+     */
+    virtual void Insert(std::size_t frame_id) = 0;
+
+    /**
+     * the page in frame_id was accessed again
+     */
+    virtual void Touch(std::size_t frame_id) = 0;
+
+    /**
+     * @param pin_count frames with a pin count above 0 are not evicted
+     * @return the frame to evict, -1 if every frame is pinned
+     */
+    virtual int Victim(const std::vector<int>& pin_count) = 0;
+};
+
+class ClockReplacer : public Replacer {
+  public:
+    explicit ClockReplacer(std::size_t frame_num)
+        : is_referenced(frame_num, false) {}
+    virtual void Insert(std::size_t frame_id) override;
+    virtual void Touch(std::size_t frame_id) override;
+    virtual int Victim(const std::vector<int>& pin_count) override;
+
+  private:
+    std::vector<bool> is_referenced;
+    std::size_t clock_hand = 0;
+};
+
+class LruReplacer : public Replacer {
+  public:
+    explicit LruReplacer(std::size_t frame_num)
+        : positions(frame_num), in_list(frame_num, false) {}
+    virtual void Insert(std::size_t frame_id) override;
+    virtual void Touch(std::size_t frame_id) override;
+    virtual int Victim(const std::vector<int>& pin_count) override;
+
+    /**
+     * forgets frame_id, it is no longer a candidate
+     */
+    void Erase(std::size_t frame_id);
+
+    bool Contains(std::size_t frame_id) const {
+        return in_list[frame_id];
+    }
+
+  private:
+    // most recently used first
+    std::list<std::size_t> order;
+    std::vector<std::list<std::size_t>::iterator> positions;
+    std::vector<bool> in_list;
+};
+
+class TwoQueueReplacer : public Replacer {
+  public:
+    explicit TwoQueueReplacer(std::size_t frame_num)
+        : once(frame_num), again(frame_num) {}
+    virtual void Insert(std::size_t frame_id) override;
+    virtual void Touch(std::size_t frame_id) override;
+    virtual int Victim(const std::vector<int>& pin_count) override;
+
+  private:
+    // FIFO of pages hit once, its order is never refreshed
+    LruReplacer once;
+    // LRU of pages hit more than once
+    LruReplacer again;
+};
+
+#endif
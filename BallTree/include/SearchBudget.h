@@ -0,0 +1,78 @@
+#ifndef __SEARCH_BUDGET_H
+#define __SEARCH_BUDGET_H
+
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include "Stats.h"
+
+/**
+ * the order in which a search expands the nodes whose bound beats the
+ * current threshold
+ *
+ * depth_first descends into the better child of every branch first and
+ * keeps no state besides the recursion; best_first keeps every bounded node
+ * not yet expanded in one max-heap and always expands the best of them, so
+ * that good records are found, and the threshold raised, before weaker
+ * subtrees are entered; it stops once the best bound left can not beat it
+ */
+enum class SearchOrder { depth_first, best_first };
+
+/**
+ * how much work a search may do before it stops and returns the best
+ * records found so far; the default budget is unlimited and exact
+ *
+ * the limits are checked before every node is entered, so a leaf is
+ * always scanned whole and max_records may be overshot by one leaf
+ */
+struct SearchBudget {
+    using Clock = std::chrono::steady_clock;
+
+    // leaves scanned at most, 0 for no limit
+    std::size_t max_leaves = 0;
+    // inner products computed against records at most, 0 for no limit
+    std::size_t max_records = 0;
+    // time after which no node is entered any more
+    Clock::time_point deadline = Clock::time_point::max();
+    /**
+     * a subtree is pruned unless its bound beats the threshold t by more
+     * than slack * |t|, so with positive inner products every result is at
+     * least 1 / (1 + slack) of the one an exact search returns
+     */
+    double slack = 0;
+
+    /**
+     * the budget of a search that should be done within duration from now
+     */
+    template <typename Duration>
+    static SearchBudget Within(Duration duration) {
+        SearchBudget ret;
+        ret.deadline = Clock::now() + duration;
+        return ret;
+    }
+
+    bool Unlimited() const {
+        return max_leaves == 0 and max_records == 0 and
+               deadline == Clock::time_point::max() and slack == 0;
+    }
+
+    /**
+     * whether a search that has done the work of spent has to stop
+     */
+    bool Exhausted(const QueryStats& spent) const {
+        return (max_leaves != 0 and spent.leaves_scanned >= max_leaves) or
+               (max_records != 0 and spent.records_scored >= max_records) or
+               (deadline != Clock::time_point::max() and
+                Clock::now() >= deadline);
+    }
+
+    /**
+     * the threshold a bound has to beat with the slack applied, threshold
+     * unchanged while it is still lowest(), i.e. no result is known
+     */
+    double Relax(double threshold, bool known) const {
+        return known ? threshold + slack * std::abs(threshold) : threshold;
+    }
+};
+
+#endif  // __SEARCH_BUDGET_H
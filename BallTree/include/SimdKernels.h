@@ -0,0 +1,54 @@
+#ifndef __SIMD_KERNELS_H
+#define __SIMD_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * float kernels for the inner loops of search and build
+ *
+ * every kernel exists in a scalar, SSE, AVX2 and AVX-512 flavour; the best
+ * one the CPU supports is picked once, on first use, from CPUID
+ */
+namespace kernels {
+
+enum class Isa { scalar, sse, avx2, avx512 };
+
+struct KernelSet {
+    Isa isa;
+    const char* name;
+    float (*dot)(const float* a, const float* b, std::size_t n);
+    float (*squared_l2)(const float* a, const float* b, std::size_t n);
+    // a against int8 codes, see QuantizedRecord
+    float (*dot_int8)(const float* a, const std::int8_t* b, std::size_t n);
+};
+
+/**
+ * @return the kernels of isa, nullptr when this CPU can not run them
+ */
+const KernelSet* Select(Isa isa);
+
+/**
+ * the kernels every call below dispatches to
+ */
+const KernelSet& Active();
+
+inline float Dot(const float* a, const float* b, std::size_t n) {
+    return Active().dot(a, b, n);
+}
+
+inline float DotInt8(const float* a, const std::int8_t* b, std::size_t n) {
+    return Active().dot_int8(a, b, n);
+}
+
+inline float SquaredL2(const float* a, const float* b, std::size_t n) {
+    return Active().squared_l2(a, b, n);
+}
+
+inline float SquaredNorm(const float* a, std::size_t n) {
+    return Active().dot(a, a, n);
+}
+
+}  // namespace kernels
+
+#endif  // __SIMD_KERNELS_H
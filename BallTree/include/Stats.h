@@ -0,0 +1,84 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <cstddef>
+#include "storage.h"
+
+/**
+ * work done by searches, summed over every query answered
+ *
+ * a batch search counts a branch or leaf once per block of queries and a
+ * record or pruned subtree once per query
+ */
+struct QueryStats {
+    std::size_t queries = 0;
+    // branches whose children were bounded
+    std::size_t branches_visited = 0;
+    std::size_t leaves_scanned = 0;
+    // inner products computed against records
+    std::size_t records_scored = 0;
+    // quantized records whose estimate could beat the result, so that the
+    // full record was read to score them exactly
+    std::size_t records_reranked = 0;
+    // children skipped because their PossibleMip could not beat the result
+    std::size_t subtrees_pruned = 0;
+
+    QueryStats& operator+=(const QueryStats& other) {
+        queries += other.queries;
+        branches_visited += other.branches_visited;
+        leaves_scanned += other.leaves_scanned;
+        records_scored += other.records_scored;
+        records_reranked += other.records_reranked;
+        subtrees_pruned += other.subtrees_pruned;
+        return *this;
+    }
+
+    QueryStats& operator-=(const QueryStats& other) {
+        queries -= other.queries;
+        branches_visited -= other.branches_visited;
+        leaves_scanned -= other.leaves_scanned;
+        records_scored -= other.records_scored;
+        records_reranked -= other.records_reranked;
+        subtrees_pruned -= other.subtrees_pruned;
+        return *this;
+    }
+};
+
+/**
+ * snapshot of the counters of a tree, subtract an earlier snapshot to get
+ * the work of the searches in between
+ */
+struct TreeStats {
+    PoolStats record;
+    PoolStats branch;
+    PoolStats leaf;
+    QueryStats query;
+
+    /**
+     * the three buffer pools together
+     */
+    PoolStats Pools() const {
+        PoolStats ret(record);
+        ret += branch;
+        ret += leaf;
+        return ret;
+    }
+
+    TreeStats& operator+=(const TreeStats& other) {
+        record += other.record;
+        branch += other.branch;
+        leaf += other.leaf;
+        query += other.query;
+        return *this;
+    }
+
+    TreeStats& operator-=(const TreeStats& other) {
+        record -= other.record;
+        branch -= other.branch;
+        leaf -= other.leaf;
+        query -= other.query;
+        return *this;
+    }
+};
+
+#endif  // __STATS_H
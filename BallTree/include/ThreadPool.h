@@ -0,0 +1,113 @@
+#ifndef __THREAD_POOL_H
+#define __THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/**
+ * fixed size thread pool with one task deque per worker
+ *
+ * a worker pushes and pops its own tasks at the back of its deque, and
+ * steals from the front of the others' when its own runs dry. Tasks
+ * submitted from outside the pool are dealt round robin.
+ */
+class ThreadPool {
+    using Task = std::function<void()>;
+
+  public:
+    explicit ThreadPool(
+        std::size_t threads = std::thread::hardware_concurrency());
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool();
+
+    template <typename F>
+    std::future<typename std::result_of<F()>::type> Submit(F f) {
+        using Ret = typename std::result_of<F()>::type;
+        auto task = std::make_shared<std::packaged_task<Ret()>>(std::move(f));
+        auto ret = task->get_future();
+        Push([task] { (*task)(); });
+        return ret;
+    }
+
+    /**
+     * waits for future, running queued tasks meanwhile so that a task may
+     * wait for the subtasks it submitted without starving the pool
+     */
+    template <typename T>
+    T Join(std::future<T>& future) {
+        while (future.wait_for(std::chrono::seconds(0)) !=
+               std::future_status::ready) {
+            if (not TryRunOne()) {
+                std::this_thread::yield();
+            }
+        }
+        return future.get();
+    }
+
+    /**
+     * calls f(first, last) on consecutive chunks of [begin, end) of at most
+     * grain elements, the chunks run on the pool and the caller joins them
+     */
+    template <typename F>
+    void ParallelFor(std::size_t begin, std::size_t end, std::size_t grain,
+                     const F& f) {
+        std::vector<std::future<void>> chunks;
+        for (std::size_t first = begin; first < end; first += grain) {
+            std::size_t last = std::min(first + grain, end);
+            chunks.push_back(Submit([&f, first, last] { f(first, last); }));
+        }
+        for (auto& chunk : chunks) {
+            Join(chunk);
+        }
+    }
+
+    std::size_t Size() const {
+        return queues_.size();
+    }
+
+    /**
+     * @return index of the worker running the calling thread, -1 if the
+     * calling thread does not belong to this pool
+     */
+    int WorkerIndex() const;
+
+  private:
+    struct TaskQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void Push(Task task);
+
+    bool Pop(std::size_t index, Task& task);
+
+    bool Steal(std::size_t thief, Task& task);
+
+    bool TryRunOne();
+
+    void Work(std::size_t index);
+
+    std::vector<std::unique_ptr<TaskQueue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<std::size_t> next_queue_{0};
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_up_;
+    std::size_t pending_ = 0;
+    bool stop_ = false;
+};
+
+#endif  // __THREAD_POOL_H
@@ -9,6 +9,7 @@
 #include <numeric>
 #include <string>
 #include <type_traits>
+#include "SimdKernels.h"
 
 constexpr int N0 = 20;
 using Path = std::string;
@@ -2,6 +2,7 @@
 #define _PAGE_H
 
 #include <cassert>
+#include <cstdint>
 #include <fstream>
 #include <vector>
 #include "rid.h"
@@ -18,7 +19,9 @@ class Page {
     const int page_size;
     using Pool = Byte*;
     using IntType = std::size_t;
-    using BitMap = std::vector<bool>;
+    // bit i of word w is slot 64 * w + i, set when the slot is in use
+    using Word = std::uint64_t;
+    using BitMap = std::vector<Word>;
 
   public:
     /**
@@ -30,18 +33,31 @@ class Page {
      * @Description Make a page from binary page file
      */
     Page(int page_id, std::istream& in, Byte* pool_base, int page_size_in_k);
+
+    /**
+     * @Description Make a page from a binary page already read into pool_base
+     */
+    Page(int page_id, Byte* pool_base, int page_size_in_k);
+
     /**
      * @Description Write data to file;
      */
     void sync(std::ostream& out);
 
+    /**
+     * @Description Bring the page bytes in the pool up to date, they can
+     * then be written out as they are
+     */
+    void sync();
+
     /**
      * @Description Select a slot according to solt id.
      */
     Slot select(const int& slot_id);
 
     /**
-     * @Description Insert new slot in page
+     * @Description Insert new slot in page, the first free slot is found a
+     * word of the bitmap at a time
      * @Return tuple of Rid and Slot.
      */
     std::tuple<Rid, Slot> insert();
@@ -54,13 +70,21 @@ class Page {
 
     inline bool isFull() { return m_slot_num >= m_total_slot; }
 
+    inline int freeSlots() const { return m_total_slot - m_slot_num; }
+
     inline int PageId() const {
       return this->m_page_id;
     }
 
+    /**
+     * @Description Number of slots of slot_size bytes a page holds
+     */
+    static int SlotsPerPage(IntType slot_size, IntType page_size_in_k);
+
   private:
    /**
-    * @Description Build Bitmap from buffer memory.
+    * @Description Build Bitmap from buffer memory a byte at a time and count
+    * the slots in use.
     */
     void initBitMap();
 
@@ -76,6 +100,15 @@ class Page {
     Page(int page_id, IntType page_size_in_k, Byte* pool_base);
     void init();
 
+    /**
+     * @Description Parse slot size, type and bitmap of the page in the pool
+     */
+    void load();
+
+    inline bool isUsed(int slot_id) const {
+        return m_slot_map[slot_id / 64] >> (slot_id % 64) & 1;
+    }
+
     inline Slot makeSlot(int slot_id) {
         return Slot(m_slot_pool + m_slot_size * slot_id, m_slot_size, type);
     }
@@ -86,6 +119,8 @@ class Page {
 
     Pool m_slot_pool;
     BitMap m_slot_map;
+    // no free slot in the words before this one
+    std::size_t m_first_free_word = 0;
     Byte* bitmap_pos;
 
     int m_total_slot;
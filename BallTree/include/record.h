@@ -1,8 +1,13 @@
 #ifndef __RECORD_H
 #define __RECORD_H
 
-#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <memory>
+#include <unordered_set>
+#include <vector>
+#include "rid.h"
 
 struct Record {
     using Pointer = std::unique_ptr<Record>;
@@ -28,4 +33,62 @@ struct Record {
     std::vector<float> data;
 };
 
+/**
+ * indices of records deleted from a tree but still stored in it, searches of
+ * the tree leave them out
+ */
+using Tombstones = std::unordered_set<int>;
+
+/**
+ * a record read in place from a storage page, the data is only valid while
+ * the page stays pinned
+ */
+struct RecordView {
+    int index;
+    const float* data;
+    std::size_t size;
+};
+
+/**
+ * a record rounded to int8 codes with one scale per vector, data[i] is
+ * close to scale * codes[i]: every component is off by at most scale / 2
+ *
+ * searches score the codes and read the full record at full only when the
+ * estimate may beat their current result
+ */
+struct QuantizedRecord {
+    static constexpr int kMaxCode = 127;
+
+    static QuantizedRecord Quantize(const Record& record, const Rid& full) {
+        float max_abs = 0;
+        for (auto x : record.data) {
+            max_abs = std::max(max_abs, std::abs(x));
+        }
+        QuantizedRecord ret{record.index, max_abs / kMaxCode, full, {}};
+        ret.codes.reserve(record.data.size());
+        for (auto x : record.data) {
+            auto code = ret.scale == 0 ? 0 : std::lround(x / ret.scale);
+            code = std::min<long>(std::max<long>(code, -kMaxCode), kMaxCode);
+            ret.codes.push_back(static_cast<std::int8_t>(code));
+        }
+        return ret;
+    }
+
+    int index;
+    float scale;
+    Rid full;
+    std::vector<std::int8_t> codes;
+};
+
+/**
+ * a QuantizedRecord read in place, valid while the page stays pinned
+ */
+struct QuantizedRecordView {
+    int index;
+    float scale;
+    Rid full{0, 0};
+    const std::int8_t* codes;
+    std::size_t size;
+};
+
 #endif
@@ -7,10 +7,17 @@ struct Rid {
     static constexpr DataType record = 0;
     static constexpr DataType branch = 1;
     static constexpr DataType leaf = 2;
+    // int8 copies of records, see QuantizedRecord
+    static constexpr DataType quantized = 3;
     Rid(int page_id, int slot_id, DataType type = Rid::record)
         : page_id(page_id), slot_id(slot_id), type(type) {}
     int page_id, slot_id;
     DataType type;
+
+    bool operator==(const Rid& other) const {
+        return page_id == other.page_id and slot_id == other.slot_id and
+               type == other.type;
+    }
 };
 
 #endif
@@ -18,17 +18,83 @@ class Slot {
     bool Get(std::unique_ptr<BallTreeBranch>&);
     bool Get(std::unique_ptr<BallTreeLeaf>&);
 
+    /**
+     * point views at the slot bytes instead of copying them out
+     */
+    bool View(RecordView&) const;
+    bool View(NodeView&) const;
+    bool View(QuantizedRecordView&) const;
+
     bool Set(const Record&);
     bool Set(const BallTreeBranch&);
     bool Set(const BallTreeLeaf&);
+    bool Set(const QuantizedRecord&);
 
     int Size() {
       return byte_size;
     }
     void SetId(unsigned int slot_id) { this->slot_id = slot_id; }
 
-    static size_t GetSize(Rid::DataType type, int dimension);
+    /**
+     * @param norms whether leaves keep the norms of their records, see
+     * IndexFormat::norm_sorted_leaves; ignored for other types
+     * @param node_norms whether branches and leaves keep the range of the
+     * norms below them, leaves then keep the norms of their records as well
+     * @param cones whether branches and leaves keep a ConeBound, they then
+     * keep the norms as well
+     * @param vectors whether leaves carry the vectors of their records, see
+     * IndexFormat::clustered_leaves; ignored for other types
+     */
+    static size_t GetSize(Rid::DataType type, int dimension, bool norms = false,
+                          bool node_norms = false, bool cones = false,
+                          bool vectors = false);
   private:
+    /**
+     * a leaf slot has room for the vectors of its records only if its index
+     * keeps them; they take more bytes than all the other parts a leaf may
+     * have together, so the size tells them apart
+     */
+    bool HasVectors(size_t center_size) const {
+      return type == Rid::leaf and static_cast<size_t>(byte_size) >=
+             GetSize(Rid::leaf, center_size, false, false, false, true);
+    }
+
+    /**
+     * the bytes of the vectors at the end of a leaf slot, 0 without them
+     */
+    size_t VectorsSize(size_t center_size) const {
+      return HasVectors(center_size)
+          ? (sizeof(int) + sizeof(float) * center_size) * N0 : 0;
+    }
+
+    /**
+     * a leaf slot has room for the norms only if its index keeps them
+     */
+    bool HasNorms(size_t center_size) const {
+      return byte_size - VectorsSize(center_size) >=
+             GetSize(Rid::leaf, center_size, true);
+    }
+
+    /**
+     * a node slot has room for the range of norms below it, and for a cone,
+     * only if its index keeps them
+     */
+    bool HasNodeNorms(size_t center_size) const {
+      return byte_size - VectorsSize(center_size) >=
+             GetSize(type, center_size, true, true);
+    }
+    bool HasCone(size_t center_size) const {
+      return byte_size - VectorsSize(center_size) >=
+             GetSize(type, center_size, true, true, true);
+    }
+
+    /**
+     * the bounds of a node besides its ball start at bounds, right after
+     * the rids of a branch and after the norms of a leaf
+     */
+    void GetBounds(const Byte* bounds, size_t center_size, BallTreeNode& node) const;
+    void SetBounds(Byte* bounds, const BallTreeNode& node);
+
     Byte* slot;
     int byte_size;
     unsigned slot_id;
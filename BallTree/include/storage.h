@@ -1,27 +1,139 @@
 #ifndef __STORAGE_H
 #define __STORAGE_H
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <set>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <fstream>
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
 #include "Utility.h"
 #include "record.h"
 #include "rid.h"
 #include "page.h"
+#include "IndexFile.h"
+#include "Replacer.h"
 
 struct BallTreeNode;
 
+/**
+ * page lookups and page I/O of a buffer pool, counted since it was created
+ */
+struct PoolStats {
+    // answered from a frame
+    std::size_t hits = 0;
+    // had to read the page in
+    std::size_t misses = 0;
+    // pages dropped from a frame to make room for another one
+    std::size_t evictions = 0;
+    // dirty pages written back, on eviction or when the pool is destroyed
+    std::size_t write_backs = 0;
+    std::size_t bytes_read = 0;
+    std::size_t bytes_written = 0;
+    // read-ahead requests for pages that were not in a frame
+    std::size_t prefetches = 0;
+
+    PoolStats& operator+=(const PoolStats& other) {
+        hits += other.hits;
+        misses += other.misses;
+        evictions += other.evictions;
+        write_backs += other.write_backs;
+        bytes_read += other.bytes_read;
+        bytes_written += other.bytes_written;
+        prefetches += other.prefetches;
+        return *this;
+    }
+
+    PoolStats& operator-=(const PoolStats& other) {
+        hits -= other.hits;
+        misses -= other.misses;
+        evictions -= other.evictions;
+        write_backs -= other.write_backs;
+        bytes_read -= other.bytes_read;
+        bytes_written -= other.bytes_written;
+        prefetches -= other.prefetches;
+        return *this;
+    }
+
+    double HitRate() const {
+        auto lookups = hits + misses;
+        return lookups == 0 ? 0 : static_cast<double>(hits) / lookups;
+    }
+};
+
+/**
+ * how much memory the buffer pools of an index get and how they evict
+ */
+struct BufferPoolConfig {
+    // frames of the branch pool and of the leaf pool each, a pool gets at
+    // least one frame
+    std::size_t node_frames = 2;
+    // frames of the record pool, at least one as well
+    std::size_t record_frames = 4;
+    ReplacementPolicy policy = ReplacementPolicy::clock;
+    // searches ask for child and record pages before they need them, which
+    // overlaps disk reads with scoring on a cold index but costs a system
+    // call per page on a warm one; the mapped backend honours it too
+    bool prefetch = false;
+};
+
+/**
+ * a view into a buffer-pool frame together with a pin on that frame, the
+ * frame is not swapped out while any Pinned of it is alive
+ */
+template <typename View>
+class Pinned {
+  public:
+    Pinned() = default;
+    Pinned(const View& view, int* pin_count)
+        : view_(view), pin_count_(pin_count) {
+        if (pin_count_) ++*pin_count_;
+    }
+    Pinned(const Pinned&) = delete;
+    Pinned& operator=(const Pinned&) = delete;
+    Pinned(Pinned&& other) : view_(other.view_), pin_count_(other.pin_count_) {
+        other.pin_count_ = nullptr;
+    }
+    Pinned& operator=(Pinned&& other) {
+        if (this != &other) {
+            Release();
+            view_ = other.view_;
+            pin_count_ = other.pin_count_;
+            other.pin_count_ = nullptr;
+        }
+        return *this;
+    }
+    ~Pinned() {
+        Release();
+    }
+
+    const View& operator*() const { return view_; }
+    const View* operator->() const { return &view_; }
+
+  private:
+    void Release() {
+        if (pin_count_) --*pin_count_;
+        pin_count_ = nullptr;
+    }
+
+    View view_;
+    int* pin_count_ = nullptr;
+};
+
 /**
  * low level abstraction of the 'storage' concept
  *
  * FixedLengthStorage manage the allocation/deallocation of fixed length bytes
  * in internal and external storage, ignoring what those bytes actually
  * represents
- * @tparam MaxPageInMemory set to -1 when no limitation
+ * @tparam MaxPageInMemory set to -1 when no limitation, otherwise the
+ * number of frames used when the constructor is not given one
  */
 template <
     int64_t BytesPerPage,
@@ -38,54 +150,61 @@ class FixedLengthStorage {
             "only memory only storage can use this constructor");
     }
 
+    /**
+     * @param frame_num pages kept in memory at once, 0 counts as 1
+     */
     FixedLengthStorage(
-        int slot_size, const std::string& name, const Path& dest_dir = "./")
+        int slot_size, const std::string& name, const Path& dest_dir = "./",
+        std::size_t frame_num = MaxPageInMemory,
+        ReplacementPolicy policy = ReplacementPolicy::clock)
         : slot_size(slot_size),
           name(name),
           dest_dir(dest_dir),
-          is_referenced(MaxPageInMemory, false),
-          is_dirty(MaxPageInMemory, false),
-          frames(MaxPageInMemory, nullptr),
-          buffer_ptr(new Byte[buffer_size]()) {
+          // 一帧都没有的池子 换页时没有帧可用
+          frame_num(std::max<std::size_t>(frame_num, 1)),
+          replacer(Replacer::Create(policy, this->frame_num)),
+          is_dirty(this->frame_num, false),
+          pin_count(this->frame_num, 0),
+          frames(this->frame_num, nullptr),
+          buffer_ptr(new Byte[page_size * this->frame_num]()) {
             static_assert(MaxPageInMemory > 0, "MaxPageInMemory should be > 0 when using this constructor");
             auto indexFs = this->getIndexFs<this->in_mode>();
             indexFs.seekg(0, std::ios::end);
             if (indexFs.tellg() > 0) {
-                // 文件非空: 从文件读取 page_num
-                this->readPageNum();
+                // 文件非空: 从文件读取 page_num 和空闲空间表
+                this->readIndex();
             }
     }
 
+    /**
+     * keeps the pages in file instead of one file per page, file has to
+     * outlive the storage
+     * @param frame_num as above
+     */
+    FixedLengthStorage(
+        int slot_size, IndexFile* file,
+        std::size_t frame_num = MaxPageInMemory,
+        ReplacementPolicy policy = ReplacementPolicy::clock)
+        : slot_size(slot_size),
+          file(file),
+          page_num(file->PageCount(DataType)),
+          free_slots(file->GetFreeSlots(DataType)),
+          // 一帧都没有的池子 换页时没有帧可用
+          frame_num(std::max<std::size_t>(frame_num, 1)),
+          replacer(Replacer::Create(policy, this->frame_num)),
+          is_dirty(this->frame_num, false),
+          pin_count(this->frame_num, 0),
+          frames(this->frame_num, nullptr),
+          buffer_ptr(new Byte[page_size * this->frame_num]()) {
+            static_assert(MaxPageInMemory > 0, "MaxPageInMemory should be > 0 when using this constructor");
+            assert(file->PageSize() == page_size);
+            this->initPagesWithRoom();
+    }
+
     template <typename T>
     Rid Put(const T &data) {
-        PagePtr non_full_page_ptr = nullptr;
-        std::size_t frame_id = 0;
-        // 尝试从内存中的缓存页中找到还没满的页面
-        for (auto &pair : this->page_to_frame_map) {
-            frame_id = pair.second;
-            auto &cur_page_ptr = this->frames[frame_id];
-            if (cur_page_ptr->isFull()) continue;
-            // 找到了
-            non_full_page_ptr = cur_page_ptr;
-            break;
-        }
-        if (not non_full_page_ptr) {
-            // 如果内存中的缓存页都满了: 这里就直接创建一个新的页面
-            // 换出一个旧的, 得到 frame_id
-            frame_id = this->swapPageOut();
-            // 创建新的
-            non_full_page_ptr = std::make_shared<Page>(this->page_num,
-                                                       this->slot_size,
-                                                       DataType,
-                                                       this->getFrameAddr(frame_id),
-                                                       this->page_size_in_k);
-            this->initNewPage(non_full_page_ptr, frame_id);
-            // 总页数增加
-            ++this->page_num;
-        }
-        // 未满页的 page_id
-        auto page_id = non_full_page_ptr->PageId();
-        this->is_referenced[frame_id] = true;
+        auto frame_id = this->frameWithRoom(1);
+        auto &non_full_page_ptr = this->frames[frame_id];
         this->is_dirty[frame_id] = true;
 
         // 插入新的槽
@@ -93,17 +212,39 @@ class FixedLengthStorage {
         auto cur_slot = std::get<1>(insert_result);
         // 设置槽中数据
         cur_slot.Set(data);
+        this->slotTaken(non_full_page_ptr->PageId());
         return std::get<0>(insert_result);
     }
 
+    /**
+     * stores items into consecutive slots of one page when they fit in one,
+     * so that reading them back with GetRun costs a single page fetch
+     * @tparam Pointers container of (smart) pointers to T
+     */
+    template <typename T, typename Pointers>
+    std::vector<Rid> PutRun(const Pointers &items) {
+        std::vector<Rid> rids;
+        rids.reserve(items.size());
+        auto frame_id = this->frameWithRoom(items.size());
+        auto &page_ptr = this->frames[frame_id];
+        this->is_dirty[frame_id] = true;
+        for (auto &item : items) {
+            if (page_ptr->isFull()) {
+                // 一页放不下 剩下的逐个放
+                rids.push_back(this->Put<T>(*item));
+                continue;
+            }
+            auto insert_result = page_ptr->insert();
+            std::get<1>(insert_result).Set(*item);
+            this->slotTaken(page_ptr->PageId());
+            rids.push_back(std::get<0>(insert_result));
+        }
+        return rids;
+    }
+
     template <typename T>
     std::unique_ptr<T> Get(const Rid &rid) {
-        if (not this->pageInMemory(rid.page_id)) {
-            // 把想要的 rid.page_id 换入
-            this->swapPageIn(rid.page_id, this->swapPageOut());
-        }
-        auto frame_id = this->page_to_frame_map[rid.page_id];
-        this->is_referenced[frame_id] = true;
+        auto frame_id = this->fetchFrame(rid.page_id);
         // 得到想要的页面
         auto &cur_page_ptr = this->frames[frame_id];
         // 得到想要的槽
@@ -111,35 +252,226 @@ class FixedLengthStorage {
         std::unique_ptr<T> ptr;
         // 复制出槽中数据
         cur_slot.Get(ptr);
-        return std::move(ptr);
+        return ptr;
     }
 
-    ~FixedLengthStorage() {
+    /**
+     * points a view of type V at the slot of rid without copying it, the
+     * frame stays pinned in memory until the returned guard is destroyed
+     */
+    template <typename V>
+    Pinned<V> View(const Rid &rid) {
+        auto frame_id = this->fetchFrame(rid.page_id);
+        V view;
+        this->frames[frame_id]->select(rid.slot_id).View(view);
+        return Pinned<V>(view, &this->pin_count[frame_id]);
+    }
+
+    /**
+     * finds all items in rids, the page of a run of rids sharing a page_id
+     * is looked up once for the whole run
+     */
+    template <typename T>
+    std::vector<std::unique_ptr<T>> GetRun(const std::vector<Rid> &rids) {
+        std::vector<std::unique_ptr<T>> items(rids.size());
+        Page *cur_page_ptr = nullptr;
+        int cur_page_id = -1;
+        for (std::size_t i = 0; i < rids.size(); ++i) {
+            auto &rid = rids[i];
+            if (not cur_page_ptr or rid.page_id != cur_page_id) {
+                auto frame_id = this->fetchFrame(rid.page_id);
+                cur_page_ptr = this->frames[frame_id].get();
+                cur_page_id = rid.page_id;
+            }
+            cur_page_ptr->select(rid.slot_id).Get(items[i]);
+        }
+        return items;
+    }
+
+    /**
+     * asks the kernel to read page_id into the page cache in the background
+     * and returns at once, the fetch that follows then copies it from memory
+     * instead of waiting on the disk; pages in a frame are skipped
+     */
+    void Prefetch(int page_id) {
+        if (page_id >= this->page_num or this->pageInMemory(page_id)) return;
+        ++this->stats.prefetches;
+        if (this->file) {
+            this->file->Prefetch(DataType, page_id);
+            return;
+        }
+        std::stringstream ss;
+        ss << "." << page_id;
+        auto filename = this->dest_dir + this->name + ss.str();
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd == -1) return;
+        ::posix_fadvise(fd, 0, page_size, POSIX_FADV_WILLNEED);
+        ::close(fd);
+    }
+
+    /**
+     * overwrites the slot of rid in place, only its page becomes dirty and
+     * is written back when it leaves the pool
+     */
+    template <typename T>
+    void Set(const Rid &rid, const T &data) {
+        auto frame_id = this->fetchFrame(rid.page_id);
+        this->is_dirty[frame_id] = true;
+        this->frames[frame_id]->select(rid.slot_id).Set(data);
+    }
+
+    /**
+     * frees the slot of rid with Page::drop, a later Put may reuse it
+     * @return false if the slot was not in use
+     */
+    bool Remove(const Rid &rid) {
+        auto frame_id = this->fetchFrame(rid.page_id);
+        if (not this->frames[frame_id]->drop(rid.slot_id)) return false;
+        this->is_dirty[frame_id] = true;
+        this->slotFreed(rid.page_id);
+        return true;
+    }
+
+    /**
+     * writes the dirty pages and the free-space map out now, another reader
+     * of the index then sees every change made so far
+     */
+    void Flush() {
         // 一页一页写出
         for (auto &pair : this->page_to_frame_map) {
             auto page_id = pair.first;
             auto frame_id = pair.second;
             if (not this->is_dirty[frame_id]) continue;
-            auto fs = this->getFs<this->out_mode>(page_id);
-            this->writePageOut(frame_id, fs);
+            this->writePageOut(page_id, frame_id);
+            this->is_dirty[frame_id] = false;
+        }
+        // 只读的实例不写 避免多个读者同时改写 .index
+        // 单文件的页数和空闲空间表由 IndexFile 记录
+        if (not this->index_changed) return;
+        if (this->file) {
+            this->file->SetFreeSlots(DataType, this->free_slots);
+        } else {
+            this->writeIndex();
         }
-        this->writePageNum();
+        this->index_changed = false;
+    }
+
+    ~FixedLengthStorage() {
+        this->Flush();
     }
 
     int SlotSize() const {
         return this->slot_size;
     }
+
+    std::size_t FrameNum() const {
+        return this->frame_num;
+    }
+
+    /**
+     * page lookups, evictions and page I/O of this pool
+     */
+    PoolStats Stats() const {
+        return this->stats;
+    }
   private:
 
+    /**
+     * @description 找到 page_id 所在的帧 不在内存就先换入
+     * @return 该页的帧id
+     */
+    std::size_t fetchFrame(int page_id) {
+        auto iter = this->page_to_frame_map.find(page_id);
+        if (iter != this->page_to_frame_map.end()) {
+            ++this->stats.hits;
+            this->replacer->Touch(iter->second);
+            return iter->second;
+        }
+        ++this->stats.misses;
+        // 把想要的 page_id 换入
+        auto frame_id = this->swapPageOut();
+        this->swapPageIn(page_id, frame_id);
+        return frame_id;
+    }
+
+    /**
+     * @description 找到一个至少有 slots 个空槽的页 不在内存就换入 都没有就新建一页
+     * 在空闲空间表里二分 与总页数和帧数无关 换出过的页也会被重新用上
+     * 选空槽最少但够用的页 整块的 PutRun 剩下的零头留给单个 Put
+     * @return 该页的帧id
+     */
+    std::size_t frameWithRoom(std::size_t slots) {
+        auto iter = this->pages_with_room.lower_bound(
+            {static_cast<std::int32_t>(slots), 0});
+        if (iter != this->pages_with_room.end()) {
+            // 找到了
+            return this->fetchFrame(iter->second);
+        }
+        // 没有空槽足够的页: 这里就直接创建一个新的页面
+        // 换出一个旧的, 得到 frame_id
+        auto frame_id = this->swapPageOut();
+        // 创建新的
+        auto new_page_ptr = std::make_shared<Page>(this->page_num,
+                                                   this->slot_size,
+                                                   DataType,
+                                                   this->getFrameAddr(frame_id),
+                                                   this->page_size_in_k);
+        this->initNewPage(new_page_ptr, frame_id);
+        if (this->file) {
+            auto page_id = this->file->AllocatePage(DataType);
+            assert(page_id == this->page_num);
+        }
+        this->free_slots.push_back(new_page_ptr->freeSlots());
+        this->pages_with_room.insert({this->free_slots.back(), this->page_num});
+        // 总页数增加
+        ++this->page_num;
+        this->index_changed = true;
+        return frame_id;
+    }
+
+    /**
+     * @description 页 page_id 用掉了一个槽 更新空闲空间表
+     */
+    void slotTaken(int page_id) {
+        auto &free = this->free_slots[page_id];
+        this->pages_with_room.erase({free, page_id});
+        if (--free > 0) {
+            this->pages_with_room.insert({free, page_id});
+        }
+        this->index_changed = true;
+    }
+
+    /**
+     * @description 页 page_id 空出了一个槽 更新空闲空间表
+     */
+    void slotFreed(int page_id) {
+        auto &free = this->free_slots[page_id];
+        this->pages_with_room.erase({free, page_id});
+        this->pages_with_room.insert({++free, page_id});
+        this->index_changed = true;
+    }
+
+    void initPagesWithRoom() {
+        // 旧的索引没有空闲空间表 它的页都当作满的
+        this->free_slots.resize(this->page_num, 0);
+        this->pages_with_room.clear();
+        for (int page_id = 0; page_id < this->page_num; ++page_id) {
+            if (this->free_slots[page_id] > 0) {
+                this->pages_with_room.insert({this->free_slots[page_id], page_id});
+            }
+        }
+    }
+
     bool pageInMemory(int page_id) const {
         return this->page_to_frame_map.find(page_id) != this->page_to_frame_map.end();
     }
 
     bool framesFull() const {
-        return this->page_to_frame_map.size() == MaxPageInMemory;
+        return this->page_to_frame_map.size() == this->frame_num;
     }
 
     void initNewPage(PagePtr new_page_ptr, std::size_t frame_id) {
+        this->replacer->Insert(frame_id);
         this->frames[frame_id] = new_page_ptr;
         this->page_to_frame_map.insert({ new_page_ptr->PageId(), frame_id });
     }
@@ -156,15 +488,28 @@ class FixedLengthStorage {
         }
         // 得到牺牲页的帧id 然后考虑把它换出去
         auto frame_id = this->page_to_frame_map.at(victim_page_id);
+        ++this->stats.evictions;
         if (this->is_dirty[frame_id]) {
-            auto fs = this->getFs<this->out_mode>(victim_page_id);
-            this->writePageOut(frame_id, fs);
+            this->writePageOut(victim_page_id, frame_id);
         }
         this->frames[frame_id].reset();
         this->page_to_frame_map.erase(victim_page_id);
         return frame_id;
     }
 
+    void writePageOut(int page_id, std::size_t frame_id) {
+        ++this->stats.write_backs;
+        this->stats.bytes_written += page_size;
+        if (this->file) {
+            // 帧里就是整页 直接 pwrite
+            this->frames[frame_id]->sync();
+            this->file->WritePage(DataType, page_id, this->getFrameAddr(frame_id));
+            return;
+        }
+        auto fs = this->getFs<this->out_mode>(page_id);
+        this->writePageOut(frame_id, fs);
+    }
+
     void writePageOut(std::size_t frame_id, std::ostream &out) {
         // 找到对应页　地址偏移一波　写回去
         auto page_ptr = this->frames[frame_id];
@@ -174,6 +519,17 @@ class FixedLengthStorage {
     }
 
     void swapPageIn(int page_in_id, std::size_t frame_id) {
+        this->stats.bytes_read += page_size;
+        if (this->file) {
+            // pread 到帧里 再就地解析
+            this->file->ReadPage(DataType, page_in_id, this->getFrameAddr(frame_id));
+            auto new_page_ptr = std::make_shared<Page>(page_in_id,
+                                                       this->getFrameAddr(frame_id),
+                                                       this->page_size_in_k);
+            this->initNewPage(new_page_ptr, frame_id);
+            this->is_dirty[frame_id] = false;
+            return;
+        }
         auto fs = this->getFs<this->in_mode>(page_in_id);
         return this->readPageIn(page_in_id, frame_id, fs);
     }
@@ -189,12 +545,12 @@ class FixedLengthStorage {
         // 构建各种关系
         this->initNewPage(new_page_ptr, frame_id);
         this->is_dirty[frame_id] = false;
-        this->is_referenced[frame_id] = true;
     }
 
     /**
      * @description 如果换出后不马上换入，就会gg，作者太菜了
-     * @return 牺牲页的 page_id
+     * @return 牺牲页的 page_id 帧没满时返回 -1
+     * @throw std::runtime_error 帧满了且每一帧都被 pin 住
      */
     int findVictimPage() {
         static_assert(MaxPageInMemory > 0, "MaxPageInMemory should be > 0 when calling findVictimPage");
@@ -203,24 +559,14 @@ class FixedLengthStorage {
             return -1;
         }
 
-        // 帧存满页 现在有一页需要牺牲
-        // 循环 + 引用位　判断
-        static int64_t victim_frame_id = 0;
-        for (std::size_t index = 0; index < MaxPageInMemory; ++index) {
-            if (not this->frames[victim_frame_id]) continue;
-            if (this->is_referenced[victim_frame_id]) {
-                // 如果引用位有效　关闭引用位
-                this->is_referenced[victim_frame_id] = false;
-            } else {
-                return this->frames[victim_frame_id]->PageId();
-            }
-
-            victim_frame_id = (victim_frame_id + 1) % MaxPageInMemory;
-        }
-        if (this->frames[victim_frame_id]) {
-            return this->frames[victim_frame_id]->PageId();
+        // 帧存满页 现在有一页需要牺牲 交给替换策略选
+        // 被 pin 住的帧不能换出
+        auto victim_frame_id = this->replacer->Victim(this->pin_count);
+        if (victim_frame_id == -1 or not this->frames[victim_frame_id]) {
+            // 不能当成还有空帧 那样会越界
+            throw std::runtime_error(this->name + ": every frame is pinned");
         }
-        assert("didn't swap in right after swapping out?");
+        return this->frames[victim_frame_id]->PageId();
     }
 
     template <std::ios::openmode openmode>
@@ -239,38 +585,66 @@ class FixedLengthStorage {
         return std::move(fs);
     }
 
-    void readPageNum() {
+    /**
+     * name.index
+     * +----------+---------------------+
+     * |   int    | int32 [page_num]    |
+     * +----------+---------------------+
+     * | page_num | free slots per page |
+     * +----------+---------------------+
+     */
+    void readIndex() {
         auto indexFs = this->getIndexFs<this->in_mode>();
         auto page_num_addr = reinterpret_cast<char *>(&this->page_num);
         constexpr auto page_num_size = sizeof(this->page_num);
         indexFs.seekg(0);
         indexFs.read(page_num_addr, page_num_size);
+        this->free_slots.assign(this->page_num, 0);
+        indexFs.read(reinterpret_cast<char *>(this->free_slots.data()),
+                     sizeof(std::int32_t) * this->page_num);
+        if (not indexFs) {
+            // 没有空闲空间表的旧索引
+            std::fill(this->free_slots.begin(), this->free_slots.end(), 0);
+        }
+        this->initPagesWithRoom();
     }
 
-    void writePageNum() {
+    void writeIndex() {
         auto indexFs = this->getIndexFs<this->out_mode>();
         auto page_num_addr = reinterpret_cast<char *>(&this->page_num);
         constexpr auto page_num_size = sizeof(this->page_num);
         indexFs.seekp(0);
         indexFs.write(page_num_addr, page_num_size);
+        indexFs.write(reinterpret_cast<const char *>(this->free_slots.data()),
+                      sizeof(std::int32_t) * this->page_num);
     }
 
     inline Byte *getFrameAddr(std::size_t frame_id) const {
-        auto buffer_ptr = reinterpret_cast<Byte (*)[page_size]>(this->buffer_ptr.get());
-        return reinterpret_cast<Byte *>(buffer_ptr + frame_id);
+        return this->buffer_ptr.get() + page_size * frame_id;
     }
 
   private:
     int slot_size;
     std::string name;
     Path dest_dir;
+    IndexFile* file = nullptr;
     int page_num = 0;
+    // 空闲空间表: 每页的空槽数 换出的页也记着
+    std::vector<std::int32_t> free_slots;
+    // 还有空槽的页 (空槽数, page_id)
+    std::set<std::pair<std::int32_t, int>> pages_with_room;
+    bool index_changed = false;
+    std::size_t frame_num;
+    // 替换策略属于实例 不同实例可以在不同线程中使用
+    std::unique_ptr<Replacer> replacer;
+    PoolStats stats;
 
-    BitSet is_referenced;
     BitSet is_dirty;
+    // 每帧上活着的 Pinned 个数 大小固定 地址不会变
+    std::vector<int> pin_count;
     std::vector<PagePtr> frames;
     std::unordered_map<int, std::size_t> page_to_frame_map;
-    std::unique_ptr<Byte> buffer_ptr;
+    std::unique_ptr<Byte[]> buffer_ptr;
     std::fstream fs;
 
     static constexpr std::ios::openmode in_mode = std::ios::binary | std::ios::in;
@@ -278,7 +652,6 @@ class FixedLengthStorage {
     static constexpr std::ios::openmode openmode = std::ios::binary | std::ios::in | std::ios::out;
     static constexpr std::size_t page_size_in_k = BytesPerPage;
     static constexpr std::size_t page_size = page_size_in_k * 1024;
-    static constexpr std::size_t buffer_size = page_size * MaxPageInMemory;
     static constexpr std::size_t begin_pos = 0;
 };
 
@@ -286,12 +659,177 @@ class FixedLengthStorage {
 template <int64_t a, Rid::DataType b, int64_t c, bool d>
 constexpr std::size_t FixedLengthStorage<a, b, c, d>::page_size_in_k;
 
+/**
+ * write side of a FixedLengthStorage for a bulk load
+ *
+ * slots are packed into pages front to back and each page is written once,
+ * kBatchPages at a time, after it is full; nothing is looked up, evicted or
+ * read back. What it leaves on disk, name.index with the free-space map
+ * included, opens as a FixedLengthStorage with the same BytesPerPage.
+ */
+template <int64_t BytesPerPage, Rid::DataType DataType>
+class PageStream {
+  public:
+    // pages gathered in memory for one write
+    static constexpr std::size_t kBatchPages = 16;
+
+    PageStream(int slot_size, const std::string& name, const Path& dest_dir)
+        : slot_size(slot_size),
+          name(name),
+          dest_dir(dest_dir),
+          buffer_ptr(new Byte[page_size * kBatchPages]()) {}
+
+    /**
+     * appends the pages to file, which has to outlive the stream
+     */
+    PageStream(int slot_size, IndexFile* file)
+        : slot_size(slot_size),
+          file(file),
+          buffer_ptr(new Byte[page_size * kBatchPages]()) {
+        assert(file->PageSize() == page_size);
+    }
+
+    PageStream(const PageStream&) = delete;
+    PageStream& operator=(const PageStream&) = delete;
+
+    ~PageStream() {
+        this->Close();
+    }
+
+    template <typename T>
+    Rid Put(const T &item) {
+        if (not this->page or this->page->isFull()) {
+            this->newPage();
+        }
+        auto insert_result = this->page->insert();
+        std::get<1>(insert_result).Set(item);
+        return std::get<0>(insert_result);
+    }
+
+    /**
+     * starts a new page unless items fit in what is left of the current
+     * one, like FixedLengthStorage::PutRun
+     */
+    template <typename T, typename Pointers>
+    std::vector<Rid> PutRun(const Pointers &items) {
+        if (this->page and
+            this->page->freeSlots() < static_cast<int>(items.size())) {
+            this->newPage();
+        }
+        std::vector<Rid> rids;
+        rids.reserve(items.size());
+        for (auto &item : items) {
+            rids.push_back(this->Put<T>(*item));
+        }
+        return rids;
+    }
+
+    /**
+     * writes the last pages and the page count, later Puts are lost
+     */
+    void Close() {
+        if (this->closed) return;
+        this->closed = true;
+        this->finishPage();
+        this->flush();
+        if (this->file) {
+            this->file->SetFreeSlots(DataType, this->free_slots);
+            return;
+        }
+        // 与 FixedLengthStorage::writeIndex 相同的格式
+        std::ofstream index(this->dest_dir + this->name + ".index",
+                            std::ios::binary | std::ios::out);
+        index.write(reinterpret_cast<const char *>(&this->page_num),
+                    sizeof(this->page_num));
+        index.write(reinterpret_cast<const char *>(this->free_slots.data()),
+                    sizeof(std::int32_t) * this->page_num);
+    }
+
+  private:
+    void newPage() {
+        this->finishPage();
+        if (this->batch_size == kBatchPages) {
+            this->flush();
+        }
+        this->page = std::make_unique<Page>(
+            this->page_num, this->slot_size, DataType,
+            this->buffer_ptr.get() + page_size * this->batch_size,
+            page_size_in_k);
+        ++this->page_num;
+    }
+
+    /**
+     * 当前页写满了或不再写了 把位图写回缓冲区 记下空槽数
+     */
+    void finishPage() {
+        if (not this->page) return;
+        this->page->sync();
+        this->free_slots.push_back(this->page->freeSlots());
+        this->page.reset();
+        ++this->batch_size;
+    }
+
+    void flush() {
+        if (this->batch_size == 0) return;
+        auto first_page_id = this->page_num - static_cast<int>(this->batch_size);
+        if (this->file) {
+            for (std::size_t i = 0; i < this->batch_size; ++i) {
+                auto page_id = this->file->AllocatePage(DataType);
+                assert(page_id == first_page_id + static_cast<int>(i));
+            }
+            // 一批页在文件里是连续的 一次写出
+            this->file->WritePages(
+                DataType, first_page_id, this->batch_size, this->buffer_ptr.get());
+        } else {
+            for (std::size_t i = 0; i < this->batch_size; ++i) {
+                std::stringstream ss;
+                ss << "." << first_page_id + i;
+                std::ofstream out(this->dest_dir + this->name + ss.str(),
+                                  std::ios::binary | std::ios::out);
+                out.write(reinterpret_cast<const char *>(
+                              this->buffer_ptr.get() + page_size * i),
+                          page_size);
+            }
+        }
+        // 下一批的空槽不留上一批的数据
+        std::fill(this->buffer_ptr.get(),
+                  this->buffer_ptr.get() + page_size * this->batch_size, 0);
+        this->batch_size = 0;
+    }
+
+    int slot_size;
+    std::string name;
+    Path dest_dir;
+    IndexFile* file = nullptr;
+    int page_num = 0;
+    std::vector<std::int32_t> free_slots;
+    std::unique_ptr<Page> page;
+    // pages of the buffer filled so far, the current page not included
+    std::size_t batch_size = 0;
+    bool closed = false;
+    std::unique_ptr<Byte[]> buffer_ptr;
+
+    static constexpr std::size_t page_size_in_k = BytesPerPage;
+    static constexpr std::size_t page_size = page_size_in_k * 1024;
+};
+
 
 class MemoryOnlyStorage;
 class NormalStorage;
 
+/**
+ * how a stored index is read back
+ */
+enum class StorageBackend {
+    // pages swapped through small fstream-backed frame buffers
+    buffered,
+    // index files mapped read only, for serving; the tree can not be changed
+    mapped,
+};
+
 class RecordStorage {
   public:
+    using Records = std::vector<Record::Pointer>;
     RecordStorage(const Path& dest_dir, int dimension = -1) {}
     RecordStorage() = default;
     RecordStorage(const RecordStorage&) = default;
@@ -308,12 +846,76 @@ class RecordStorage {
      */
     virtual std::unique_ptr<Record> Get(const Rid& rid) {};
 
+    /**
+     * views the record specified by rid in place, storages that can not
+     * hand out views copy it into a scratch record that the view points
+     * at until the next call
+     */
+    virtual Pinned<RecordView> View(const Rid& rid) {
+        scratch_ = Get(rid);
+        return Pinned<RecordView>(
+            RecordView{scratch_->index, scratch_->data.data(),
+                       scratch_->data.size()},
+            nullptr);
+    }
+
+    /**
+     * views the int8 copy of the record of rid, rid has to be of type
+     * Rid::quantized; View and Get of such a rid return the full record
+     */
+    virtual Pinned<QuantizedRecordView> ViewQuantized(const Rid&) {
+        assert(false && "the storage keeps no quantized records");
+        return Pinned<QuantizedRecordView>();
+    }
+
+    /**
+     * finds all records specified by rids, in order
+     */
+    virtual Records GetAll(const std::vector<Rid>& rids) {
+        Records records;
+        records.reserve(rids.size());
+        for (auto& rid : rids) {
+            records.push_back(Get(rid));
+        }
+        return records;
+    }
+
+    /**
+     * starts loading the page of rid without waiting for it, storages held
+     * in memory ignore it
+     */
+    virtual void Prefetch(const Rid&) {}
+
+    /**
+     * frees the slot of rid so that a later Put can reuse it
+     * @return false if the storage can not be changed or rid is not in use
+     */
+    virtual bool Remove(const Rid&) {
+        return false;
+    }
+
+    /**
+     * writes every change made so far out to the index, storages held in
+     * memory have nothing to write
+     */
+    virtual void Flush() {}
+
     /**
      * dump all data to specific path,
      */
     virtual void DumpTo(const Path& dest_dir) {};
 
+    /**
+     * lookups of the buffer pool, storages without one report none
+     */
+    virtual PoolStats Stats() const {
+        return PoolStats();
+    }
+
     virtual ~RecordStorage() {}
+
+  private:
+    Record::Pointer scratch_;
 };
 /**
  * storage store node
@@ -322,35 +924,259 @@ class NodeStorage {
     using BranchStorage = FixedLengthStorage<64, Rid::branch, 2>;
     using LeafStorage = FixedLengthStorage<64, Rid::leaf, 2>;
   public:
-    NodeStorage(const Path& dest_dir, int dimension);
-    std::unique_ptr<BallTreeNode> Get(Rid rid);
-    Rid Put(const BallTreeNode& node);
+    /**
+     * @param format ignored when restoring (dimension == -1), the format
+     * stored with the index is used instead
+     */
+    NodeStorage(const Path& dest_dir, int dimension,
+                const IndexFormat& format = IndexFormat(),
+                const BufferPoolConfig& pool = BufferPoolConfig());
+    /**
+     * keeps the branch and leaf pages, root and dimension in file
+     */
+    NodeStorage(std::shared_ptr<IndexFile> file, int dimension,
+                const IndexFormat& format = IndexFormat(),
+                const BufferPoolConfig& pool = BufferPoolConfig());
+    virtual ~NodeStorage() {}
+    virtual std::unique_ptr<BallTreeNode> Get(Rid rid);
+    virtual Rid Put(const BallTreeNode& node);
+
+    /**
+     * views the branch or leaf specified by rid in place
+     */
+    virtual Pinned<NodeView> View(Rid rid);
 
-    std::unique_ptr<BallTreeNode> GetRoot();
-    Rid PutRoot(const BallTreeNode& node);
+    /**
+     * starts loading the page of the branch or leaf without waiting for it
+     */
+    virtual void Prefetch(Rid rid);
+
+    /**
+     * the root is a leaf if the tree holds at most N0 records
+     */
+    virtual std::unique_ptr<BallTreeNode> GetRoot();
+    virtual Rid PutRoot(const BallTreeNode& node);
+
+    /**
+     * overwrites the stored branch or leaf of rid in place, node has to be
+     * of the same kind
+     */
+    virtual bool Update(Rid rid, const BallTreeNode& node);
+
+    /**
+     * frees the slot of the branch or leaf of rid
+     */
+    virtual bool Remove(Rid rid);
+
+    /**
+     * writes the dirty branch and leaf pages and the free-space maps out
+     */
+    virtual void Flush();
+
+    inline Rid GetRootRid() const {
+        return root;
+    }
 
     inline int GetDimension() {
         return m_dimension;
     }
-  private:
+
+    inline const IndexFormat& GetFormat() const {
+        return m_format;
+    }
+
+    /**
+     * the index an insertion without one gets next, 0 if the index was
+     * written before it was kept
+     */
+    inline int GetNextIndex() const {
+        return m_next_index;
+    }
+    void SetNextIndex(int index);
+
+    /**
+     * lookups and page I/O of the branch pool or of the leaf pool
+     */
+    virtual PoolStats Stats(Rid::DataType type) const;
+
+    /**
+     * root file: Rid root | int dimension | uint8 clustered_leaves |
+     * uint8 norm_sorted_leaves | uint8 cone_bounds | uint8 node_norms |
+     * int32 next_index
+     */
+    static void WriteRootFile(const Path& dest_dir, const Rid& root,
+                              int dimension, const IndexFormat& format,
+                              int next_index);
+  protected:
+    /**
+     * only reads the root file, the subclass brings its own pages
+     */
+    explicit NodeStorage(const Path& dest_dir);
+
+    void ReadRootFile();
+
     int m_dimension;
+    IndexFormat m_format;
     Rid root;
+    int m_next_index = 0;
+    // declared before the storages so that they flush into it first
+    std::shared_ptr<IndexFile> m_file;
+  private:
     std::unique_ptr<BranchStorage> branch_storage;
     std::unique_ptr<LeafStorage> leaf_storage;
+  protected:
     Path dest_dir;
 };
 
+/**
+ * the page files of one FixedLengthStorage mapped read only, a rid resolves
+ * to its slot by pointer arithmetic and which pages stay resident is left
+ * to the kernel
+ */
+class MappedPages {
+  public:
+    /**
+     * maps the pages of type out of the IndexFile in dest_dir when there is
+     * one, from the name.<page_id> files otherwise
+     * @param advice madvise advice applied to every page, e.g. MADV_RANDOM
+     */
+    MappedPages(const Path& dest_dir, const std::string& name,
+                Rid::DataType type, std::size_t page_size, int advice);
+    MappedPages(const MappedPages&) = delete;
+    MappedPages& operator=(const MappedPages&) = delete;
+    ~MappedPages();
+
+    Slot Select(const Rid& rid) const {
+        assert(rid.page_id < static_cast<int>(pages.size()) and
+               pages[rid.page_id]);
+        return Slot(pages[rid.page_id] + slot_size * rid.slot_id, slot_size,
+                    type);
+    }
+
+    /**
+     * MADV_WILLNEED on the page of rid, the kernel reads it in the background
+     */
+    void Prefetch(const Rid& rid) const;
+
+  private:
+    std::vector<Byte*> pages;
+    // (address, length) of every mapping to unmap
+    std::vector<std::pair<void*, std::size_t>> mappings;
+    std::size_t page_size;
+    std::size_t slot_size = 0;
+    Rid::DataType type = Rid::record;
+};
+
+/**
+ * read only node storage over mapped pages, nothing is ever swapped or
+ * copied, views are not pinned since the mapping outlives every search
+ */
+class MappedNodeStorage : public NodeStorage {
+  public:
+    explicit MappedNodeStorage(const Path& dest_dir);
+    virtual std::unique_ptr<BallTreeNode> Get(Rid rid) override;
+    virtual Rid Put(const BallTreeNode& node) override;
+    virtual Pinned<NodeView> View(Rid rid) override;
+    virtual void Prefetch(Rid rid) override;
+    virtual std::unique_ptr<BallTreeNode> GetRoot() override;
+    virtual Rid PutRoot(const BallTreeNode& node) override;
+    virtual bool Update(Rid rid, const BallTreeNode& node) override;
+    virtual bool Remove(Rid rid) override;
+    virtual void Flush() override {}
+    virtual PoolStats Stats(Rid::DataType) const override {
+        // the kernel keeps the pages, there is no pool to count
+        return PoolStats();
+    }
+  private:
+    const MappedPages& PagesOf(const Rid& rid) const {
+        return rid.type == Rid::branch ? branch_pages : leaf_pages;
+    }
+
+    MappedPages branch_pages;
+    MappedPages leaf_pages;
+};
+
+/**
+ * with format.quantized_records, Put stores the record and an int8 copy of
+ * it and returns the rid of the copy; the copies get a buffer pool of their
+ * own of the same size as the one of the full records
+ */
 class NormalStorage: public RecordStorage {
     public:
-    NormalStorage(const Path& dest_dir, int dimension);
+    /**
+     * @param format ignored when restoring (dimension == -1), the format
+     * stored with the index is used instead
+     */
+    NormalStorage(const Path& dest_dir, int dimension,
+                  const BufferPoolConfig& pool = BufferPoolConfig(),
+                  const IndexFormat& format = IndexFormat());
+    NormalStorage(std::shared_ptr<IndexFile> file, int dimension,
+                  const BufferPoolConfig& pool = BufferPoolConfig(),
+                  const IndexFormat& format = IndexFormat());
     virtual Rid Put(const Record& record) override;
     virtual std::unique_ptr<Record> Get(const Rid& rid) override;
-    virtual void DumpTo(const Path& path) override {
+    virtual Pinned<RecordView> View(const Rid& rid) override;
+    virtual Pinned<QuantizedRecordView> ViewQuantized(const Rid& rid) override;
+    virtual void Prefetch(const Rid& rid) override {
+        if (rid.type == Rid::quantized) {
+            quantized->Prefetch(rid.page_id);
+        } else {
+            storage->Prefetch(rid.page_id);
+        }
+    }
+    virtual Records GetAll(const std::vector<Rid>& rids) override;
+    virtual bool Remove(const Rid& rid) override;
+    virtual void Flush() override;
+    virtual void DumpTo(const Path&) override {
         // no op
     }
+    /**
+     * the pools of the full records and of the quantized ones together
+     */
+    virtual PoolStats Stats() const override;
+
+    /**
+     * dimension.bin: int dimension | uint8 quantized_records
+     */
+    static void WriteDimensionFile(const Path& dest_dir, int dimension,
+                                   const IndexFormat& format);
     private:
     using RStorage = FixedLengthStorage<64, Rid::record, 4>;
+    using QStorage = FixedLengthStorage<64, Rid::quantized, 4>;
+
+    /**
+     * the rid of the full record, rid itself unless it is of a quantized one
+     */
+    Rid FullRid(const Rid& rid);
+
+    std::shared_ptr<IndexFile> file;
     std::unique_ptr<RStorage> storage;
+    // nullptr unless the records are quantized
+    std::unique_ptr<QStorage> quantized;
+};
+
+/**
+ * read only record storage over mapped pages, for serving a stored index
+ */
+class MappedRecordStorage : public RecordStorage {
+  public:
+    explicit MappedRecordStorage(const Path& dest_dir);
+    virtual Rid Put(const Record& record) override;
+    virtual std::unique_ptr<Record> Get(const Rid& rid) override;
+    virtual Pinned<RecordView> View(const Rid& rid) override;
+    virtual Pinned<QuantizedRecordView> ViewQuantized(const Rid& rid) override;
+    virtual void Prefetch(const Rid& rid) override {
+        (rid.type == Rid::quantized ? quantized_pages : pages).Prefetch(rid);
+    }
+    virtual void DumpTo(const Path&) override {
+        // no op
+    }
+  private:
+    Rid FullRid(const Rid& rid) const;
+
+    MappedPages pages;
+    // empty unless the records are quantized
+    MappedPages quantized_pages;
 };
 
 /**
@@ -370,7 +1196,16 @@ class SimpleStorage : public RecordStorage {
         }
         return std::make_unique<Record>(iter->second);
     }
-    virtual void DumpTo(const Path& dest_dir) override {
+    virtual Pinned<RecordView> View(const Rid& rid) override {
+        auto& record = s_.at(rid.page_id);
+        return Pinned<RecordView>(
+            RecordView{record.index, record.data.data(), record.data.size()},
+            nullptr);
+    }
+    virtual bool Remove(const Rid& rid) override {
+        return s_.erase(rid.page_id) > 0;
+    }
+    virtual void DumpTo(const Path&) override {
         // no-op
     }
 
@@ -381,12 +1216,57 @@ class SimpleStorage : public RecordStorage {
 
 namespace storage_factory {
 
-inline std::unique_ptr<RecordStorage> GetRecordStorage(Path& dest_dir, int dim) {
-    return std::unique_ptr<RecordStorage>(new NormalStorage(dest_dir, dim));
+inline std::unique_ptr<RecordStorage> GetRecordStorage(
+    Path& dest_dir, int dim, const BufferPoolConfig& pool = BufferPoolConfig()) {
+    return std::unique_ptr<RecordStorage>(new NormalStorage(dest_dir, dim, pool));
+}
+
+inline std::unique_ptr<NodeStorage> GetNodeStorage(
+    Path& dest_dir, int dim, const IndexFormat& format = IndexFormat(),
+    const BufferPoolConfig& pool = BufferPoolConfig()) {
+    return std::make_unique<NodeStorage>(dest_dir, dim, format, pool);
+}
+
+/**
+ * storages reading an existing index with the given backend
+ */
+inline std::shared_ptr<IndexFile> GetIndexFile(Path& dest_dir, bool create) {
+    // NodeStorage and NormalStorage both page in 64k
+    return std::make_shared<IndexFile>(dest_dir, 64 * 1024, create);
+}
+
+inline std::unique_ptr<RecordStorage> GetRecordStorage(
+    std::shared_ptr<IndexFile> file, int dim,
+    const BufferPoolConfig& pool = BufferPoolConfig()) {
+    return std::make_unique<NormalStorage>(std::move(file), dim, pool);
+}
+
+inline std::unique_ptr<NodeStorage> GetNodeStorage(
+    std::shared_ptr<IndexFile> file, int dim,
+    const IndexFormat& format = IndexFormat(),
+    const BufferPoolConfig& pool = BufferPoolConfig()) {
+    return std::make_unique<NodeStorage>(std::move(file), dim, format, pool);
+}
+
+/**
+ * @param pool ignored by the mapped backend
+ */
+inline std::unique_ptr<RecordStorage> GetRecordStorage(
+    Path& dest_dir, StorageBackend backend,
+    const BufferPoolConfig& pool = BufferPoolConfig()) {
+    if (backend == StorageBackend::mapped) {
+        return std::make_unique<MappedRecordStorage>(dest_dir);
+    }
+    return GetRecordStorage(dest_dir, -1, pool);
 }
 
-inline std::unique_ptr<NodeStorage> GetNodeStorage(Path& dest_dir, int dim) {
-    return std::make_unique<NodeStorage>(dest_dir, dim);
+inline std::unique_ptr<NodeStorage> GetNodeStorage(
+    Path& dest_dir, StorageBackend backend,
+    const BufferPoolConfig& pool = BufferPoolConfig()) {
+    if (backend == StorageBackend::mapped) {
+        return std::make_unique<MappedNodeStorage>(dest_dir);
+    }
+    return GetNodeStorage(dest_dir, -1, IndexFormat(), pool);
 }
 
 
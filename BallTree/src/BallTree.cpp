@@ -14,24 +14,30 @@ Records BallTree::ArrayToVector(int n, int d, float** data) {
     return v;
 }
 
-bool BallTree::buildTree(int n, int d, float** data) {
-    impl_ = std::make_unique<BallTreeImpl>(ArrayToVector(n, d, data));
+bool BallTree::buildTree(
+    int n, int d, float** data, int threads, NodeBound bound) {
+    impl_ = std::make_unique<BallTreeImpl>(
+        ArrayToVector(n, d, data), &Pool(threads),
+        BallTreeImpl::kParallelBuildCutoff, BallTreeImpl::kParallelScanCutoff,
+        bound);
     impl_->SetDimension(d);
     dim = d;
     return true;
 }
 
-bool BallTree::storeTree(const char* index_path) {
+bool BallTree::storeTree(const char* index_path, const IndexFormat& format) {
     if (not impl_) {
         return false;
     }
     std::string index(index_path);
-    return impl_->StoreTree(index);
+    return impl_->StoreTree(index, format);
 }
 
-bool BallTree::restoreTree(const char* index_path) {
+bool BallTree::restoreTree(
+    const char* index_path, StorageBackend backend,
+    const BufferPoolConfig& pool) {
     std::string index(index_path);
-    impl_ = std::make_unique<BallTreeImpl>(index);
+    impl_ = std::make_unique<BallTreeImpl>(index, backend, pool);
     impl_->SetDimension(dim);
     return true;
 }
@@ -43,16 +49,124 @@ int BallTree::mipSearch(int d, float* query) {
     return impl_->Search(std::vector<float>(query, query + d)).first;
 }
 
+int BallTree::mipSearchTopK(
+    int d, float* query, int k, int* out_indices, float* out_scores) {
+    if (not impl_) {
+        return -1;
+    }
+    auto result = impl_->SearchTopK(std::vector<float>(query, query + d), k);
+    for (std::size_t i = 0; i < result.size(); ++i) {
+        out_indices[i] = result[i].first;
+        if (out_scores) {
+            out_scores[i] = result[i].second;
+        }
+    }
+    return result.size();
+}
+
+int BallTree::mipSearchTopK(
+    int d, float* query, int k, int* out_indices, float* out_scores,
+    const SearchBudget& budget, bool* exact) {
+    if (not impl_) {
+        return -1;
+    }
+    auto result = impl_->SearchTopK(
+        std::vector<float>(query, query + d), k, budget, exact);
+    for (std::size_t i = 0; i < result.size(); ++i) {
+        out_indices[i] = result[i].first;
+        if (out_scores) {
+            out_scores[i] = result[i].second;
+        }
+    }
+    return result.size();
+}
+
+bool BallTree::mipSearchBatch(int nq, int d, float** queries, int* out) {
+    if (not impl_) {
+        return false;
+    }
+    std::vector<std::vector<float>> vs;
+    vs.reserve(nq);
+    for (int i = 0; i < nq; ++i) {
+        vs.emplace_back(queries[i], queries[i] + d);
+    }
+    auto result = impl_->SearchBatch(vs);
+    std::copy(begin(result), end(result), out);
+    return true;
+}
+
+bool BallTree::mipSearchParallel(
+    int nq, int d, float** queries, int* out, int threads) {
+    if (not impl_) {
+        return false;
+    }
+    std::vector<std::vector<float>> vs;
+    vs.reserve(nq);
+    for (int i = 0; i < nq; ++i) {
+        vs.emplace_back(queries[i], queries[i] + d);
+    }
+    auto result = impl_->SearchParallel(vs, Pool(threads));
+    std::copy(begin(result), end(result), out);
+    return true;
+}
+
+bool BallTree::flattenTree() {
+    if (not impl_) {
+        return false;
+    }
+    return impl_->Flatten();
+}
+
+bool BallTree::buildQuantizer(int subspaces) {
+    if (not impl_) {
+        return false;
+    }
+    return impl_->Quantize(subspaces);
+}
+
+int BallTree::mipSearchApproximateTopK(
+    int d, float* query, int k, int* out_indices, float* out_scores,
+    int candidates) {
+    if (not impl_) {
+        return -1;
+    }
+    auto result = impl_->SearchApproximate(
+        std::vector<float>(query, query + d), k, std::max(candidates, 0));
+    for (std::size_t i = 0; i < result.size(); ++i) {
+        out_indices[i] = result[i].first;
+        if (out_scores) {
+            out_scores[i] = result[i].second;
+        }
+    }
+    return result.size();
+}
+
+TreeStats BallTree::stats() const {
+    if (not impl_) {
+        return TreeStats();
+    }
+    return impl_->Stats();
+}
+
+ThreadPool& BallTree::Pool(int threads) {
+    std::size_t pool_size =
+        threads > 0 ? threads : std::thread::hardware_concurrency();
+    if (not pool_ or pool_->Size() != pool_size) {
+        pool_ = std::make_unique<ThreadPool>(pool_size);
+    }
+    return *pool_;
+}
+
 
 /**
- * Additional task (not written now)
+ * Additional task
  */
 
-bool BallTree::insertData(int d, float* data) {
+bool BallTree::insertData(int d, float* data, int index) {
     if (not impl_) {
-        return -1;
+        return false;
     }
-    return impl_->Insert(std::vector<float>(data, data + d));
+    return impl_->Insert(std::vector<float>(data, data + d), index);
 }
 
 
@@ -60,7 +174,32 @@ bool BallTree::deleteData(int d, float* data) {
     if (not impl_) {
         return false;
     }
-    return impl_->Insert(std::vector<float>(data, data + d));
+    return impl_->Delete(std::vector<float>(data, data + d));
+}
+
+
+bool BallTree::setMergeThreshold(std::size_t updates) {
+    if (not impl_) {
+        return false;
+    }
+    impl_->SetMergeThreshold(updates);
+    return true;
+}
+
+bool BallTree::setSearchOrder(SearchOrder order) {
+    if (not impl_) {
+        return false;
+    }
+    impl_->SetSearchOrder(order);
+    return true;
+}
+
+
+bool BallTree::mergeUpdates() {
+    if (not impl_) {
+        return false;
+    }
+    return impl_->Merge();
 }
 
 
@@ -5,33 +5,260 @@ using Records = std::vector<Record::Pointer>;
 /**
  * build the balltree from index file
  */
-BallTreeImpl::BallTreeImpl(Path& index_path):dim(-1) {
-    if (not record_storage_) {
-        record_storage_ = storage_factory::GetRecordStorage(index_path, dim);
-        node_storage_ = storage_factory::GetNodeStorage(index_path, dim);
+BallTreeImpl::BallTreeImpl(
+    Path& index_path, StorageBackend backend, const BufferPoolConfig& pool)
+    : dim(-1), index_path_(index_path), backend_(backend),
+      pool_config_(pool) {
+    if (backend == StorageBackend::buffered and
+        IndexFile::Exists(index_path)) {
+        // both storages page through the one descriptor
+        auto file = storage_factory::GetIndexFile(index_path, false);
+        record_storage_ = storage_factory::GetRecordStorage(file, dim, pool);
+        node_storage_ =
+            storage_factory::GetNodeStorage(file, dim, IndexFormat(), pool);
+    } else if (not record_storage_) {
+        record_storage_ =
+            storage_factory::GetRecordStorage(index_path, backend, pool);
+        node_storage_ =
+            storage_factory::GetNodeStorage(index_path, backend, pool);
     }
     root_ = node_storage_->GetRoot();
+    if (root_ and not root_->cone.Empty()) {
+        bound_ = NodeBound::cone;
+    }
+    next_index_ = node_storage_->GetNextIndex();
 }
 
 /**
  * build the balltree from plain index and vector data
  */
-BallTreeImpl::BallTreeImpl(Records&& records)
+BallTreeImpl::BallTreeImpl(
+    Records&& records, ThreadPool* pool, std::size_t parallel_build_cutoff,
+    std::size_t parallel_scan_cutoff, NodeBound bound)
     :
 #ifdef BALLTREE_TESTING_ALGORITHM
       record_storage_(storage_factory::GetSimpleStorage()),
 #endif
-      root_(BuildTree(std::move(records))) {
+      pool_(pool),
+      parallel_build_cutoff_(parallel_build_cutoff),
+      parallel_scan_cutoff_(parallel_scan_cutoff), bound_(bound) {
+    for (auto& record : records) {
+        next_index_ = std::max(next_index_, record->index + 1);
+    }
+    root_ = BuildTree(std::move(records));
+    // the pool belongs to the caller, it is only borrowed for the build
+    pool_ = nullptr;
+}
+
+BallTreeImpl::~BallTreeImpl() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        keep_flat_ = false;
+        if (node_storage_ and root_) {
+            MergeAll();
+        }
+        // a merge still running finds nothing left and stops
+        delta_ = DeltaSegment();
+        merging_ = DeltaSegment();
+    }
+    if (merge_.valid()) {
+        merge_.get();
+    }
+}
+
+constexpr std::size_t BallTreeImpl::kParallelBuildCutoff;
+constexpr std::size_t BallTreeImpl::kParallelScanCutoff;
+constexpr std::size_t BallTreeImpl::kMergeThreshold;
+
+namespace {
+
+/**
+ * records handled by one chunk of a parallel scan over n records, a few
+ * chunks per worker so that stealing can even out the load
+ */
+std::size_t ScanGrain(const ThreadPool& pool, std::size_t n) {
+    return std::max<std::size_t>(n / (pool.Size() * 4), 256);
+}
+
+/**
+ * how far a ball has to grow to cover v and how far v is from its center,
+ * an insertion descends into the child for which this is smaller
+ */
+std::pair<double, double> Growth(
+    const float* center, double radius, const std::vector<float>& v) {
+    double distance =
+        std::sqrt(kernels::SquaredL2(center, v.data(), v.size()));
+    return {std::max(distance - radius, 0.0), distance};
+}
+
+std::pair<double, double> Growth(
+    const NodeView& node, const std::vector<float>& v) {
+    return Growth(node.center, node.radius, v);
+}
+
+/**
+ * whether a ball may hold v, with some slack for the rounding of radii
+ */
+bool MayContain(const BallTreeNode& node, const std::vector<float>& v) {
+    return Distance(node.center, v) <= node.radius + 1e-4;
+}
+
+/**
+ * which half of an overfull leaf every record goes to, split by the pivots
+ * like a build does, or in halves when every record is the same point
+ */
+std::vector<char> SplitSides(const Records& records) {
+    Record *a, *b;
+    std::tie(a, b) = BallTreeImpl::PickPivots(records);
+    std::vector<char> to_first(records.size());
+    std::size_t first_size = 0;
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        to_first[i] = Distance(records[i]->data, a->data) <
+                      Distance(records[i]->data, b->data);
+        first_size += to_first[i];
+    }
+    if (first_size == 0 or first_size == records.size()) {
+        for (std::size_t i = 0; i < records.size(); ++i) {
+            to_first[i] = i < records.size() / 2;
+        }
+    }
+    return to_first;
+}
+
+/**
+ * orders the records of a leaf by descending norm, ties keep their order,
+ * see IndexFormat::norm_sorted_leaves
+ */
+void SortByNorm(Records& records) {
+    std::vector<std::pair<double, Record::Pointer>> by_norm;
+    by_norm.reserve(records.size());
+    for (auto& record : records) {
+        by_norm.emplace_back(Norm(record->data), std::move(record));
+    }
+    std::stable_sort(
+        begin(by_norm), end(by_norm),
+        [](const auto& a, const auto& b) { return a.first > b.first; });
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        records[i] = std::move(by_norm[i].second);
+    }
+}
+
+/**
+ * the smallest and largest norm of records, see IndexFormat::node_norms
+ */
+std::pair<double, double> NormRange(const Records& records) {
+    std::pair<double, double> ret(std::numeric_limits<double>::max(), 0);
+    for (auto& record : records) {
+        double norm = Norm(record->data);
+        ret.first = std::min(ret.first, norm);
+        ret.second = std::max(ret.second, norm);
+    }
+    return ret;
 }
 
+/**
+ * widens the range of the norms below node to hold norm, a node whose
+ * norms are not known is left alone
+ * @return whether it changed
+ */
+bool CoverNorm(BallTreeNode& node, double norm) {
+    if (node.max_norm == kUnknownNorm) {
+        return false;
+    }
+    bool changed = false;
+    if (norm < node.min_norm) {
+        node.min_norm = norm;
+        changed = true;
+    }
+    if (norm > node.max_norm) {
+        node.max_norm = norm;
+        changed = true;
+    }
+    return changed;
+}
+
+/**
+ * a leaf of stored records, records[i] is stored at rids[i]; the rids are
+ * sorted by the norms of their records and the norms kept with them, the
+ * records are moved to raw_data in the same order
+ */
+BallTreeLeaf::Pointer LeafOf(
+    Records& records, std::vector<Rid>&& rids, NodeBound bound) {
+    auto center = BallTreeImpl::CalculateCenter(records);
+    double radius = BallTreeImpl::CalculateRadius(records, center);
+    std::vector<std::pair<float, std::size_t>> by_norm;
+    by_norm.reserve(records.size());
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        by_norm.emplace_back(Norm(records[i]->data), i);
+    }
+    std::stable_sort(
+        begin(by_norm), end(by_norm),
+        [](const auto& a, const auto& b) { return a.first > b.first; });
+    std::vector<Rid> sorted;
+    std::vector<float> norms;
+    for (auto& entry : by_norm) {
+        norms.push_back(entry.first);
+        sorted.push_back(rids[entry.second]);
+    }
+    auto leaf = BallTreeLeaf::Create(std::move(center), radius, std::move(sorted));
+    leaf->norms = std::move(norms);
+    std::tie(leaf->min_norm, leaf->max_norm) = NormRange(records);
+    if (bound == NodeBound::cone) {
+        leaf->cone = ConeBound::Of(records);
+    }
+    for (auto& entry : by_norm) {
+        leaf->raw_data.push_back(std::move(records[entry.second]));
+    }
+    return leaf;
+}
+
+/**
+ * adds record, stored at rid, to a stored leaf, at its place by norm if the
+ * leaf keeps the norms of its records; raw_data follows data if the leaf
+ * carries its records, see IndexFormat::clustered_leaves
+ */
+void InsertByNorm(BallTreeLeaf& leaf, const Rid& rid, Record::Pointer record) {
+    auto position = leaf.data.size();
+    if (leaf.norms.size() == leaf.data.size()) {
+        float norm = Norm(record->data);
+        auto at = std::upper_bound(
+            begin(leaf.norms), end(leaf.norms), norm, std::greater<float>());
+        position = at - begin(leaf.norms);
+        leaf.norms.insert(at, norm);
+    }
+    if (leaf.raw_data.size() == leaf.data.size()) {
+        leaf.raw_data.insert(begin(leaf.raw_data) + position, std::move(record));
+    }
+    leaf.data.insert(begin(leaf.data) + position, rid);
+}
+
+}  // anonymous namespace
+
 /**
  * functions for calculations
  */
-std::vector<float> BallTreeImpl::CalculateCenter(const Records& records) {
+std::vector<float> BallTreeImpl::CalculateCenter(
+    const Records& records, ThreadPool* pool) {
     assert(records.size() > 0);
     std::vector<float> center(records.front()->Size(), 0);
-    for (auto& record : records) {
-        Combine(center, record->data, std::plus<float>());
+    if (pool) {
+        // split by dimension, every coordinate is still summed in record
+        // order
+        auto dimension = center.size();
+        auto grain = std::max<std::size_t>(1, dimension / pool->Size());
+        pool->ParallelFor(
+            0, dimension, grain,
+            [&records, &center](std::size_t first, std::size_t last) {
+                for (auto& record : records) {
+                    for (auto j = first; j < last; ++j) {
+                        center[j] = center[j] + record->data[j];
+                    }
+                }
+            });
+    } else {
+        for (auto& record : records) {
+            Combine(center, record->data, std::plus<float>());
+        }
     }
     auto s = records.size();
     ApplyElementwise(center, [s](float x) { return x / s; });
@@ -39,37 +266,100 @@ std::vector<float> BallTreeImpl::CalculateCenter(const Records& records) {
 }
 
 double BallTreeImpl::CalculateRadius(
-    const Records& records, const std::vector<float>& center) {
-    return std::accumulate(
-        begin(records), end(records), 0.0,
-        [&center](double acc, const Record::Pointer& record) {
-            return std::max(Distance(center, record->data), acc);
+    const Records& records, const std::vector<float>& center,
+    ThreadPool* pool) {
+    auto radius_of = [&records, &center](std::size_t first, std::size_t last) {
+        return std::accumulate(
+            begin(records) + first, begin(records) + last, 0.0,
+            [&center](double acc, const Record::Pointer& record) {
+                return std::max(Distance(center, record->data), acc);
+            });
+    };
+    if (not pool) {
+        return radius_of(0, records.size());
+    }
+    auto grain = ScanGrain(*pool, records.size());
+    std::vector<double> partial((records.size() - 1) / grain + 1);
+    pool->ParallelFor(
+        0, records.size(), grain,
+        [&partial, &radius_of, grain](std::size_t first, std::size_t last) {
+            partial[first / grain] = radius_of(first, last);
         });
+    return *std::max_element(begin(partial), end(partial));
 }
 
-Record* BallTreeImpl::ChooseFarthest(const Records& records, Record* pivot) {
-    double max_distance = 0;
-    Record* result = pivot;
-    for (auto& record : records) {
-        double new_distance = Distance(record->data, pivot->data);
-        if (new_distance > max_distance) {
-            max_distance = new_distance;
-            result = record.get();
+Record* BallTreeImpl::ChooseFarthest(
+    const Records& records, Record* pivot, ThreadPool* pool) {
+    using Farthest = std::pair<double, Record*>;
+    auto farthest_of = [&records, pivot](std::size_t first, std::size_t last) {
+        double max_distance = 0;
+        Record* result = pivot;
+        for (auto i = first; i < last; ++i) {
+            double new_distance = Distance(records[i]->data, pivot->data);
+            if (new_distance > max_distance) {
+                max_distance = new_distance;
+                result = records[i].get();
+            }
         }
+        return Farthest(max_distance, result);
+    };
+    if (not pool) {
+        return farthest_of(0, records.size()).second;
     }
-    return result;
+    auto grain = ScanGrain(*pool, records.size());
+    std::vector<Farthest> partial((records.size() - 1) / grain + 1);
+    pool->ParallelFor(
+        0, records.size(), grain,
+        [&partial, &farthest_of, grain](std::size_t first, std::size_t last) {
+            partial[first / grain] = farthest_of(first, last);
+        });
+    // the earliest chunk wins a tie, as the earliest record does serially
+    Farthest result(0, pivot);
+    for (auto& farthest : partial) {
+        if (farthest.first > result.first) {
+            result = farthest;
+        }
+    }
+    return result.second;
 }
 
-std::pair<Record*, Record*> BallTreeImpl::PickPivots(const Records& records) {
+std::pair<Record*, Record*> BallTreeImpl::PickPivots(
+    const Records& records, ThreadPool* pool) {
     assert(records.size() >= 2);
     auto& arbitrary(records.front());
-    Record* a = ChooseFarthest(records, arbitrary.get());
-    Record* b = ChooseFarthest(records, a);
+    Record* a = ChooseFarthest(records, arbitrary.get(), pool);
+    Record* b = ChooseFarthest(records, a, pool);
     return {a, b};
 }
 
 std::pair<Records, Records> BallTreeImpl::SplitRecord(
-    Records&& records, Record* a, Record* b) {
+    Records&& records, Record* a, Record* b, ThreadPool* pool) {
+    if (pool) {
+        // evaluate the predicate in parallel, then run the same partition
+        // over positions so that the records end up in the serial order
+        std::vector<char> closer_to_a(records.size());
+        pool->ParallelFor(
+            0, records.size(), ScanGrain(*pool, records.size()),
+            [&](std::size_t first, std::size_t last) {
+                for (auto i = first; i < last; ++i) {
+                    closer_to_a[i] = Distance(records[i]->data, a->data) <
+                                     Distance(records[i]->data, b->data);
+                }
+            });
+        std::vector<std::size_t> positions(records.size());
+        std::iota(begin(positions), end(positions), 0);
+        auto mid = std::partition(
+            begin(positions), end(positions),
+            [&closer_to_a](std::size_t i) { return closer_to_a[i]; });
+        std::pair<Records, Records> ret;
+        ret.first.reserve(mid - begin(positions));
+        ret.second.reserve(end(positions) - mid);
+        for (auto iter = begin(positions); iter != end(positions); ++iter) {
+            auto& side = iter < mid ? ret.first : ret.second;
+            side.push_back(std::move(records[*iter]));
+        }
+        return ret;
+    }
     auto mid = std::partition(
         begin(records), end(records),
         [a, b](const Record::Pointer& record) {
@@ -85,10 +375,11 @@ std::pair<Records, Records> BallTreeImpl::SplitRecord(
             std::make_move_iterator(end(records))));
 }
 
-std::pair<Records, Records> BallTreeImpl::SplitRecord(Records&& records) {
+std::pair<Records, Records> BallTreeImpl::SplitRecord(
+    Records&& records, ThreadPool* pool) {
     Record *a, *b;
-    std::tie(a, b) = PickPivots(records);
-    return SplitRecord(std::move(records), a, b);
+    std::tie(a, b) = PickPivots(records, pool);
+    return SplitRecord(std::move(records), a, b, pool);
 }
 
 /**
@@ -98,17 +389,46 @@ std::pair<Records, Records> BallTreeImpl::SplitRecord(Records&& records) {
 BallTreeLeaf::Pointer BallTreeImpl::BuildTreeLeaf(Records& records) {
     std::vector<float> center(CalculateCenter(records));
     double radius(CalculateRadius(records, center));
-    return BallTreeLeaf::Create(std::move(center), radius, std::move(records));
+    SortByNorm(records);
+    auto leaf =
+        BallTreeLeaf::Create(std::move(center), radius, std::move(records));
+    std::tie(leaf->min_norm, leaf->max_norm) = NormRange(leaf->raw_data);
+    if (bound_ == NodeBound::cone) {
+        leaf->cone = ConeBound::Of(leaf->raw_data);
+    }
+    return leaf;
 }
 
 
 BallTreeBranch::Pointer BallTreeImpl::BuildTreeBranch(Records&& data) {
-    std::vector<float> center(CalculateCenter(data));
-    double radius(CalculateRadius(data, center));
-    std::pair<Records, Records> split_result(SplitRecord(std::move(data)));
-    return BallTreeBranch::Create(
-        std::move(center), radius, BuildTree(std::move(split_result.first)),
-        BuildTree(std::move(split_result.second)));
+    ThreadPool* scan_pool =
+        data.size() > parallel_scan_cutoff_ ? pool_ : nullptr;
+    std::vector<float> center(CalculateCenter(data, scan_pool));
+    double radius(CalculateRadius(data, center, scan_pool));
+    auto norms = NormRange(data);
+    ConeBound cone;
+    if (bound_ == NodeBound::cone) {
+        cone = ConeBound::Of(data);
+    }
+    std::pair<Records, Records> split_result(
+        SplitRecord(std::move(data), scan_pool));
+    BallTreeBranch::Pointer branch;
+    if (pool_ and split_result.first.size() > parallel_build_cutoff_ and
+        split_result.second.size() > parallel_build_cutoff_) {
+        auto left = pool_->Submit([this, &split_result] {
+            return BuildTree(std::move(split_result.first));
+        });
+        auto right = BuildTree(std::move(split_result.second));
+        branch = BallTreeBranch::Create(
+            std::move(center), radius, pool_->Join(left), std::move(right));
+    } else {
+        branch = BallTreeBranch::Create(
+            std::move(center), radius, BuildTree(std::move(split_result.first)),
+            BuildTree(std::move(split_result.second)));
+    }
+    std::tie(branch->min_norm, branch->max_norm) = norms;
+    branch->cone = std::move(cone);
+    return branch;
 }
 
 BallTreeNode::Pointer BallTreeImpl::BuildTree(Records&& records) {
@@ -134,15 +454,40 @@ std::vector<Rid> BallTreeImpl::StoreAll(const Records& records) {
 /**
  * store the balltree to an index file
  */
-bool BallTreeImpl::StoreTree(Path& index_path) {
+bool BallTreeImpl::StoreTree(Path& index_path, const IndexFormat& format) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not root_) {
+        return false;
+    }
+    MergeAll();
     if (not record_storage_) {
-        record_storage_ = storage_factory::GetRecordStorage(index_path, dim);
-        node_storage_ = storage_factory::GetNodeStorage(index_path, dim);
+        // the tree is still in memory, stream it out in one pass
+        IndexFormat stored(format);
+        stored.cone_bounds = bound_ == NodeBound::cone;
+        auto leaf_size = Slot::GetSize(
+            Rid::leaf, dim, stored.norm_sorted_leaves, stored.node_norms,
+            stored.cone_bounds, stored.clustered_leaves);
+        if (Page::SlotsPerPage(leaf_size, 64) < 1) {
+            assert(false && "a leaf of this index does not fit in a page");
+            return false;
+        }
+        std::shared_ptr<IndexFile> file;
+        if (format.single_file) {
+            file = storage_factory::GetIndexFile(index_path, true);
+        } else {
+            // a restore would pick up a single file left by an earlier store
+            std::remove((index_path + IndexFile::kFileName).data());
+        }
+        BulkStorer visitor(index_path, dim, stored, std::move(file));
+        visitor.Store(*root_, next_index_);
+        root_ = nullptr;
+        return true;
     }
 
     NodeStorer visitor(node_storage_.get(), record_storage_.get());
     root_->Accept(visitor);
 
+    node_storage_->SetNextIndex(next_index_);
     node_storage_->PutRoot(*root_.get());
 
     root_ = nullptr;
@@ -156,13 +501,215 @@ bool BallTreeImpl::StoreTree(Path& index_path) {
  * vector given
  */
 std::pair<int, double> BallTreeImpl::Search(const std::vector<float>& v) {
-    if (not root_) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not root_ and not flat_) {
         assert(false && "root is nullptr!");
         return {-1, 0};
     }
-    MIPSearcher visitor(v, record_storage_.get(), node_storage_.get());
+    auto results = SearchTree(v, 1);
+    delta_.Scan(v, 1, results);
+    merging_.Scan(v, 1, results);
+    if (results.empty()) {
+        return {-1, 0};
+    }
+    return results.front();
+}
+
+/**
+ * returns at most k (index, inner product) pairs with the largest inner
+ * products with the vector given, best first
+ */
+std::vector<std::pair<int, double>> BallTreeImpl::SearchTopK(
+    const std::vector<float>& v, int k) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not root_ and not flat_) {
+        assert(false && "root is nullptr!");
+        return {};
+    }
+    if (k <= 0) {
+        return {};
+    }
+    auto results = SearchTree(v, k);
+    delta_.Scan(v, k, results);
+    merging_.Scan(v, k, results);
+    return results;
+}
+
+std::vector<std::pair<int, double>> BallTreeImpl::SearchTopK(
+    const std::vector<float>& v, int k, const SearchBudget& budget,
+    bool* exact) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (exact) {
+        *exact = true;
+    }
+    if (not root_ and not flat_) {
+        assert(false && "root is nullptr!");
+        return {};
+    }
+    if (k <= 0) {
+        return {};
+    }
+    auto results = SearchTree(v, k, &budget, exact);
+    delta_.Scan(v, k, results);
+    merging_.Scan(v, k, results);
+    return results;
+}
+
+std::vector<std::pair<int, double>> BallTreeImpl::SearchTree(
+    const std::vector<float>& v, std::size_t k, const SearchBudget* budget,
+    bool* exact) {
+    ++query_stats_.queries;
+    if (flat_) {
+        return flat_->SearchTopK(
+            v, k, &query_stats_, Skip(), budget, exact, search_order_);
+    }
+    MIPSearcher visitor(v, record_storage_.get(), node_storage_.get(), k,
+                        pool_config_.prefetch, Skip(), budget, search_order_);
     root_->Accept(visitor);
-    return {visitor.ResultIndex(), visitor.ResultMIP()};
+    query_stats_ += visitor.Stats();
+    if (exact) {
+        *exact = visitor.Exact();
+    }
+    return visitor.Results();
+}
+
+/**
+ * returns the index of the vector with the maximum inner product for every
+ * vector given, the queries traverse the tree block by block
+ */
+std::vector<int> BallTreeImpl::SearchBatch(
+    const std::vector<std::vector<float>>& vs) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return AnswerBatch(vs);
+}
+
+std::vector<int> BallTreeImpl::AnswerBatch(
+    const std::vector<std::vector<float>>& vs) {
+    if (not root_ and not flat_) {
+        assert(false && "root is nullptr!");
+        return std::vector<int>(vs.size(), -1);
+    }
+    auto results = SearchBatchTree(vs, Skip());
+    std::vector<int> ret;
+    ret.reserve(vs.size());
+    for (std::size_t i = 0; i < vs.size(); ++i) {
+        ret.push_back(AnswerWithDelta(vs[i], results[i]));
+    }
+    return ret;
+}
+
+std::vector<std::pair<int, double>> BallTreeImpl::SearchBatchTree(
+    const std::vector<std::vector<float>>& vs, const Tombstones* skip) {
+    if (flat_) {
+        return SearchFlat(vs, query_stats_, skip);
+    }
+    std::vector<std::pair<int, double>> ret;
+    ret.reserve(vs.size());
+    for (auto iter = begin(vs); iter != end(vs);) {
+        auto block_end =
+            iter + std::min<std::ptrdiff_t>(
+                       BatchMIPSearcher::kBlockSize, end(vs) - iter);
+        std::vector<std::vector<float>> block(iter, block_end);
+        BatchMIPSearcher visitor(block, record_storage_.get(),
+                                 node_storage_.get(), pool_config_.prefetch,
+                                 skip);
+        root_->Accept(visitor);
+        query_stats_.queries += block.size();
+        query_stats_ += visitor.Stats();
+        for (std::size_t q = 0; q < block.size(); ++q) {
+            ret.emplace_back(visitor.ResultIndices()[q],
+                             visitor.ResultMIPs()[q]);
+        }
+        iter = block_end;
+    }
+    return ret;
+}
+
+int BallTreeImpl::AnswerWithDelta(
+    const std::vector<float>& v,
+    const std::pair<int, double>& tree_result) const {
+    if (delta_.Empty() and merging_.Empty()) {
+        return tree_result.first;
+    }
+    DeltaSegment::Results results;
+    if (tree_result.first != -1) {
+        results.push_back(tree_result);
+    }
+    delta_.Scan(v, 1, results);
+    merging_.Scan(v, 1, results);
+    return results.empty() ? -1 : results.front().first;
+}
+
+/**
+ * SearchBatch spread over the workers of pool, every worker searches through
+ * its own reader since storages are not thread safe
+ */
+std::vector<int> BallTreeImpl::SearchParallel(
+    const std::vector<std::vector<float>>& vs, ThreadPool& pool) {
+    // a merge waits until the workers are done; the tasks never take the
+    // lock, so holding it while they run can not deadlock them
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index_path_.empty() and not flat_) {
+        // nothing to open readers from, fall back to this thread
+        return AnswerBatch(vs);
+    }
+    if (changed_) {
+        // the readers open the index from disk, write the changes out first
+        CloseReaders();
+        node_storage_->Flush();
+        record_storage_->Flush();
+        changed_ = false;
+    }
+    // one slot per worker and a last one for threads outside the pool,
+    // which run a task when they join tasks of the pool
+    if (readers_.size() != pool.Size() + 1) {
+        CloseReaders();
+        readers_.resize(pool.Size() + 1);
+    }
+    if (worker_query_stats_.size() < pool.Size() + 1) {
+        worker_query_stats_.resize(pool.Size() + 1);
+    }
+    std::vector<int> ret(vs.size(), -1);
+    std::vector<std::future<void>> tasks;
+    for (std::size_t first = 0; first < vs.size();
+         first += BatchMIPSearcher::kBlockSize) {
+        std::size_t last =
+            std::min(first + BatchMIPSearcher::kBlockSize, vs.size());
+        tasks.push_back(pool.Submit([this, &pool, &vs, &ret, first, last] {
+            std::vector<std::vector<float>> block(
+                begin(vs) + first, begin(vs) + last);
+            int worker = pool.WorkerIndex();
+            std::size_t slot = worker >= 0 ? worker : pool.Size();
+            // several threads outside the pool may share the last slot
+            std::unique_lock<std::mutex> outside;
+            if (worker < 0) {
+                outside = std::unique_lock<std::mutex>(outside_mutex_);
+            }
+            std::vector<std::pair<int, double>> result;
+            if (flat_) {
+                // the flat tree is read only, every worker can share it
+                result = SearchFlat(block, worker_query_stats_[slot], Skip());
+            } else {
+                // only this worker touches its own reader
+                auto& reader = readers_[slot];
+                if (not reader) {
+                    reader = std::make_unique<BallTreeImpl>(
+                        index_path_, backend_, pool_config_);
+                }
+                result = reader->SearchBatchTree(block, Skip());
+            }
+            // the segments are only read while the lock is held
+            for (std::size_t q = 0; q < block.size(); ++q) {
+                ret[first + q] = AnswerWithDelta(block[q], result[q]);
+            }
+        }));
+    }
+    // joined rather than waited for, so that a caller running on a worker
+    // of pool takes tasks on instead of blocking the worker
+    for (auto& task : tasks) {
+        pool.Join(task);
+    }
+    return ret;
 }
 
 
@@ -170,18 +717,609 @@ std::pair<int, double> BallTreeImpl::Search(const std::vector<float>& v) {
 /**
  * insert given vector to the balltree
  */
-bool BallTreeImpl::Insert(const std::vector<float>& v) {
-    return false;
+bool BallTreeImpl::Insert(const std::vector<float>& v, int index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not root_ or backend_ == StorageBackend::mapped) {
+        return false;
+    }
+    assert(v.size() == root_->center.size());
+    if (index <= 0) {
+        if (next_index_ == 0) {
+            next_index_ = MaxIndex() + 1;
+        }
+        index = next_index_;
+    } else if (tombstones_.count(index)) {
+        return false;
+    }
+    if (next_index_ != 0) {
+        next_index_ = std::max(next_index_, index + 1);
+    }
+    delta_.Insert(Record::Create(index, std::vector<float>(v)));
+    MaybeStartMerge();
+    return true;
 }
 
 /**
  * delete given vector from the balltree
  */
 bool BallTreeImpl::Delete(const std::vector<float>& v) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not root_ or backend_ == StorageBackend::mapped) {
+        return false;
+    }
+    assert(v.size() == root_->center.size());
+    if (delta_.EraseInserted(v) or merging_.EraseInserted(v)) {
+        return true;
+    }
+    auto record = FindInTree(v);
+    if (not record) {
+        return false;
+    }
+    tombstones_.insert(record->index);
+    delta_.Delete(std::move(record));
+    MaybeStartMerge();
+    return true;
+}
+
+void BallTreeImpl::SetMergeThreshold(std::size_t updates) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    merge_threshold_ = std::max<std::size_t>(updates, 1);
+    MaybeStartMerge();
+}
+
+void BallTreeImpl::SetSearchOrder(SearchOrder order) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    search_order_ = order;
+}
+
+bool BallTreeImpl::Merge() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not root_) {
+        return false;
+    }
+    MergeAll();
+    return true;
+}
+
+void BallTreeImpl::MaybeStartMerge() {
+    if (delta_.Size() < merge_threshold_ or not merging_.Empty()) {
+        return;
+    }
+    std::swap(delta_, merging_);
+    if (merge_running_) {
+        // it has not seen that merging_ ran empty yet, it goes on with these
+        return;
+    }
+    if (merge_.valid()) {
+        // already past its last step, it does not need the lock any more
+        merge_.get();
+    }
+    merge_running_ = true;
+    merge_ = std::async(std::launch::async, [this] { MergeInBackground(); });
+}
+
+void BallTreeImpl::MergeInBackground() {
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            bool merged = MergeStep();
+            // a tree in memory is only searched through the flat tree, which
+            // the steps drop, so no search may come in between
+            while (merged and not node_storage_) {
+                merged = MergeStep();
+            }
+            if (not merged) {
+                FinishMerge();
+                merge_running_ = false;
+                return;
+            }
+        }
+        // one update at a time, searches get the lock in between
+        std::this_thread::yield();
+    }
+}
+
+bool BallTreeImpl::MergeStep() {
+    auto& inserted = merging_.Inserted();
+    if (inserted.empty() and merging_.Deleted().empty()) {
+        return false;
+    }
+    if (not inserted.empty()) {
+        auto record = std::move(inserted.back());
+        inserted.pop_back();
+        ApplyInsert(std::move(record));
+        return true;
+    }
+    auto& deleted = merging_.Deleted();
+    if (not deleted.empty()) {
+        auto record = std::move(deleted.back());
+        deleted.pop_back();
+        ApplyDelete(*record);
+        return true;
+    }
+    return false;
+}
+
+void BallTreeImpl::MergeAll() {
+    while (MergeStep()) {
+    }
+    std::swap(delta_, merging_);
+    while (MergeStep()) {
+    }
+    FinishMerge();
+}
+
+void BallTreeImpl::FinishMerge() {
+    // the index keeps the next index for inserts after a restore
+    if (node_storage_ and next_index_ != node_storage_->GetNextIndex()) {
+        node_storage_->SetNextIndex(next_index_);
+    }
+    if (keep_flat_ and not flat_) {
+        MakeFlat();
+    }
+}
+
+void BallTreeImpl::ApplyInsert(Record::Pointer record) {
+    if (node_storage_) {
+        InsertStored(record->data, record->index);
+    } else {
+        InsertInMemory(std::move(record));
+    }
+    // the flat tree is a copy, it does not see the change; FinishMerge
+    // copies the tree again
+    flat_ = nullptr;
+}
+
+void BallTreeImpl::ApplyDelete(const Record& record) {
+    bool deleted = node_storage_ ? DeleteStored(record.data, record.index)
+                                 : DeleteInMemory(record.data, record.index);
+    assert(deleted && "a tombstone points at a record of the tree");
+    tombstones_.erase(record.index);
+    flat_ = nullptr;
+}
+
+bool BallTreeImpl::InsertStored(const std::vector<float>& v, int index) {
+    // the branches from the root down to the parent of the leaf
+    std::vector<std::pair<Rid, BallTreeNode::Pointer>> path;
+    Rid rid = node_storage_->GetRootRid();
+    while (rid.type == Rid::branch) {
+        auto node = node_storage_->Get(rid);
+        auto& branch = static_cast<BallTreeBranch&>(*node);
+        auto left_growth = Growth(*node_storage_->View(branch.r_left), v);
+        auto right_growth = Growth(*node_storage_->View(branch.r_right), v);
+        Rid next = left_growth <= right_growth ? branch.r_left : branch.r_right;
+        path.emplace_back(rid, std::move(node));
+        rid = next;
+    }
+
+    auto node = node_storage_->Get(rid);
+    auto& leaf = static_cast<BallTreeLeaf&>(*node);
+    auto record = Record::Create(index, std::vector<float>(v));
+    Rid stored = record_storage_->Put(*record);
+    InsertByNorm(leaf, stored, std::move(record));
+    Rid child = rid;
+    if (leaf.data.size() > N0) {
+        child = SplitStoredLeaf(rid, leaf, path.empty());
+    } else {
+        leaf.radius = std::max(leaf.radius, Distance(leaf.center, v));
+        CoverNorm(leaf, Norm(v));
+        if (not leaf.cone.Empty()) {
+            leaf.cone.Cover(v);
+        }
+        node_storage_->Update(rid, leaf);
+    }
+    if (path.empty()) {
+        // the root was a leaf, it may have become a branch
+        root_ = node_storage_->GetRoot();
+    }
+
+    // grow the radii on the way back, a branch is rewritten only if it
+    // changes; a ball may cover v without its parent covering it, so the
+    // whole path is checked
+    for (auto iter = path.rbegin(); iter != path.rend(); ++iter) {
+        auto& branch = static_cast<BallTreeBranch&>(*iter->second);
+        bool changed = false;
+        if (iter == path.rbegin() and not (child == rid)) {
+            (branch.r_left == rid ? branch.r_left : branch.r_right) = child;
+            changed = true;
+        }
+        double distance = Distance(branch.center, v);
+        if (distance > branch.radius) {
+            branch.radius = distance;
+            changed = true;
+        }
+        if (CoverNorm(branch, Norm(v))) {
+            changed = true;
+        }
+        if (not branch.cone.Empty() and branch.cone.Cover(v)) {
+            changed = true;
+        }
+        if (not changed) {
+            continue;
+        }
+        node_storage_->Update(iter->first, branch);
+        if (iter + 1 == path.rend()) {
+            root_ = node_storage_->GetRoot();
+        }
+    }
+    changed_ = true;
+    return true;
+}
+
+Rid BallTreeImpl::SplitStoredLeaf(Rid rid, BallTreeLeaf& leaf, bool root) {
+    auto records = leaf.raw_data.size() == leaf.data.size()
+        ? std::move(leaf.raw_data) : record_storage_->GetAll(leaf.data);
+    auto to_first = SplitSides(records);
+    auto center = CalculateCenter(records);
+    double radius = CalculateRadius(records, center);
+    auto norms = NormRange(records);
+    ConeBound cone;
+    if (bound_ == NodeBound::cone) {
+        cone = ConeBound::Of(records);
+    }
+    Records halves[2];
+    std::vector<Rid> rids[2];
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        int half = to_first[i] ? 0 : 1;
+        halves[half].push_back(std::move(records[i]));
+        rids[half].push_back(leaf.data[i]);
+    }
+    auto first = LeafOf(halves[0], std::move(rids[0]), bound_);
+    auto second = LeafOf(halves[1], std::move(rids[1]), bound_);
+    node_storage_->Update(rid, *first);
+    auto branch = BallTreeBranch::Create(
+        std::move(center), radius, nullptr, nullptr, rid,
+        node_storage_->Put(*second));
+    std::tie(branch->min_norm, branch->max_norm) = norms;
+    branch->cone = std::move(cone);
+    return root ? node_storage_->PutRoot(*branch) : node_storage_->Put(*branch);
+}
+
+bool BallTreeImpl::InsertInMemory(Record::Pointer record) {
+    std::vector<BallTreeBranch*> path;
+    BallTreeNode::Pointer* slot = &root_;
+    while (auto branch = dynamic_cast<BallTreeBranch*>(slot->get())) {
+        auto& left = branch->left;
+        auto& right = branch->right;
+        bool to_left =
+            Growth(left->center.data(), left->radius, record->data) <=
+            Growth(right->center.data(), right->radius, record->data);
+        path.push_back(branch);
+        slot = to_left ? &left : &right;
+    }
+    auto& leaf = static_cast<BallTreeLeaf&>(**slot);
+    const std::vector<float> v(record->data);
+    double norm = Norm(v);
+    auto position = std::find_if(
+        begin(leaf.raw_data), end(leaf.raw_data),
+        [norm](const Record::Pointer& other) { return Norm(other->data) < norm; });
+    leaf.raw_data.insert(position, std::move(record));
+    if (leaf.raw_data.size() > N0) {
+        Records records(std::move(leaf.raw_data));
+        auto to_first = SplitSides(records);
+        auto center = CalculateCenter(records);
+        double radius = CalculateRadius(records, center);
+        auto norms = NormRange(records);
+        ConeBound cone;
+        if (bound_ == NodeBound::cone) {
+            cone = ConeBound::Of(records);
+        }
+        Records halves[2];
+        for (std::size_t i = 0; i < records.size(); ++i) {
+            halves[to_first[i] ? 0 : 1].push_back(std::move(records[i]));
+        }
+        auto first = BuildTreeLeaf(halves[0]);
+        auto second = BuildTreeLeaf(halves[1]);
+        auto branch = BallTreeBranch::Create(
+            std::move(center), radius, std::move(first), std::move(second));
+        std::tie(branch->min_norm, branch->max_norm) = norms;
+        branch->cone = std::move(cone);
+        *slot = std::move(branch);
+    } else {
+        leaf.radius = std::max(leaf.radius, Distance(leaf.center, v));
+        CoverNorm(leaf, norm);
+        if (not leaf.cone.Empty()) {
+            leaf.cone.Cover(v);
+        }
+    }
+    for (auto iter = path.rbegin(); iter != path.rend(); ++iter) {
+        (*iter)->radius = std::max((*iter)->radius, Distance((*iter)->center, v));
+        CoverNorm(**iter, norm);
+        if (not (*iter)->cone.Empty()) {
+            (*iter)->cone.Cover(v);
+        }
+    }
+    return true;
+}
+bool BallTreeImpl::Matches(
+    int record_index, const float* data, const std::vector<float>& v,
+    int index) const {
+    if (index != 0 ? record_index != index : tombstones_.count(record_index)) {
+        return false;
+    }
+    return std::equal(begin(v), end(v), data);
+}
+
+bool BallTreeImpl::FindStored(
+    Rid rid, const std::vector<float>& v, int index, std::vector<Rid>& path,
+    std::size_t& position) {
+    auto node = node_storage_->Get(rid);
+    if (not MayContain(*node, v)) {
+        return false;
+    }
+    path.push_back(rid);
+    if (rid.type == Rid::leaf) {
+        auto& rids = static_cast<BallTreeLeaf&>(*node).data;
+        for (position = 0; position < rids.size(); ++position) {
+            auto record = record_storage_->View(rids[position]);
+            if (Matches(record->index, record->data, v, index)) {
+                return true;
+            }
+        }
+    } else {
+        auto& branch = static_cast<BallTreeBranch&>(*node);
+        if (FindStored(branch.r_left, v, index, path, position) or
+            FindStored(branch.r_right, v, index, path, position)) {
+            return true;
+        }
+    }
+    path.pop_back();
     return false;
 }
 
+BallTreeImpl::Found BallTreeImpl::FindInMemory(
+    const std::vector<float>& v, int index) {
+    // (node, the branch above it)
+    std::vector<std::pair<BallTreeNode::Pointer*, BallTreeNode::Pointer*>>
+        stack{{&root_, nullptr}};
+    while (not stack.empty()) {
+        auto slot = stack.back().first;
+        auto parent = stack.back().second;
+        stack.pop_back();
+        if (not MayContain(**slot, v)) {
+            continue;
+        }
+        if (auto branch = dynamic_cast<BallTreeBranch*>(slot->get())) {
+            stack.emplace_back(&branch->right, slot);
+            stack.emplace_back(&branch->left, slot);
+            continue;
+        }
+        auto& records = static_cast<BallTreeLeaf&>(**slot).raw_data;
+        for (std::size_t i = 0; i < records.size(); ++i) {
+            if (Matches(records[i]->index, records[i]->data.data(), v, index)) {
+                return Found{slot, parent, i};
+            }
+        }
+    }
+    return Found();
+}
+
+Record::Pointer BallTreeImpl::FindInTree(const std::vector<float>& v) {
+    if (not node_storage_) {
+        auto found = FindInMemory(v, 0);
+        if (not found.slot) {
+            return nullptr;
+        }
+        auto& leaf = static_cast<BallTreeLeaf&>(**found.slot);
+        return std::make_unique<Record>(*leaf.raw_data[found.position]);
+    }
+    std::vector<Rid> path;
+    std::size_t position = 0;
+    if (not FindStored(node_storage_->GetRootRid(), v, 0, path, position)) {
+        return nullptr;
+    }
+    auto node = node_storage_->View(path.back());
+    return record_storage_->Get(node->rids[position]);
+}
+
+bool BallTreeImpl::DeleteStored(const std::vector<float>& v, int index) {
+    std::vector<Rid> path;
+    std::size_t position = 0;
+    if (not FindStored(
+            node_storage_->GetRootRid(), v, index, path, position)) {
+        return false;
+    }
+    changed_ = true;
+    Rid leaf_rid = path.back();
+    auto node = node_storage_->Get(leaf_rid);
+    auto& leaf = static_cast<BallTreeLeaf&>(*node);
+    record_storage_->Remove(leaf.data[position]);
+    if (leaf.norms.size() == leaf.data.size()) {
+        leaf.norms.erase(begin(leaf.norms) + position);
+    }
+    if (leaf.raw_data.size() == leaf.data.size()) {
+        leaf.raw_data.erase(begin(leaf.raw_data) + position);
+    }
+    leaf.data.erase(begin(leaf.data) + position);
+    if (not leaf.data.empty() or path.size() < 3) {
+        // the root stays a branch, an empty leaf right below it is kept
+        node_storage_->Update(leaf_rid, leaf);
+        if (path.size() == 1) {
+            // the root is the leaf, searches start from the copy of it
+            root_ = node_storage_->GetRoot();
+        }
+        return true;
+    }
+    // the sibling of the empty leaf takes the place of their parent
+    Rid parent_rid = path[path.size() - 2];
+    Rid grandparent_rid = path[path.size() - 3];
+    auto parent = node_storage_->Get(parent_rid);
+    auto& branch = static_cast<BallTreeBranch&>(*parent);
+    Rid sibling = branch.r_left == leaf_rid ? branch.r_right : branch.r_left;
+    auto grandparent = node_storage_->Get(grandparent_rid);
+    auto& above = static_cast<BallTreeBranch&>(*grandparent);
+    (above.r_left == parent_rid ? above.r_left : above.r_right) = sibling;
+    node_storage_->Update(grandparent_rid, above);
+    node_storage_->Remove(parent_rid);
+    node_storage_->Remove(leaf_rid);
+    if (grandparent_rid == node_storage_->GetRootRid()) {
+        root_ = node_storage_->GetRoot();
+    }
+    return true;
+}
+
+bool BallTreeImpl::DeleteInMemory(const std::vector<float>& v, int index) {
+    auto found = FindInMemory(v, index);
+    if (not found.slot) {
+        return false;
+    }
+    auto& records = static_cast<BallTreeLeaf&>(**found.slot).raw_data;
+    records.erase(begin(records) + found.position);
+    if (records.empty() and found.parent) {
+        auto& branch = static_cast<BallTreeBranch&>(**found.parent);
+        auto sibling = std::move(
+            &branch.left == found.slot ? branch.right : branch.left);
+        *found.parent = std::move(sibling);
+    }
+    return true;
+}
+
+int BallTreeImpl::MaxIndex() {
+    int ret = 0;
+    for (auto segment : {&delta_, &merging_}) {
+        for (auto& record : segment->Inserted()) {
+            ret = std::max(ret, record->index);
+        }
+    }
+    if (not node_storage_) {
+        std::vector<const BallTreeNode*> stack{root_.get()};
+        while (not stack.empty()) {
+            auto node = stack.back();
+            stack.pop_back();
+            if (auto branch = dynamic_cast<const BallTreeBranch*>(node)) {
+                stack.push_back(branch->left.get());
+                stack.push_back(branch->right.get());
+                continue;
+            }
+            for (auto& record : static_cast<const BallTreeLeaf*>(node)->raw_data) {
+                ret = std::max(ret, record->index);
+            }
+        }
+        return ret;
+    }
+    std::vector<Rid> stack{node_storage_->GetRootRid()};
+    while (not stack.empty()) {
+        auto node = node_storage_->View(stack.back());
+        stack.pop_back();
+        if (node->type == Rid::branch) {
+            stack.push_back(node->left);
+            stack.push_back(node->right);
+            continue;
+        }
+        for (std::size_t i = 0; i < node->rid_size; ++i) {
+            ret = std::max(ret, record_storage_->View(node->rids[i])->index);
+        }
+    }
+    return ret;
+}
+
+bool BallTreeImpl::Flatten() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not root_) {
+        return false;
+    }
+    BuildFlat();
+    return true;
+}
+
+void BallTreeImpl::BuildFlat() {
+    // the flat tree is a copy of the tree alone, so merge first
+    keep_flat_ = true;
+    MergeAll();
+}
+
+void BallTreeImpl::MakeFlat() {
+    flat_ = std::make_unique<FlatBallTree>(
+        *root_, root_->center.size(), node_storage_.get(),
+        record_storage_.get());
+    if (quantizer_) {
+        flat_->Quantize(quantizer_);
+    }
+}
+
+bool BallTreeImpl::Quantize(int subspaces) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not flat_) {
+        if (not root_) {
+            return false;
+        }
+        BuildFlat();
+    }
+    flat_->Quantize(subspaces);
+    quantizer_ = flat_->Quantizer();
+    return true;
+}
+
+std::vector<std::pair<int, double>> BallTreeImpl::SearchApproximate(
+    const std::vector<float>& v, int k, std::size_t candidates) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not quantizer_) {
+        assert(false && "the tree is not quantized");
+        return {};
+    }
+    if (k <= 0) {
+        return {};
+    }
+    std::vector<std::pair<int, double>> results;
+    if (flat_) {
+        ++query_stats_.queries;
+        results = flat_->SearchApproximate(
+            v, k, candidates, &query_stats_, Skip());
+    } else {
+        // a merge is running, it copies and encodes the tree once done
+        results = SearchTree(v, k);
+    }
+    // pending insertions are few, they are scored exactly
+    delta_.Scan(v, k, results);
+    merging_.Scan(v, k, results);
+    return results;
+}
+
+std::vector<std::pair<int, double>> BallTreeImpl::SearchFlat(
+    const std::vector<std::vector<float>>& vs, QueryStats& stats,
+    const Tombstones* skip) const {
+    std::vector<std::pair<int, double>> ret;
+    ret.reserve(vs.size());
+    for (auto& v : vs) {
+        ret.push_back(flat_->Search(v, &stats, skip));
+    }
+    stats.queries += vs.size();
+    return ret;
+}
+
+TreeStats BallTreeImpl::Stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TreeStats stats;
+    if (record_storage_) {
+        stats.record += record_storage_->Stats();
+    }
+    if (node_storage_) {
+        stats.branch += node_storage_->Stats(Rid::branch);
+        stats.leaf += node_storage_->Stats(Rid::leaf);
+    }
+    stats += closed_reader_stats_;
+    stats.query += query_stats_;
+    for (auto& worker_stats : worker_query_stats_) {
+        stats.query += worker_stats;
+    }
+    for (auto& reader : readers_) {
+        if (reader) {
+            stats += reader->Stats();
+        }
+    }
+    return stats;
+}
+
+void BallTreeImpl::CloseReaders() {
+    for (auto& reader : readers_) {
+        if (reader) {
+            closed_reader_stats_ += reader->Stats();
+        }
+    }
+    readers_.clear();
+}
 
 bool BallTreeImpl::SetDimension(int d) {
     dim = d;
+    return true;
 }
\ No newline at end of file
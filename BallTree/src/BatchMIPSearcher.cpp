@@ -0,0 +1,159 @@
+#include "BatchMIPSearcher.h"
+#include <algorithm>
+#include <limits>
+#include "MIPSearcher.h"
+
+constexpr std::size_t BatchMIPSearcher::kBlockSize;
+
+BatchMIPSearcher::BatchMIPSearcher(
+    const Needles& needles, RecordStorage* r_storage, NodeStorage* n_storage,
+    bool prefetch, const Tombstones* skip)
+    : needles(needles),
+      cur_max_idx_(needles.size(), -1),
+      cur_mip_(needles.size(), std::numeric_limits<double>::lowest()),
+      prefetch_(prefetch),
+      skip_(skip),
+      record_storage_(r_storage),
+      node_storage_(n_storage) {
+    needle_norms.reserve(needles.size());
+    norm_bounds.reserve(needles.size());
+    quantization_errors.reserve(needles.size());
+    for (std::size_t q = 0; q < needles.size(); ++q) {
+        needle_norms.push_back(Norm(needles[q]));
+        norm_bounds.push_back(MIPSearcher::NormBound(needles[q]));
+        quantization_errors.push_back(
+            MIPSearcher::QuantizationError(needles[q]));
+        active_.push_back(q);
+    }
+}
+
+void BatchMIPSearcher::Visit(BallTreeBranch* branch) {
+    ++stats_.branches_visited;
+    if (prefetch_) {
+        node_storage_->Prefetch(branch->r_left);
+        node_storage_->Prefetch(branch->r_right);
+    }
+    auto left = node_storage_->Get(branch->r_left);
+    auto right = node_storage_->Get(branch->r_right);
+    std::vector<double> left_mips, right_mips;
+    left_mips.reserve(active_.size());
+    right_mips.reserve(active_.size());
+    std::size_t prefer_left = 0;
+    for (auto q : active_) {
+        left_mips.push_back(PossibleMip(q, *left));
+        right_mips.push_back(PossibleMip(q, *right));
+        if (left_mips.back() > right_mips.back()) {
+            ++prefer_left;
+        }
+    }
+    // the child most queries prefer goes first, the other one is filtered
+    // again after it returns since cur_mip_ may have grown meanwhile
+    bool left_first = prefer_left * 2 > active_.size();
+    auto& first = left_first ? left : right;
+    auto& second = left_first ? right : left;
+    auto& first_mips = left_first ? left_mips : right_mips;
+    auto& second_mips = left_first ? right_mips : left_mips;
+
+    QuerySet parent(active_);
+    active_ = Filter(first_mips);
+    stats_.subtrees_pruned += parent.size() - active_.size();
+    if (not active_.empty()) {
+        first->Accept(*this);
+    }
+    active_ = parent;
+    active_ = Filter(second_mips);
+    stats_.subtrees_pruned += parent.size() - active_.size();
+    if (not active_.empty()) {
+        second->Accept(*this);
+    }
+    active_ = std::move(parent);
+}
+
+void BatchMIPSearcher::Visit(BallTreeLeaf* leaf) {
+    ++stats_.leaves_scanned;
+    stats_.records_scored += leaf->data.size() * active_.size();
+    // a leaf of an index with clustered_leaves comes with its records
+    bool carried = leaf->raw_data.size() == leaf->data.size();
+    for (std::size_t i = 0; prefetch_ and not carried and i < leaf->data.size(); ++i) {
+        if (i == 0 or leaf->data[i].page_id != leaf->data[i - 1].page_id) {
+            record_storage_->Prefetch(leaf->data[i]);
+        }
+    }
+    if (not carried and leaf->data.front().type == Rid::quantized) {
+        ScanQuantized(leaf->data);
+        return;
+    }
+    std::vector<Record::Pointer> stored;
+    if (not carried) {
+        stored = record_storage_->GetAll(leaf->data);
+    }
+    for (const auto& record : carried ? leaf->raw_data : stored) {
+        if (skip_ and skip_->count(record->index)) {
+            continue;
+        }
+        for (auto q : active_) {
+            double innerproduct = kernels::Dot(
+                needles[q].data(), record->data.data(), record->data.size());
+            if (innerproduct > cur_mip_[q]) {
+                cur_mip_[q] = innerproduct;
+                cur_max_idx_[q] = record->index;
+            }
+        }
+    }
+}
+
+void BatchMIPSearcher::ScanQuantized(const std::vector<Rid>& rids) {
+    for (auto& rid : rids) {
+        auto codes = record_storage_->ViewQuantized(rid);
+        if (skip_ and skip_->count(codes->index)) {
+            continue;
+        }
+        // read at most once, by the first query that needs it
+        Pinned<RecordView> record;
+        bool record_read = false;
+        for (auto q : active_) {
+            double estimate = codes->scale * kernels::DotInt8(
+                needles[q].data(), codes->codes, codes->size);
+            if (estimate + codes->scale * quantization_errors[q] <= cur_mip_[q]) {
+                continue;
+            }
+            ++stats_.records_reranked;
+            if (not record_read) {
+                record = record_storage_->View(codes->full);
+                record_read = true;
+            }
+            double innerproduct =
+                kernels::Dot(needles[q].data(), record->data, record->size);
+            if (innerproduct > cur_mip_[q]) {
+                cur_mip_[q] = innerproduct;
+                cur_max_idx_[q] = record->index;
+            }
+        }
+    }
+}
+
+double BatchMIPSearcher::PossibleMip(
+    std::size_t query, const BallTreeNode& node) const {
+    double ball = kernels::Dot(needles[query].data(), node.center.data(),
+                               node.center.size()) +
+                  node.radius * needle_norms[query];
+    ball = std::min(ball, norm_bounds[query] * node.max_norm);
+    if (node.cone.Empty()) {
+        return ball;
+    }
+    return std::min(
+        ball, node.cone.Mip(needles[query], needle_norms[query],
+                            node.min_norm, node.max_norm));
+}
+
+BatchMIPSearcher::QuerySet BatchMIPSearcher::Filter(
+    const std::vector<double>& possible_mips) const {
+    QuerySet ret;
+    ret.reserve(active_.size());
+    for (std::size_t i = 0; i < active_.size(); ++i) {
+        if (possible_mips[i] > cur_mip_[active_[i]]) {
+            ret.push_back(active_[i]);
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,103 @@
+#include "ConeBound.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include "Utility.h"
+
+namespace {
+
+// 角度在 double 里算 误差远小于这个余量
+constexpr double kSpreadSlack = 1e-9;
+
+double NormOf(const float* v, std::size_t size) {
+    double sum = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+        sum += static_cast<double>(v[i]) * v[i];
+    }
+    return std::sqrt(sum);
+}
+
+/**
+ * the cosine of the angle between v and the unit axis, lowered by the
+ * slack; 1 for a zero v, which every cone holds
+ */
+double CosineTo(const std::vector<float>& axis, const std::vector<float>& v) {
+    double norm = NormOf(v.data(), v.size());
+    if (norm == 0) {
+        return 1;
+    }
+    double dot = 0;
+    for (std::size_t i = 0; i < v.size(); ++i) {
+        dot += static_cast<double>(axis[i]) * v[i];
+    }
+    double axis_norm = NormOf(axis.data(), axis.size());
+    return std::max(-1.0, dot / (norm * axis_norm) - kSpreadSlack);
+}
+
+}  // anonymous namespace
+
+ConeBound ConeBound::Of(const std::vector<Record::Pointer>& records) {
+    assert(not records.empty());
+    auto size = records.front()->data.size();
+    // 轴取各记录方向的平均
+    std::vector<double> sum(size, 0);
+    for (auto& record : records) {
+        double norm = NormOf(record->data.data(), size);
+        if (norm == 0) continue;
+        for (std::size_t i = 0; i < size; ++i) {
+            sum[i] += record->data[i] / norm;
+        }
+    }
+    double sum_norm = 0;
+    for (auto x : sum) {
+        sum_norm += x * x;
+    }
+    sum_norm = std::sqrt(sum_norm);
+    ConeBound ret;
+    ret.axis.assign(size, 0);
+    if (sum_norm > 0) {
+        std::transform(begin(sum), end(sum), begin(ret.axis),
+                       [sum_norm](double x) { return x / sum_norm; });
+    } else {
+        // 方向互相抵消 任取一个轴
+        ret.axis[0] = 1;
+    }
+    for (auto& record : records) {
+        ret.cos_spread = std::min(ret.cos_spread, CosineTo(ret.axis, record->data));
+    }
+    ret.sin_spread = std::sqrt(1 - ret.cos_spread * ret.cos_spread);
+    return ret;
+}
+
+bool ConeBound::Cover(const std::vector<float>& v) {
+    assert(not Empty());
+    double cosine = CosineTo(axis, v);
+    if (cosine >= cos_spread) {
+        return false;
+    }
+    cos_spread = cosine;
+    sin_spread = std::sqrt(1 - cos_spread * cos_spread);
+    return true;
+}
+
+double ConeBound::Mip(
+    const float* q, double q_norm, const float* axis, std::size_t size,
+    double cos_spread, double sin_spread, double min_norm, double max_norm) {
+    if (q_norm == 0) {
+        return 0;
+    }
+    // the float sums are off by at most size * epsilon of the sum of the
+    // absolute products, raising the cosine only loosens the bound
+    double tolerance =
+        2.0 * (size + 2) * std::numeric_limits<float>::epsilon();
+    double cosine = std::max(
+        -1.0, std::min(1.0, kernels::Dot(q, axis, size) / q_norm + tolerance));
+    // the smallest angle between q and a record, cos(max(0, angle - spread))
+    double best = cosine >= cos_spread
+        ? 1
+        : cosine * cos_spread + std::sqrt(1 - cosine * cosine) * sin_spread;
+    // past a right angle the shortest record is the least negative
+    double norm = best >= 0 ? max_norm : min_norm;
+    return q_norm * (norm * best + max_norm * tolerance);
+}
@@ -0,0 +1,39 @@
+#include "DeltaSegment.h"
+#include <algorithm>
+#include "SimdKernels.h"
+
+bool DeltaSegment::EraseInserted(const std::vector<float>& v) {
+    auto iter = std::find_if(
+        begin(inserted_), end(inserted_),
+        [&v](const Record::Pointer& record) { return record->data == v; });
+    if (iter == end(inserted_)) {
+        return false;
+    }
+    inserted_.erase(iter);
+    return true;
+}
+
+void DeltaSegment::Scan(
+    const std::vector<float>& v, std::size_t k, Results& results) const {
+    if (k == 0) {
+        return;
+    }
+    for (auto& record : inserted_) {
+        double innerproduct =
+            kernels::Dot(v.data(), record->data.data(), v.size());
+        if (results.size() == k and not(innerproduct > results.back().second)) {
+            continue;
+        }
+        // after every result at least as good, as a tree search would keep
+        // the record found first
+        auto position = std::upper_bound(
+            begin(results), end(results), innerproduct,
+            [](double value, const std::pair<int, double>& result) {
+                return value > result.second;
+            });
+        results.insert(position, {record->index, innerproduct});
+        if (results.size() > k) {
+            results.pop_back();
+        }
+    }
+}
@@ -0,0 +1,392 @@
+#include "FlatBallTree.h"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <queue>
+#include "MIPSearcher.h"
+
+constexpr std::size_t FlatBallTree::kAlignment;
+constexpr std::size_t FlatBallTree::kCandidatesPerResult;
+
+/**
+ * appends nodes in DFS pre-order while visiting the pointer tree
+ */
+class FlatBallTree::Builder : public BallTreeVisitor {
+  public:
+    Builder(FlatBallTree& tree, NodeStorage* n_storage,
+            RecordStorage* r_storage)
+        : tree_(tree), node_storage_(n_storage), record_storage_(r_storage) {}
+
+    virtual void Visit(BallTreeBranch* branch) {
+        auto self = Append(*branch);
+        VisitChild(branch->left, branch->r_left);
+        tree_.nodes_[self].right = tree_.nodes_.size();
+        VisitChild(branch->right, branch->r_right);
+        tree_.nodes_[self].left = self + 1;
+    }
+
+    virtual void Visit(BallTreeLeaf* leaf) {
+        auto self = Append(*leaf);
+        tree_.nodes_[self].first = tree_.indices_.size();
+        std::vector<Record::Pointer> stored;
+        if (leaf->raw_data.empty()) {
+            stored = record_storage_->GetAll(leaf->data);
+        }
+        auto& records = leaf->raw_data.empty() ? stored : leaf->raw_data;
+        // 叶子里的记录按范数从大到小排 旧索引的叶子也一样
+        std::vector<std::pair<float, const Record*>> by_norm;
+        for (auto& record : records) {
+            by_norm.emplace_back(Norm(record->data), record.get());
+        }
+        std::stable_sort(
+            begin(by_norm), end(by_norm),
+            [](const auto& a, const auto& b) { return a.first > b.first; });
+        for (auto& entry : by_norm) {
+            AppendRecord(*entry.second, entry.first);
+        }
+        tree_.nodes_[self].last = tree_.indices_.size();
+    }
+
+  private:
+    std::size_t Append(const BallTreeNode& node) {
+        tree_.nodes_.push_back({node.radius, node.max_norm, -1, -1, 0, 0});
+        AppendRow(tree_.centers_, node.center);
+        // 锥是整棵树一起有或没有的
+        if (not node.cone.Empty()) {
+            auto& cone = node.cone;
+            AppendRow(tree_.axes_, cone.axis);
+            tree_.cones_.push_back(
+                {cone.cos_spread, cone.sin_spread, node.min_norm});
+        }
+        return tree_.nodes_.size() - 1;
+    }
+
+    void AppendRecord(const Record& record, float norm) {
+        tree_.indices_.push_back(record.index);
+        tree_.norms_.push_back(norm);
+        AppendRow(tree_.records_, record.data);
+    }
+
+    void AppendRow(Matrix& matrix, const std::vector<float>& row) {
+        auto offset = matrix.size();
+        matrix.resize(offset + tree_.stride_, 0);
+        std::copy(begin(row), end(row), begin(matrix) + offset);
+    }
+
+    void VisitChild(const BallTreeNode::Pointer& in_memory, const Rid& rid) {
+        if (in_memory) {
+            in_memory->Accept(*this);
+        } else {
+            node_storage_->Get(rid)->Accept(*this);
+        }
+    }
+
+    FlatBallTree& tree_;
+    NodeStorage* node_storage_;
+    RecordStorage* record_storage_;
+};
+
+/**
+ * depth first branch and bound over the flat arrays, same order and
+ * pruning as MIPSearcher, leaves stop at the first record whose norm can
+ * not beat the threshold; with a quantizer the records are scored from the
+ * lookup table of the needle, with a budget it stops as MIPSearcher does
+ */
+class FlatBallTree::Searcher {
+    using Candidate = std::pair<double, int>;
+
+  public:
+    Searcher(const FlatBallTree& tree, const std::vector<float>& v,
+             std::size_t k, const Tombstones* skip,
+             const ProductQuantizer* quantizer = nullptr,
+             const SearchBudget* budget = nullptr)
+        : tree_(tree), needle_(v.data()), needle_norm_(Norm(v)),
+          norm_bound_(MIPSearcher::NormBound(v)), k_(k),
+          skip_(skip), quantizer_(quantizer),
+          budgeted_(budget and not budget->Unlimited()),
+          budget_(budget ? *budget : SearchBudget()) {
+        if (quantizer_) {
+            table_.resize(quantizer_->TableSize());
+            quantizer_->Table(needle_, table_.data());
+        }
+    }
+
+    void Visit(std::size_t index) {
+        if (OutOfBudget()) {
+            return;
+        }
+        auto& node = tree_.nodes_[index];
+        if (node.left < 0) {
+            ScanLeaf(node);
+            return;
+        }
+        ++stats_.branches_visited;
+        double left_mip = PossibleMip(node.left);
+        double right_mip = PossibleMip(node.right);
+        std::size_t first = node.left, second = node.right;
+        if (not(left_mip > right_mip)) {
+            std::swap(first, second);
+            std::swap(left_mip, right_mip);
+        }
+        if (not WorthVisiting(left_mip)) {
+            stats_.subtrees_pruned += 2;
+            return;
+        }
+        Visit(first);
+        if (WorthVisiting(right_mip)) {
+            Visit(second);
+        } else {
+            ++stats_.subtrees_pruned;
+        }
+    }
+
+    /**
+     * SearchOrder::best_first from the root: the best node of the frontier
+     * is popped and the tree is descended from it to a leaf through the
+     * better child of every branch, the other child is pushed
+     */
+    void VisitBestFirst() {
+        // (PossibleMip, node index), the best bound on top
+        std::priority_queue<std::pair<double, std::size_t>> frontier;
+        frontier.push({std::numeric_limits<double>::max(), 0});
+        while (not frontier.empty()) {
+            auto best = frontier.top();
+            // the threshold has only risen since the node was pushed
+            if (not WorthVisiting(best.first) or OutOfBudget()) {
+                stats_.subtrees_pruned += frontier.size();
+                return;
+            }
+            frontier.pop();
+            auto index = best.second;
+            while (tree_.nodes_[index].left >= 0) {
+                auto& node = tree_.nodes_[index];
+                ++stats_.branches_visited;
+                double left_mip = PossibleMip(node.left);
+                double right_mip = PossibleMip(node.right);
+                std::size_t first = node.left, second = node.right;
+                if (not(left_mip > right_mip)) {
+                    std::swap(first, second);
+                    std::swap(left_mip, right_mip);
+                }
+                if (WorthVisiting(right_mip)) {
+                    frontier.push({right_mip, second});
+                } else {
+                    ++stats_.subtrees_pruned;
+                }
+                if (not WorthVisiting(left_mip) or OutOfBudget()) {
+                    ++stats_.subtrees_pruned;
+                    index = tree_.nodes_.size();
+                    break;
+                }
+                index = first;
+            }
+            if (index < tree_.nodes_.size()) {
+                ScanLeaf(tree_.nodes_[index]);
+            }
+        }
+    }
+
+    std::vector<std::pair<int, double>> Results() {
+        std::vector<std::pair<int, double>> ret(top_k_.size());
+        for (auto iter = ret.rbegin(); iter != ret.rend(); ++iter) {
+            *iter = {top_k_.top().second, top_k_.top().first};
+            top_k_.pop();
+        }
+        return ret;
+    }
+
+    const QueryStats& Stats() const {
+        return stats_;
+    }
+
+    bool Exact() const {
+        return exact_;
+    }
+
+  private:
+    void ScanLeaf(const Node& node) {
+        ++stats_.leaves_scanned;
+        for (auto i = node.first; i < node.last; ++i) {
+            // estimates are not bounded by the norms, so only exact scans
+            // stop early
+            if (not quantizer_ and
+                norm_bound_ * tree_.norms_[i] <= Threshold()) {
+                break;
+            }
+            ++stats_.records_scored;
+            if (skip_ and skip_->count(tree_.indices_[i])) {
+                continue;
+            }
+            double innerproduct = quantizer_
+                ? quantizer_->Score(
+                      table_.data(),
+                      tree_.codes_.data() + i * quantizer_->CodeSize())
+                : kernels::Dot(
+                      needle_, tree_.RecordData(i), tree_.dimension_);
+            if (innerproduct > Threshold()) {
+                // approximate candidates are re-ranked from their rows
+                Offer(quantizer_ ? i : tree_.indices_[i], innerproduct);
+            }
+        }
+    }
+
+    double PossibleMip(std::size_t index) const {
+        auto& node = tree_.nodes_[index];
+        double ball =
+            kernels::Dot(needle_, tree_.Center(index), tree_.dimension_) +
+            node.radius * needle_norm_;
+        // as in ScanLeaf, estimates are not bounded by the norms
+        if (not quantizer_) {
+            ball = std::min(ball, norm_bound_ * node.max_norm);
+        }
+        if (not tree_.HasCones()) {
+            return ball;
+        }
+        auto& cone = tree_.cones_[index];
+        return std::min(
+            ball, ConeBound::Mip(
+                      needle_, needle_norm_,
+                      tree_.axes_.data() + index * tree_.stride_,
+                      tree_.dimension_, cone.cos_spread, cone.sin_spread,
+                      cone.min_norm, node.max_norm));
+    }
+
+    double Threshold() const {
+        if (top_k_.size() < k_) {
+            return std::numeric_limits<double>::lowest();
+        }
+        return top_k_.top().first;
+    }
+
+    bool WorthVisiting(double possible_mip) {
+        if (not(possible_mip > Threshold())) {
+            return false;
+        }
+        if (budgeted_ and not(possible_mip > budget_.Relax(
+                                                 Threshold(), top_k_.size() == k_))) {
+            exact_ = false;
+            return false;
+        }
+        return true;
+    }
+
+    bool OutOfBudget() {
+        if (budgeted_ and budget_.Exhausted(stats_)) {
+            exact_ = false;
+            return true;
+        }
+        return false;
+    }
+
+    void Offer(int index, double innerproduct) {
+        if (top_k_.size() == k_) {
+            top_k_.pop();
+        }
+        top_k_.push({innerproduct, index});
+    }
+
+    const FlatBallTree& tree_;
+    const float* needle_;
+    const double needle_norm_;
+    const double norm_bound_;
+    const std::size_t k_;
+    const Tombstones* skip_;
+    const ProductQuantizer* quantizer_;
+    const bool budgeted_;
+    const SearchBudget budget_;
+    bool exact_ = true;
+    std::vector<float> table_;
+    std::priority_queue<
+        Candidate, std::vector<Candidate>, std::greater<Candidate>>
+        top_k_;
+    QueryStats stats_;
+};
+
+FlatBallTree::FlatBallTree(
+    BallTreeNode& root, int dimension, NodeStorage* n_storage,
+    RecordStorage* r_storage)
+    : dimension_(dimension),
+      stride_(
+          (dimension * sizeof(float) + kAlignment - 1) / kAlignment *
+          kAlignment / sizeof(float)) {
+    Builder builder(*this, n_storage, r_storage);
+    root.Accept(builder);
+}
+
+std::pair<int, double> FlatBallTree::Search(
+    const std::vector<float>& v, QueryStats* stats,
+    const Tombstones* skip) const {
+    auto result = SearchTopK(v, 1, stats, skip);
+    if (result.empty()) {
+        return {-1, 0};
+    }
+    return result.front();
+}
+
+std::vector<std::pair<int, double>> FlatBallTree::SearchTopK(
+    const std::vector<float>& v, std::size_t k, QueryStats* stats,
+    const Tombstones* skip, const SearchBudget* budget, bool* exact,
+    SearchOrder order) const {
+    if (exact) {
+        *exact = true;
+    }
+    if (nodes_.empty() or k == 0) {
+        return {};
+    }
+    Searcher searcher(*this, v, k, skip, nullptr, budget);
+    if (order == SearchOrder::best_first) {
+        searcher.VisitBestFirst();
+    } else {
+        searcher.Visit(0);
+    }
+    if (stats) {
+        *stats += searcher.Stats();
+    }
+    if (exact) {
+        *exact = searcher.Exact();
+    }
+    return searcher.Results();
+}
+
+void FlatBallTree::Quantize(int subspaces) {
+    auto quantizer = std::make_shared<ProductQuantizer>(dimension_, subspaces);
+    quantizer->Train(records_.data(), indices_.size(), stride_);
+    Quantize(std::move(quantizer));
+}
+
+void FlatBallTree::Quantize(std::shared_ptr<const ProductQuantizer> quantizer) {
+    quantizer_ = std::move(quantizer);
+    auto code_size = quantizer_->CodeSize();
+    codes_.assign(indices_.size() * code_size, 0);
+    for (std::size_t i = 0; i < indices_.size(); ++i) {
+        quantizer_->Encode(RecordData(i), codes_.data() + i * code_size);
+    }
+}
+
+std::vector<std::pair<int, double>> FlatBallTree::SearchApproximate(
+    const std::vector<float>& v, std::size_t k, std::size_t candidates,
+    QueryStats* stats, const Tombstones* skip) const {
+    assert(quantizer_);
+    if (nodes_.empty() or k == 0) {
+        return {};
+    }
+    if (candidates == 0) {
+        candidates = kCandidatesPerResult * k;
+    }
+    Searcher searcher(*this, v, std::max(k, candidates), skip, quantizer_.get());
+    searcher.Visit(0);
+    auto ret = searcher.Results();
+    for (auto& candidate : ret) {
+        auto row = candidate.first;
+        candidate = {indices_[row], kernels::Dot(v.data(), RecordData(row), dimension_)};
+    }
+    if (stats) {
+        *stats += searcher.Stats();
+        stats->records_reranked += ret.size();
+    }
+    std::stable_sort(begin(ret), end(ret), [](const auto& a, const auto& b) {
+        return a.second > b.second;
+    });
+    ret.resize(std::min(ret.size(), k));
+    return ret;
+}
@@ -0,0 +1,212 @@
+#include "IndexFile.h"
+#include <cassert>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+constexpr int IndexFile::kStorageNum;
+
+bool IndexFile::Exists(const Path& dest_dir) {
+    return ::access((dest_dir + kFileName).data(), F_OK) == 0;
+}
+
+IndexFile::IndexFile(const Path& dest_dir, std::size_t page_size, bool create)
+    : page_size(page_size) {
+    auto filename = dest_dir + kFileName;
+    if (create) {
+        fd = ::open(filename.data(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        header.page_size = page_size;
+        changed = true;
+        return;
+    }
+    fd = ::open(filename.data(), O_RDWR);
+    if (fd == -1) {
+        // a read only index can still be served
+        fd = ::open(filename.data(), O_RDONLY);
+    }
+    if (fd != -1 and not ReadHeader()) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+IndexFile::~IndexFile() {
+    if (fd == -1) return;
+    if (not Flush()) {
+        assert(false && "the header of the index file could not be written");
+    }
+    ::close(fd);
+}
+
+bool IndexFile::Flush() {
+    if (fd != -1 and changed) {
+        return WriteHeader();
+    }
+    return true;
+}
+
+int IndexFile::AllocatePage(Rid::DataType type) {
+    assert(type < kStorageNum);
+    directory[type].push_back(header.file_page_num++);
+    free_slots[type].push_back(0);
+    changed = true;
+    return directory[type].size() - 1;
+}
+
+bool IndexFile::ReadPage(Rid::DataType type, int page_id, Byte* buffer) const {
+    assert(page_id < PageCount(type));
+    auto read = ::pread(fd, buffer, page_size, PageOffset(type, page_id));
+    return read == static_cast<ssize_t>(page_size);
+}
+
+void IndexFile::Prefetch(Rid::DataType type, int page_id) const {
+    assert(page_id < PageCount(type));
+    ::posix_fadvise(fd, PageOffset(type, page_id), page_size,
+                    POSIX_FADV_WILLNEED);
+}
+
+bool IndexFile::WritePage(Rid::DataType type, int page_id, const Byte* buffer) {
+    assert(page_id < PageCount(type));
+    auto written = ::pwrite(fd, buffer, page_size, PageOffset(type, page_id));
+    return written == static_cast<ssize_t>(page_size);
+}
+
+bool IndexFile::WritePages(
+    Rid::DataType type, int first_page_id, std::size_t count,
+    const Byte* buffer) {
+    assert(first_page_id + static_cast<int>(count) <= PageCount(type));
+    for (std::size_t i = 1; i < count; ++i) {
+        assert(directory[type][first_page_id + i] ==
+               directory[type][first_page_id] + static_cast<int>(i));
+    }
+    auto bytes = page_size * count;
+    auto written =
+        ::pwrite(fd, buffer, bytes, PageOffset(type, first_page_id));
+    return written == static_cast<ssize_t>(bytes);
+}
+
+void IndexFile::SetDimension(int dimension) {
+    header.dimension = dimension;
+    changed = true;
+}
+
+void IndexFile::SetRoot(const Rid& root) {
+    header.root = root;
+    changed = true;
+}
+
+void IndexFile::SetNextIndex(int index) {
+    header.next_index = index;
+    changed = true;
+}
+
+IndexFormat IndexFile::GetFormat() const {
+    IndexFormat format;
+    format.clustered_leaves = header.clustered_leaves;
+    format.quantized_records = header.quantized_records;
+    format.norm_sorted_leaves = header.norm_sorted_leaves;
+    format.cone_bounds = header.cone_bounds;
+    format.node_norms = header.node_norms;
+    format.single_file = true;
+    return format;
+}
+
+void IndexFile::SetFormat(const IndexFormat& format) {
+    header.clustered_leaves = format.clustered_leaves;
+    header.quantized_records = format.quantized_records;
+    header.norm_sorted_leaves = format.norm_sorted_leaves;
+    header.cone_bounds = format.cone_bounds;
+    header.node_norms = format.node_norms;
+    changed = true;
+}
+
+void IndexFile::SetFreeSlots(
+    Rid::DataType type, const std::vector<std::int32_t>& free) {
+    assert(free.size() == directory[type].size());
+    free_slots[type] = free;
+    changed = true;
+}
+
+/**
+ * page directory and free-space map
+ * +-------------------+----------------------+-----+-----------------------+-----+
+ * | int32 [4]         | int32 [page_num[0]]  | ... | int32 [page_num[0]]   | ... |
+ * +-------------------+----------------------+-----+-----------------------+-----+
+ * | page_num per type | file pages of type 0 | ... | free slots of type 0  | ... |
+ * +-------------------+----------------------+-----+-----------------------+-----+
+ */
+bool IndexFile::ReadHeader() {
+    Header stored;
+    if (::pread(fd, &stored, sizeof(stored), 0) != sizeof(stored) or
+        std::memcmp(stored.magic, header.magic, sizeof(header.magic)) != 0 or
+        stored.version != header.version or stored.page_size != page_size) {
+        return false;
+    }
+    header = stored;
+    std::int32_t page_num[kStorageNum];
+    auto offset = header.directory_offset;
+    if (::pread(fd, page_num, sizeof(page_num), offset) !=
+        static_cast<ssize_t>(sizeof(page_num))) {
+        return false;
+    }
+    offset += sizeof(page_num);
+    for (int type = 0; type < kStorageNum; ++type) {
+        directory[type].resize(page_num[type]);
+        auto bytes = sizeof(std::int32_t) * page_num[type];
+        if (::pread(fd, directory[type].data(), bytes, offset) !=
+            static_cast<ssize_t>(bytes)) {
+            return false;
+        }
+        offset += bytes;
+    }
+    for (int type = 0; type < kStorageNum; ++type) {
+        free_slots[type].resize(page_num[type]);
+        auto bytes = sizeof(std::int32_t) * page_num[type];
+        if (::pread(fd, free_slots[type].data(), bytes, offset) !=
+            static_cast<ssize_t>(bytes)) {
+            return false;
+        }
+        offset += bytes;
+    }
+    return true;
+}
+
+bool IndexFile::WriteHeader() {
+    // the directory grows with the file, it always goes after the last page
+    header.directory_offset =
+        (header.file_page_num + 1) * static_cast<std::int64_t>(page_size);
+    std::int32_t page_num[kStorageNum];
+    for (int type = 0; type < kStorageNum; ++type) {
+        page_num[type] = directory[type].size();
+    }
+    auto offset = header.directory_offset;
+    auto write = [this, &offset](const void* data, std::size_t bytes) {
+        auto written = ::pwrite(fd, data, bytes, offset);
+        offset += bytes;
+        return written == static_cast<ssize_t>(bytes);
+    };
+    if (not write(page_num, sizeof(page_num))) {
+        return false;
+    }
+    for (int type = 0; type < kStorageNum; ++type) {
+        if (not write(directory[type].data(),
+                      sizeof(std::int32_t) * page_num[type])) {
+            return false;
+        }
+    }
+    for (int type = 0; type < kStorageNum; ++type) {
+        if (not write(free_slots[type].data(),
+                      sizeof(std::int32_t) * page_num[type])) {
+            return false;
+        }
+    }
+    // drop a longer directory written by an earlier flush, the header goes
+    // last so that it never points at a directory half written
+    if (::ftruncate(fd, offset) != 0 or
+        ::pwrite(fd, &header, sizeof(header), 0) !=
+            static_cast<ssize_t>(sizeof(header))) {
+        return false;
+    }
+    changed = false;
+    return true;
+}
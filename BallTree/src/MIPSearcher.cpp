@@ -1,38 +1,271 @@
 #include "MIPSearcher.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
 void MIPSearcher::Visit(BallTreeBranch* branch) {
-    auto left = node_storage_->Get(branch->r_left);
-    auto right = node_storage_->Get(branch->r_right);
-    double left_mip = PossibleMip(std::move(left));
-    double right_mip = PossibleMip(std::move(right));
-    if (left_mip > right_mip and left_mip > cur_mip_) {
-        auto child_left = node_storage_->Get(branch->r_left);
-        child_left->Accept(*this);
-        if (right_mip > cur_mip_) {
-            auto child_right = node_storage_->Get(branch->r_right);
-            child_right->Accept(*this);
-        }
-    } else if (right_mip >= left_mip and right_mip > cur_mip_) {
-        auto child_right = node_storage_->Get(branch->r_right);
-        child_right->Accept(*this);
-        if (left_mip > cur_mip_) {
-            auto child_left = node_storage_->Get(branch->r_left);
-            child_left->Accept(*this);
-        }
-    } 
+    if (order_ == SearchOrder::best_first) {
+        VisitBestFirst(branch->r_left, branch->r_right);
+    } else {
+        VisitChildren(branch->r_left, branch->r_right);
+    }
 }
 void MIPSearcher::Visit(BallTreeLeaf* leaf) {
-    for (const auto& rid : leaf->data) {
-        auto record = record_storage_->Get(rid);
-        double innerproduct = InnerProduct(needle, record->data);
-        if (innerproduct > cur_mip_) {
-            cur_mip_ = innerproduct;
-            cur_max_idx_ = record->index;
+    bool sorted = leaf->norms.size() == leaf->data.size();
+    ScanRecords(leaf->data.data(), sorted ? leaf->norms.data() : nullptr,
+                leaf->data.size());
+}
+
+void MIPSearcher::VisitChildren(Rid r_left, Rid r_right) {
+    ++stats_.branches_visited;
+    if (prefetch_) {
+        // both reads are in flight before the first one is waited for
+        node_storage_->Prefetch(r_left);
+        node_storage_->Prefetch(r_right);
+    }
+    // the pins are dropped before descending, a path of pinned pages could
+    // otherwise fill the small node buffers
+    double left_mip = PossibleMip(*node_storage_->View(r_left));
+    double right_mip = PossibleMip(*node_storage_->View(r_right));
+    std::size_t visited = 0;
+    if (left_mip > right_mip and WorthVisiting(left_mip)) {
+        VisitNode(r_left);
+        ++visited;
+        if (WorthVisiting(right_mip)) {
+            VisitNode(r_right);
+            ++visited;
+        }
+    } else if (right_mip >= left_mip and WorthVisiting(right_mip)) {
+        VisitNode(r_right);
+        ++visited;
+        if (WorthVisiting(left_mip)) {
+            VisitNode(r_left);
+            ++visited;
+        }
+    }
+    stats_.subtrees_pruned += 2 - visited;
+}
+
+void MIPSearcher::VisitNode(Rid rid) {
+    if (OutOfBudget()) {
+        return;
+    }
+    auto node = node_storage_->View(rid);
+    if (node->type == Rid::branch) {
+        Rid r_left = node->left, r_right = node->right;
+        node = Pinned<NodeView>();
+        VisitChildren(r_left, r_right);
+    } else {
+        // records live in another storage, keeping the leaf pinned is safe
+        ScanRecords(node->rids, node->norms, node->rid_size, node->indices,
+                    node->vectors);
+    }
+}
+
+void MIPSearcher::VisitBestFirst(Rid r_left, Rid r_right) {
+    // (PossibleMip, rid) of the nodes bounded but not expanded yet, the
+    // best bound on top
+    using Frontier = std::pair<double, Rid>;
+    auto worse = [](const Frontier& a, const Frontier& b) {
+        return a.first < b.first;
+    };
+    std::priority_queue<Frontier, std::vector<Frontier>, decltype(worse)>
+        frontier(worse);
+    // bounds both children, pushes the worse one and sets next to the
+    // better one; false if that one is not worth visiting either
+    Rid next(0, 0, 0);
+    auto bound_children = [&](Rid left, Rid right) {
+        ++stats_.branches_visited;
+        if (prefetch_) {
+            node_storage_->Prefetch(left);
+            node_storage_->Prefetch(right);
+        }
+        double left_mip = PossibleMip(*node_storage_->View(left));
+        double right_mip = PossibleMip(*node_storage_->View(right));
+        if (not(left_mip > right_mip)) {
+            std::swap(left, right);
+            std::swap(left_mip, right_mip);
+        }
+        if (WorthVisiting(right_mip)) {
+            frontier.push({right_mip, right});
+        } else {
+            ++stats_.subtrees_pruned;
         }
+        if (not WorthVisiting(left_mip)) {
+            ++stats_.subtrees_pruned;
+            return false;
+        }
+        next = left;
+        return true;
+    };
+    bool descending = bound_children(r_left, r_right);
+    while (true) {
+        // from next down to a leaf through the better child of every branch
+        while (descending and not OutOfBudget()) {
+            auto node = node_storage_->View(next);
+            if (node->type == Rid::branch) {
+                Rid left = node->left, right = node->right;
+                node = Pinned<NodeView>();
+                descending = bound_children(left, right);
+            } else {
+                ScanRecords(node->rids, node->norms, node->rid_size,
+                            node->indices, node->vectors);
+                descending = false;
+            }
+        }
+        if (frontier.empty()) {
+            return;
+        }
+        // the threshold has only risen since the node was pushed, once the
+        // best bound left can not beat it none of the others can
+        if (not WorthVisiting(frontier.top().first) or OutOfBudget()) {
+            stats_.subtrees_pruned += frontier.size();
+            return;
+        }
+        next = frontier.top().second;
+        frontier.pop();
+        descending = true;
     }
 }
 
-double MIPSearcher::PossibleMip(const std::unique_ptr<BallTreeNode> node) {
-    return InnerProduct(needle, node->center) + node->radius * needle_norm;
+void MIPSearcher::ScanRecords(
+    const Rid* rids, const float* norms, std::size_t size,
+    const int* indices, const float* vectors) {
+    ++stats_.leaves_scanned;
+    // later pages load while the records of earlier ones are scored
+    for (std::size_t i = 0; prefetch_ and not vectors and i < size; ++i) {
+        if (i == 0 or rids[i].page_id != rids[i - 1].page_id) {
+            record_storage_->Prefetch(rids[i]);
+        }
+    }
+    for (std::size_t i = 0; i < size; ++i) {
+        // 记录按范数从大到小排 之后的记录都赢不了阈值
+        if (norms and norm_bound_ * norms[i] <= Threshold()) {
+            break;
+        }
+        ++stats_.records_scored;
+        if (vectors) {
+            // 向量就在叶子页里 不用读记录页
+            Score(indices[i], vectors + i * needle.size());
+            continue;
+        }
+        if (rids[i].type == Rid::quantized) {
+            ScoreQuantized(rids[i]);
+            continue;
+        }
+        auto record = record_storage_->View(rids[i]);
+        assert(record->size == needle.size());
+        Score(record->index, record->data);
+    }
+}
+
+void MIPSearcher::Score(int index, const float* data) {
+    if (skip_ and skip_->count(index)) {
+        return;
+    }
+    double innerproduct = kernels::Dot(needle.data(), data, needle.size());
+    if (innerproduct > Threshold()) {
+        Offer(index, innerproduct);
+    }
+}
+
+void MIPSearcher::ScoreQuantized(const Rid& rid) {
+    auto codes = record_storage_->ViewQuantized(rid);
+    assert(codes->size == needle.size());
+    if (skip_ and skip_->count(codes->index)) {
+        return;
+    }
+    double estimate =
+        codes->scale * kernels::DotInt8(needle.data(), codes->codes, codes->size);
+    // the inner product is at most estimate + error, a record that can not
+    // beat the threshold would not have been offered with full precision
+    if (estimate + codes->scale * quantization_error_ <= Threshold()) {
+        return;
+    }
+    ++stats_.records_reranked;
+    auto record = record_storage_->View(codes->full);
+    double innerproduct =
+        kernels::Dot(needle.data(), record->data, record->size);
+    if (innerproduct > Threshold()) {
+        Offer(record->index, innerproduct);
+    }
+}
+
+double MIPSearcher::NormBound(const std::vector<float>& v) {
+    return Norm(v) * (1 + 2.0 * (v.size() + 2) *
+                              std::numeric_limits<float>::epsilon());
+}
+
+double MIPSearcher::QuantizationError(const std::vector<float>& v) {
+    double l1 = 0;
+    for (auto x : v) {
+        l1 += std::abs(x);
+    }
+    return l1 * (0.5 + 2.0 * QuantizedRecord::kMaxCode * v.size() *
+                           std::numeric_limits<float>::epsilon());
+}
+
+std::vector<std::pair<int, double>> MIPSearcher::Results() const {
+    CandidateHeap heap(top_k_);
+    std::vector<std::pair<int, double>> ret(heap.size());
+    for (auto iter = ret.rbegin(); iter != ret.rend(); ++iter) {
+        *iter = {heap.top().second, heap.top().first};
+        heap.pop();
+    }
+    return ret;
+}
+
+double MIPSearcher::PossibleMip(const NodeView& node) const {
+    assert(node.center_size == needle.size());
+    double ball = kernels::Dot(needle.data(), node.center, node.center_size) +
+                  node.radius * needle_norm;
+    // 整个子树的记录范数都不超过 max_norm
+    ball = std::min(ball, norm_bound_ * node.max_norm);
+    if (not node.axis) {
+        return ball;
+    }
+    return std::min(
+        ball, ConeBound::Mip(needle.data(), needle_norm, node.axis,
+                             node.center_size, node.cos_spread,
+                             node.sin_spread, node.min_norm, node.max_norm));
+}
+
+double MIPSearcher::Threshold() const {
+    if (top_k_.size() < k_) {
+        return std::numeric_limits<double>::lowest();
+    }
+    return top_k_.top().first;
+}
+
+bool MIPSearcher::WorthVisiting(double possible_mip) {
+    if (not(possible_mip > Threshold())) {
+        return false;
+    }
+    if (budgeted_ and not(possible_mip > budget_.Relax(
+                                             Threshold(), top_k_.size() == k_))) {
+        // only the slack prunes it, a better record may be below
+        exact_ = false;
+        return false;
+    }
+    return true;
+}
+
+bool MIPSearcher::OutOfBudget() {
+    if (budgeted_ and budget_.Exhausted(stats_)) {
+        exact_ = false;
+        return true;
+    }
+    return false;
+}
+
+void MIPSearcher::Offer(int index, double innerproduct) {
+    if (top_k_.size() == k_) {
+        top_k_.pop();
+    }
+    top_k_.push({innerproduct, index});
+    if (cur_max_idx_ == -1 or innerproduct > cur_mip_) {
+        cur_mip_ = innerproduct;
+        cur_max_idx_ = index;
+    }
 }
 
@@ -1,4 +1,57 @@
 #include "NodeBuilder.h"
+#include <deque>
+
+namespace {
+
+/**
+ * where a PageStream will put the items it is given, without writing them
+ */
+class PagePlanner {
+  public:
+    PagePlanner(int slots_per_page, Rid::DataType type)
+        : slots_per_page_(slots_per_page), type_(type) {}
+
+    std::vector<Rid> PutRun(std::size_t n) {
+        if (page_id_ >= 0 and slots_per_page_ - used_ < static_cast<int>(n)) {
+            NewPage();
+        }
+        std::vector<Rid> rids;
+        rids.reserve(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            if (page_id_ < 0 or used_ == slots_per_page_) {
+                NewPage();
+            }
+            rids.emplace_back(page_id_, used_++, type_);
+        }
+        return rids;
+    }
+
+  private:
+    void NewPage() {
+        ++page_id_;
+        used_ = 0;
+    }
+
+    int slots_per_page_;
+    Rid::DataType type_;
+    int page_id_ = -1;
+    int used_ = 0;
+};
+
+/**
+ * the norms kept next to the rids of a leaf, see
+ * IndexFormat::norm_sorted_leaves
+ */
+std::vector<float> NormsOf(const std::vector<Record::Pointer>& records) {
+    std::vector<float> ret;
+    ret.reserve(records.size());
+    for (auto& record : records) {
+        ret.push_back(Norm(record->data));
+    }
+    return ret;
+}
+
+}  // anonymous namespace
 
 
 
@@ -12,7 +65,9 @@ void NodeStorer::Visit(BallTreeBranch* branch) {
 }
 
 void NodeStorer::Visit(BallTreeLeaf* leaf) {
+	// with clustered_leaves the leaf slot carries raw_data as well
 	leaf->data = StoreAll(leaf->raw_data);
+	leaf->norms = NormsOf(leaf->raw_data);
 	Rid r = node_storage_->Put(*leaf);
 	leaf->rid = r;
 }
@@ -28,3 +83,155 @@ std::vector<Rid> NodeStorer::StoreAll(const Records& records) {
     return ret;
 }
 
+
+BulkStorer::BulkStorer(const Path& dest_dir, int dimension,
+                       const IndexFormat& format,
+                       std::shared_ptr<IndexFile> file)
+    : dest_dir_(dest_dir),
+      dimension_(dimension),
+      format_(format),
+      file_(std::move(file)) {
+    auto record_size = Slot::GetSize(Rid::record, dimension);
+    auto branch_size = Slot::GetSize(
+        Rid::branch, dimension, false, format.node_norms, format.cone_bounds);
+    auto leaf_size = Slot::GetSize(
+        Rid::leaf, dimension, format.norm_sorted_leaves, format.node_norms,
+        format.cone_bounds, format.clustered_leaves);
+    if (file_) {
+        records_ = std::make_unique<RecordStream>(record_size, file_.get());
+        branches_ = std::make_unique<BranchStream>(branch_size, file_.get());
+        leaves_ = std::make_unique<LeafStream>(leaf_size, file_.get());
+    } else {
+        records_ = std::make_unique<RecordStream>(record_size, "record", dest_dir);
+        branches_ = std::make_unique<BranchStream>(branch_size, "branch", dest_dir);
+        leaves_ = std::make_unique<LeafStream>(leaf_size, "leaf", dest_dir);
+    }
+    if (format_.quantized_records) {
+        auto quantized_size = Slot::GetSize(Rid::quantized, dimension);
+        quantized_ = file_
+            ? std::make_unique<QuantizedStream>(quantized_size, file_.get())
+            : std::make_unique<QuantizedStream>(quantized_size, "qrecord", dest_dir);
+    }
+}
+
+void BulkStorer::Visit(BallTreeBranch* branch) {
+	branch->left->Accept(*this);
+	branch->r_left = branch->left->rid;
+	branch->right->Accept(*this);
+	branch->r_right = branch->right->rid;
+	branch->rid = branches_->Put(*branch);
+}
+
+void BulkStorer::Visit(BallTreeLeaf* leaf) {
+	StoreRecords(*leaf);
+	leaf->rid = leaves_->Put(*leaf);
+}
+
+void BulkStorer::StoreRecords(BallTreeLeaf& leaf) {
+	leaf.norms = NormsOf(leaf.raw_data);
+	leaf.data.clear();
+	leaf.data.reserve(leaf.raw_data.size());
+	for (auto& record : leaf.raw_data) {
+		leaf.data.push_back(records_->Put(*record));
+	}
+	if (not quantized_) {
+		return;
+	}
+	// 叶子指向量化的副本 副本记着完整记录的 rid
+	std::vector<std::unique_ptr<QuantizedRecord>> copies;
+	copies.reserve(leaf.raw_data.size());
+	for (std::size_t i = 0; i < leaf.raw_data.size(); ++i) {
+		copies.push_back(std::make_unique<QuantizedRecord>(
+			QuantizedRecord::Quantize(*leaf.raw_data[i], leaf.data[i])));
+	}
+	for (std::size_t i = 0; i < copies.size(); ++i) {
+		leaf.data[i] = quantized_->Put(*copies[i]);
+	}
+}
+
+void BulkStorer::StoreBlocked(BallTreeBranch& root) {
+	auto branch_slots = Page::SlotsPerPage(
+		Slot::GetSize(Rid::branch, dimension_, false, format_.node_norms,
+		              format_.cone_bounds),
+		64);
+	// 1. 切块: 每块是一棵子树的上面几层 按层序取满一页
+	// 块按深度优先排 一棵子树的块连在一起 搜索往下走时页也往后走
+	std::vector<std::vector<BallTreeBranch*>> blocks;
+	std::vector<BallTreeBranch*> block_roots{&root};
+	while (not block_roots.empty()) {
+		auto block_root = block_roots.back();
+		block_roots.pop_back();
+		std::vector<BallTreeBranch*> block;
+		std::deque<BallTreeBranch*> frontier{block_root};
+		while (not frontier.empty() and
+		       static_cast<int>(block.size()) < branch_slots) {
+			auto branch = frontier.front();
+			frontier.pop_front();
+			block.push_back(branch);
+			for (auto child : {branch->left.get(), branch->right.get()}) {
+				if (auto child_branch = dynamic_cast<BallTreeBranch*>(child)) {
+					frontier.push_back(child_branch);
+				}
+			}
+		}
+		// 没放进这一块的分支各自开始新的块 最左边的先处理
+		block_roots.insert(block_roots.end(), frontier.rbegin(), frontier.rend());
+		blocks.push_back(std::move(block));
+	}
+
+	// 2. 叶子和记录照旧按深度优先的顺序存 和搜索访问它们的顺序一致
+	std::vector<BallTreeNode*> stack{&root};
+	while (not stack.empty()) {
+		auto node = stack.back();
+		stack.pop_back();
+		if (auto branch = dynamic_cast<BallTreeBranch*>(node)) {
+			stack.push_back(branch->right.get());
+			stack.push_back(branch->left.get());
+		} else {
+			Visit(static_cast<BallTreeLeaf*>(node));
+		}
+	}
+
+	// 3. 分支要先知道孩子的 rid 所以先算出每块落在哪 再按块写出
+	PagePlanner planner(branch_slots, Rid::branch);
+	for (auto& block : blocks) {
+		auto rids = planner.PutRun(block.size());
+		for (std::size_t i = 0; i < block.size(); ++i) {
+			block[i]->rid = rids[i];
+		}
+	}
+	for (auto& block : blocks) {
+		for (auto branch : block) {
+			branch->r_left = branch->left->rid;
+			branch->r_right = branch->right->rid;
+		}
+		auto rids = branches_->PutRun<BallTreeBranch>(block);
+		assert(rids.front().page_id == block.front()->rid.page_id and
+		       rids.front().slot_id == block.front()->rid.slot_id);
+	}
+}
+
+void BulkStorer::Store(BallTreeNode& root, int next_index) {
+	auto root_branch = dynamic_cast<BallTreeBranch*>(&root);
+	if (format_.clustered_subtrees and root_branch) {
+		StoreBlocked(*root_branch);
+	} else {
+		root.Accept(*this);
+	}
+	records_->Close();
+	branches_->Close();
+	leaves_->Close();
+	if (quantized_) {
+		quantized_->Close();
+	}
+	if (file_) {
+		file_->SetDimension(dimension_);
+		file_->SetFormat(format_);
+		file_->SetRoot(root.rid);
+		file_->SetNextIndex(next_index);
+		return;
+	}
+	NodeStorage::WriteRootFile(
+		dest_dir_, root.rid, dimension_, format_, next_index);
+	NormalStorage::WriteDimensionFile(dest_dir_, dimension_, format_);
+}
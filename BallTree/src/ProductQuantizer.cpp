@@ -0,0 +1,103 @@
+#include "ProductQuantizer.h"
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+constexpr int ProductQuantizer::kCentroids;
+constexpr int ProductQuantizer::kSubspaceWidth;
+constexpr std::size_t ProductQuantizer::kTrainingSample;
+constexpr int ProductQuantizer::kIterations;
+
+ProductQuantizer::ProductQuantizer(int dimension, int subspaces)
+    : dimension_(dimension),
+      subspaces_(subspaces > 0
+                     ? std::min(subspaces, dimension)
+                     : (dimension + kSubspaceWidth - 1) / kSubspaceWidth),
+      centroids_(static_cast<std::size_t>(dimension) * kCentroids, 0) {
+    assert(dimension > 0);
+}
+
+void ProductQuantizer::Train(
+    const float* rows, std::size_t n, std::size_t stride) {
+    if (n == 0) {
+        return;
+    }
+    // 均匀取样 每个子空间在同一批样本上各跑一遍 k-means
+    std::size_t step = std::max<std::size_t>(1, n / kTrainingSample);
+    std::vector<const float*> sample;
+    for (std::size_t i = 0; i < n and sample.size() < kTrainingSample; i += step) {
+        sample.push_back(rows + i * stride);
+    }
+    std::vector<int> assignment(sample.size());
+    for (int m = 0; m < subspaces_; ++m) {
+        int begin = Begin(m), width = Begin(m + 1) - begin;
+        auto codebook = centroids_.data() + begin * kCentroids;
+        // 初始中心取样本中隔开的几行 样本比中心少时重复使用
+        for (int c = 0; c < kCentroids; ++c) {
+            auto row = sample[c * sample.size() / kCentroids] + begin;
+            std::copy(row, row + width, codebook + c * width);
+        }
+        for (int iteration = 0; iteration < kIterations; ++iteration) {
+            for (std::size_t i = 0; i < sample.size(); ++i) {
+                assignment[i] = Nearest(m, sample[i] + begin);
+            }
+            std::vector<double> sums(kCentroids * width, 0);
+            std::vector<std::size_t> counts(kCentroids, 0);
+            for (std::size_t i = 0; i < sample.size(); ++i) {
+                auto c = assignment[i];
+                ++counts[c];
+                for (int j = 0; j < width; ++j) {
+                    sums[c * width + j] += sample[i][begin + j];
+                }
+            }
+            for (int c = 0; c < kCentroids; ++c) {
+                // 空的簇保留原来的中心
+                if (counts[c] == 0) continue;
+                for (int j = 0; j < width; ++j) {
+                    codebook[c * width + j] = sums[c * width + j] / counts[c];
+                }
+            }
+        }
+    }
+}
+
+int ProductQuantizer::Nearest(int m, const float* sub) const {
+    int width = Begin(m + 1) - Begin(m);
+    int best = 0;
+    float best_distance = std::numeric_limits<float>::max();
+    auto centroid = Centroid(m, 0);
+    // 子空间只有几维 直接算比调用 SIMD 内核快
+    for (int c = 0; c < kCentroids; ++c, centroid += width) {
+        float distance = 0;
+        for (int j = 0; j < width; ++j) {
+            float diff = sub[j] - centroid[j];
+            distance += diff * diff;
+        }
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = c;
+        }
+    }
+    return best;
+}
+
+void ProductQuantizer::Encode(const float* v, std::uint8_t* codes) const {
+    for (int m = 0; m < subspaces_; ++m) {
+        codes[m] = Nearest(m, v + Begin(m));
+    }
+}
+
+void ProductQuantizer::Table(const float* v, float* table) const {
+    for (int m = 0; m < subspaces_; ++m) {
+        int width = Begin(m + 1) - Begin(m);
+        auto sub = v + Begin(m);
+        auto centroid = Centroid(m, 0);
+        for (int c = 0; c < kCentroids; ++c, centroid += width) {
+            float sum = 0;
+            for (int j = 0; j < width; ++j) {
+                sum += sub[j] * centroid[j];
+            }
+            table[m * kCentroids + c] = sum;
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#include "Replacer.h"
+#include <cassert>
+
+std::unique_ptr<Replacer> Replacer::Create(
+    ReplacementPolicy policy, std::size_t frame_num) {
+    assert(frame_num > 0);
+    switch (policy) {
+        case ReplacementPolicy::lru:
+            return std::make_unique<LruReplacer>(frame_num);
+        case ReplacementPolicy::two_queue:
+            return std::make_unique<TwoQueueReplacer>(frame_num);
+        case ReplacementPolicy::clock:
+        default:
+            return std::make_unique<ClockReplacer>(frame_num);
+    }
+}
+
+void ClockReplacer::Insert(std::size_t frame_id) {
+    is_referenced[frame_id] = true;
+}
+
+void ClockReplacer::Touch(std::size_t frame_id) {
+    is_referenced[frame_id] = true;
+}
+
+int ClockReplacer::Victim(const std::vector<int>& pin_count) {
+    // 循环 + 引用位　判断
+    // 被 pin 住的帧不能换出 转两圈让引用位有机会清掉
+    auto frame_num = is_referenced.size();
+    for (std::size_t index = 0; index < 2 * frame_num; ++index) {
+        auto frame_id = clock_hand;
+        clock_hand = (clock_hand + 1) % frame_num;
+        if (pin_count[frame_id] > 0) continue;
+        if (not is_referenced[frame_id]) {
+            return frame_id;
+        }
+        // 如果引用位有效　关闭引用位
+        is_referenced[frame_id] = false;
+    }
+    return -1;
+}
+
+void LruReplacer::Insert(std::size_t frame_id) {
+    Touch(frame_id);
+}
+
+void LruReplacer::Touch(std::size_t frame_id) {
+    if (in_list[frame_id]) {
+        // relinks the node, nothing is allocated on a hit
+        order.splice(order.begin(), order, positions[frame_id]);
+        return;
+    }
+    order.push_front(frame_id);
+    positions[frame_id] = order.begin();
+    in_list[frame_id] = true;
+}
+
+int LruReplacer::Victim(const std::vector<int>& pin_count) {
+    for (auto iter = order.rbegin(); iter != order.rend(); ++iter) {
+        if (pin_count[*iter] == 0) {
+            return *iter;
+        }
+    }
+    return -1;
+}
+
+void LruReplacer::Erase(std::size_t frame_id) {
+    if (not in_list[frame_id]) return;
+    order.erase(positions[frame_id]);
+    in_list[frame_id] = false;
+}
+
+void TwoQueueReplacer::Insert(std::size_t frame_id) {
+    again.Erase(frame_id);
+    once.Insert(frame_id);
+}
+
+void TwoQueueReplacer::Touch(std::size_t frame_id) {
+    if (once.Contains(frame_id)) {
+        // second hit: promote
+        once.Erase(frame_id);
+    }
+    again.Touch(frame_id);
+}
+
+int TwoQueueReplacer::Victim(const std::vector<int>& pin_count) {
+    int victim = once.Victim(pin_count);
+    if (victim == -1) {
+        victim = again.Victim(pin_count);
+    }
+    return victim;
+}
@@ -0,0 +1,263 @@
+#include "SimdKernels.h"
+#include <initializer_list>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BALLTREE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace kernels {
+
+namespace {
+
+float DotScalar(const float* a, const float* b, std::size_t n) {
+    float sum = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+float DotInt8Scalar(const float* a, const std::int8_t* b, std::size_t n) {
+    float sum = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+float SquaredL2Scalar(const float* a, const float* b, std::size_t n) {
+    float sum = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+#ifdef BALLTREE_X86_KERNELS
+
+__attribute__((target("sse"))) float HorizontalSum(__m128 v) {
+    __m128 shuffled = _mm_movehl_ps(v, v);
+    __m128 sums = _mm_add_ps(v, shuffled);
+    shuffled = _mm_shuffle_ps(sums, sums, 0x55);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuffled));
+}
+
+__attribute__((target("sse")))
+float DotSse(const float* a, const float* b, std::size_t n) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(
+            acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(
+            acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float sum = HorizontalSum(_mm_add_ps(acc0, acc1));
+    return sum + DotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse")))
+float SquaredL2Sse(const float* a, const float* b, std::size_t n) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 =
+            _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    float sum = HorizontalSum(_mm_add_ps(acc0, acc1));
+    return sum + SquaredL2Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) float HorizontalSum(__m256 v) {
+    return HorizontalSum(
+        _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+float DotAvx2(const float* a, const float* b, std::size_t n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm256_fmadd_ps(
+            _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(
+            _mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(
+            _mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(
+            _mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(
+            _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    float sum = HorizontalSum(
+        _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    return sum + DotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+float DotInt8Avx2(const float* a, const std::int8_t* b, std::size_t n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // 8 codes at a time widened to int32 and then to float
+        __m256 b0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + i))));
+        __m256 b1 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + i + 8))));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), b0, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), b1, acc1);
+    }
+    float sum = HorizontalSum(_mm256_add_ps(acc0, acc1));
+    return sum + DotInt8Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+float SquaredL2Avx2(const float* a, const float* b, std::size_t n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 =
+            _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(
+            _mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d0 =
+            _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    }
+    float sum = HorizontalSum(_mm256_add_ps(acc0, acc1));
+    return sum + SquaredL2Scalar(a + i, b + i, n - i);
+}
+
+// _mm512_reduce_add_ps and the casts to 256 bits start from an undefined
+// register, which GCC 12 reports as uninitialized; the halves are summed
+// through memory instead
+__attribute__((target("avx512f"))) float HorizontalSum(__m512 v) {
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, v);
+    return HorizontalSum(
+        _mm256_add_ps(_mm256_load_ps(lanes), _mm256_load_ps(lanes + 8)));
+}
+
+__attribute__((target("avx512f")))
+float DotAvx512(const float* a, const float* b, std::size_t n) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(
+            _mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(
+            _mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i < n; i += 16) {
+        // masked loads cover the tail, lanes past n read as zero
+        __mmask16 mask = n - i >= 16 ? 0xFFFF : (1u << (n - i)) - 1;
+        acc0 = _mm512_fmadd_ps(
+            _mm512_maskz_loadu_ps(mask, a + i),
+            _mm512_maskz_loadu_ps(mask, b + i), acc0);
+    }
+    return HorizontalSum(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+float DotInt8Avx512(const float* a, const std::int8_t* b, std::size_t n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // the zero-masked conversions, for the same reason as HorizontalSum
+        __m512 b0 = _mm512_maskz_cvtepi32_ps(
+            0xFFFF, _mm512_maskz_cvtepi8_epi32(
+                        0xFFFF, _mm_loadu_si128(
+                                    reinterpret_cast<const __m128i*>(b + i))));
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), b0, acc0);
+    }
+    // a masked byte load would need AVX-512BW, the tail is left scalar
+    return HorizontalSum(acc0) + DotInt8Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+float SquaredL2Avx512(const float* a, const float* b, std::size_t n) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 =
+            _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(
+            _mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i < n; i += 16) {
+        __mmask16 mask = n - i >= 16 ? 0xFFFF : (1u << (n - i)) - 1;
+        __m512 d0 = _mm512_sub_ps(
+            _mm512_maskz_loadu_ps(mask, a + i),
+            _mm512_maskz_loadu_ps(mask, b + i));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    }
+    return HorizontalSum(_mm512_add_ps(acc0, acc1));
+}
+
+#endif  // BALLTREE_X86_KERNELS
+
+const KernelSet kScalar{
+    Isa::scalar, "scalar", DotScalar, SquaredL2Scalar, DotInt8Scalar};
+#ifdef BALLTREE_X86_KERNELS
+// widening int8 needs SSE4.1, the SSE set scores codes with the scalar loop
+const KernelSet kSse{Isa::sse, "sse", DotSse, SquaredL2Sse, DotInt8Scalar};
+const KernelSet kAvx2{
+    Isa::avx2, "avx2", DotAvx2, SquaredL2Avx2, DotInt8Avx2};
+const KernelSet kAvx512{
+    Isa::avx512, "avx512", DotAvx512, SquaredL2Avx512, DotInt8Avx512};
+#endif
+
+const KernelSet* Best() {
+    for (auto isa : {Isa::avx512, Isa::avx2, Isa::sse}) {
+        if (auto kernels = Select(isa)) {
+            return kernels;
+        }
+    }
+    return &kScalar;
+}
+
+}  // anonymous namespace
+
+const KernelSet* Select(Isa isa) {
+#ifdef BALLTREE_X86_KERNELS
+    __builtin_cpu_init();
+#endif
+    switch (isa) {
+#ifdef BALLTREE_X86_KERNELS
+        case Isa::avx512:
+            return __builtin_cpu_supports("avx512f") ? &kAvx512 : nullptr;
+        case Isa::avx2:
+            return __builtin_cpu_supports("avx2") and
+                           __builtin_cpu_supports("fma")
+                       ? &kAvx2
+                       : nullptr;
+        case Isa::sse:
+            return __builtin_cpu_supports("sse") ? &kSse : nullptr;
+#endif
+        case Isa::scalar:
+            return &kScalar;
+        default:
+            return nullptr;
+    }
+}
+
+const KernelSet& Active() {
+    static const KernelSet* active = Best();
+    return *active;
+}
+
+}  // namespace kernels
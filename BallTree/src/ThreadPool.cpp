@@ -0,0 +1,107 @@
+#include "ThreadPool.h"
+
+namespace {
+
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local int current_index = -1;
+
+}  // anonymous namespace
+
+ThreadPool::ThreadPool(std::size_t threads) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    queues_.reserve(threads);
+    for (std::size_t i = 0; i < threads; ++i) {
+        queues_.push_back(std::make_unique<TaskQueue>());
+    }
+    workers_.reserve(threads);
+    for (std::size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back([this, i] { Work(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wake_up_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+int ThreadPool::WorkerIndex() const {
+    return current_pool == this ? current_index : -1;
+}
+
+void ThreadPool::Push(Task task) {
+    int self = WorkerIndex();
+    std::size_t index =
+        self >= 0 ? self : next_queue_.fetch_add(1) % queues_.size();
+    {
+        std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        ++pending_;
+    }
+    wake_up_.notify_one();
+}
+
+bool ThreadPool::Pop(std::size_t index, Task& task) {
+    auto& queue = *queues_[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    return true;
+}
+
+bool ThreadPool::Steal(std::size_t thief, Task& task) {
+    for (std::size_t i = 1; i <= queues_.size(); ++i) {
+        auto& queue = *queues_[(thief + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        return true;
+    }
+    return false;
+}
+
+bool ThreadPool::TryRunOne() {
+    int self = WorkerIndex();
+    Task task;
+    if (not(self >= 0 and Pop(self, task)) and
+        not Steal(self >= 0 ? self : 0, task)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        --pending_;
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::Work(std::size_t index) {
+    current_pool = this;
+    current_index = index;
+    while (true) {
+        if (TryRunOne()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wake_up_.wait(lock, [this] { return stop_ or pending_ > 0; });
+        if (stop_ and pending_ == 0) {
+            return;
+        }
+    }
+}
@@ -9,12 +9,21 @@ Page::Page(int page_id, IntType slot_size, Rid::DataType type, Byte* pool_base,
     *reinterpret_cast<Rid::DataType*>(solt_size_addr - sizeof(Rid::DataType)) = type;
     this->type = type;
     init();
-    m_slot_map = std::vector<bool>(m_bitmap_size * 8, false);
+    m_slot_map.assign((m_bitmap_size + sizeof(Word) - 1) / sizeof(Word), 0);
 }
 
 Page::Page(int page_id, std::istream& in, Byte* pool_base, int page_size_in_k = 64)
           : Page(page_id, page_size_in_k, pool_base) {
     in.read(reinterpret_cast<char*>(m_slot_pool), page_size);
+    load();
+}
+
+Page::Page(int page_id, Byte* pool_base, int page_size_in_k)
+          : Page(page_id, static_cast<IntType>(page_size_in_k), pool_base) {
+    load();
+}
+
+void Page::load() {
     Byte* solt_size_addr = m_slot_pool + page_size - sizeof(IntType);
     m_slot_size = *reinterpret_cast<IntType*>(solt_size_addr);
     type = *reinterpret_cast<Rid::DataType*>(solt_size_addr - sizeof(Rid::DataType));
@@ -33,15 +42,19 @@ Page::Page(int page_id, IntType page_size_in_k, Byte* pool_base)
  * @Description Write data to file;
  */
 void Page::sync(std::ostream& out) {
-    restoreBitMap();
+    sync();
     out.write(reinterpret_cast<char*>(m_slot_pool), page_size);
 }
 
+void Page::sync() {
+    restoreBitMap();
+}
+
 /**
  * @Description Select a slot according to solt id.
  */
 Slot Page::select(const int& slot_id) {
-    assert(slot_id < m_slot_map.size() and m_slot_map[slot_id]);
+    assert(slot_id < m_total_slot and isUsed(slot_id));
     return makeSlot(slot_id);
 }
 /**
@@ -51,14 +64,17 @@ Slot Page::select(const int& slot_id) {
 std::tuple<Rid, Slot> Page::insert() {
     assert(not isFull());
     Rid ret(m_page_id, m_total_slot, type);
-    for (int i = 0; i < m_total_slot; ++i) {
-        if (m_slot_map[i] == false) {
-            m_slot_map[i] = true;
-            m_slot_num++;
-            ret.slot_id = i;
-            break;
-        }
+    for (auto w = m_first_free_word; w < m_slot_map.size(); ++w) {
+        if (m_slot_map[w] == ~Word(0)) continue;
+        // 最低的 0 位就是第一个空槽 页不满时它一定小于 m_total_slot
+        int bit = __builtin_ctzll(~m_slot_map[w]);
+        m_slot_map[w] |= Word(1) << bit;
+        m_slot_num++;
+        m_first_free_word = w;
+        ret.slot_id = w * 64 + bit;
+        break;
     }
+    assert(ret.slot_id < m_total_slot);
     this->m_dirty = true;
     return std::make_tuple(ret, makeSlot(ret.slot_id));
 }
@@ -67,43 +83,56 @@ std::tuple<Rid, Slot> Page::insert() {
  * @Description Drop a slot from page, just reset its bit in bitmap
  */
 bool Page::drop(const int& slot_id) {
-    if (slot_id < m_total_slot || m_slot_map[slot_id] == false) return false;
-    m_slot_map[slot_id] = false;
+    if (slot_id < 0 || slot_id >= m_total_slot || not isUsed(slot_id)) return false;
+    m_slot_map[slot_id / 64] &= ~(Word(1) << (slot_id % 64));
     m_slot_num--;
+    if (static_cast<std::size_t>(slot_id / 64) < m_first_free_word) {
+        m_first_free_word = slot_id / 64;
+    }
     m_dirty = true;
     return true;
 }
 
 void Page::initBitMap() {
-    m_slot_map.clear();
-    m_slot_map.reserve(m_bitmap_size * 8);
+    // byte i of the bitmap holds slots 8 * i to 8 * i + 7, lowest bit first
+    m_slot_map.assign((m_bitmap_size + sizeof(Word) - 1) / sizeof(Word), 0);
     for (IntType i = 0; i < m_bitmap_size; ++i) {
-        for (int bit_pos = 0; bit_pos < 8; ++bit_pos) {
-            bool valid = bitmap_pos[i] & (1 << bit_pos);
-            m_slot_map.push_back(valid);
-        }
+        m_slot_map[i / sizeof(Word)] |=
+            Word(bitmap_pos[i]) << (8 * (i % sizeof(Word)));
+    }
+    // 末尾凑整的位不算槽
+    for (auto slot = static_cast<IntType>(m_total_slot);
+         slot < m_slot_map.size() * 64; ++slot) {
+        m_slot_map[slot / 64] &= ~(Word(1) << (slot % 64));
     }
+    m_slot_num = 0;
+    for (auto word : m_slot_map) {
+        m_slot_num += __builtin_popcountll(word);
+    }
+    m_first_free_word = 0;
 }
 
 void Page::restoreBitMap() {
     if (not m_dirty) return;
-    Byte* end_pos = bitmap_pos + m_slot_map.size() / 8;
-    auto it = m_slot_map.begin();
-    for (Byte* pos = bitmap_pos; pos != end_pos; ++pos) {
-        *pos = bitsToByte(it, it + 8);
-        // dangerous step !!!
-        it += 8;
+    for (IntType i = 0; i < m_bitmap_size; ++i) {
+        bitmap_pos[i] = static_cast<Byte>(
+            m_slot_map[i / sizeof(Word)] >> (8 * (i % sizeof(Word))));
     }
     m_dirty = false;
 }
 
-void Page::init() {
+int Page::SlotsPerPage(IntType slot_size, IntType page_size_in_k) {
+    IntType page_size = page_size_in_k * 1024 / sizeof(Byte);
     // reserve 8 bits for bitmap alignemt
     const int page_bit =
             (page_size - sizeof(IntType) - sizeof(Rid::DataType) - 1) * 8;
     // 1 bit for bitmap
-    const int bit_per_slot = m_slot_size * 8 + 1;
-    m_total_slot = page_bit / bit_per_slot;
+    const int bit_per_slot = slot_size * 8 + 1;
+    return page_bit / bit_per_slot;
+}
+
+void Page::init() {
+    m_total_slot = SlotsPerPage(m_slot_size, page_size * sizeof(Byte) / 1024);
     m_bitmap_size = m_total_slot / 8 + 1;
     bitmap_pos = m_slot_pool + page_size - sizeof(IntType) - sizeof(Rid::DataType) - m_bitmap_size;
 }
@@ -21,11 +21,12 @@ bool Slot::Get(std::unique_ptr<Record>& pointer) {
 
 /**
  * A slot of BallTreeBranch
- * +-------------+---------------------+--------+------+-------+
- * |    size_t   | float [center_size] | double |  Rid |  Rid  |
- * +-------------+---------------------+--------+------+-------+
- * | center_size |    vector center    | radius | left | right |
- * +-------------+---------------------+--------+------+-------+
+ * +-------------+---------------------+--------+------+-------+------+
+ * |    size_t   | float [center_size] | double |  Rid |  Rid  |      |
+ * +-------------+---------------------+--------+------+-------+------+
+ * | center_size |    vector center    | radius | left | right |bounds|
+ * +-------------+---------------------+--------+------+-------+------+
+ * bounds only in slots of an index with node_norms or cone_bounds
  */
 bool Slot::Get(std::unique_ptr<BallTreeBranch>& pointer) {
   if (type != Rid::branch) return false;
@@ -38,16 +39,29 @@ bool Slot::Get(std::unique_ptr<BallTreeBranch>& pointer) {
   auto right = *reinterpret_cast<Rid*>(radius_begin + sizeof(double) + sizeof(Rid));
   std::vector<float> center(center_begin, center_begin + center_size);
   pointer = BallTreeBranch::Create(std::move(center), radius, nullptr, nullptr, left, right);
+  GetBounds(radius_begin + sizeof(double) + sizeof(Rid) * 2, center_size,
+            *pointer);
   return true;
 }
 
 /**
  * A slot of BallTreeLeaf
- * +-------------+---------------------+--------+----------+----------------+
- * |    size_t   | float [center_size] | double |  size_t  | Rid [rid_size] |
- * +-------------+---------------------+--------+----------+----------------+
- * | center_size |    vector center    | radius | rid_size |  vector rids   |
- * +-------------+---------------------+--------+----------+----------------+
+ * +-------------+---------------------+--------+----------+----------+------------+
+ * |    size_t   | float [center_size] | double |  size_t  | Rid [N0] | float [N0] |
+ * +-------------+---------------------+--------+----------+----------+------------+
+ * | center_size |    vector center    | radius | rid_size |   rids   |   norms    |
+ * +-------------+---------------------+--------+----------+----------+------------+
+ * the first rid_size rids and norms are used, the norms only in slots of
+ * an index with norm_sorted_leaves, node_norms or cone_bounds; the bounds
+ * follow the norms, only with node_norms or cone_bounds
+ *
+ * with clustered_leaves the slot ends with the records of the leaf, in the
+ * order of the rids
+ * +-------------+---------------------------+
+ * |  int [N0]   | float [N0][center_size]   |
+ * +-------------+---------------------------+
+ * |   indices   |         vectors           |
+ * +-------------+---------------------------+
  */
 bool Slot::Get(std::unique_ptr<BallTreeLeaf>& pointer) {
   if (type != Rid::leaf) return false;
@@ -63,6 +77,88 @@ bool Slot::Get(std::unique_ptr<BallTreeLeaf>& pointer) {
   std::vector<float> center(center_begin, center_begin + center_size);
   std::vector<Rid> rids(rid_begin, rid_begin + rid_size);
   pointer = BallTreeLeaf::Create(std::move(center), radius, std::move(rids));
+  if (HasNorms(center_size)) {
+    auto norms_begin = reinterpret_cast<float*>(rid_begin + N0);
+    pointer->norms.assign(norms_begin, norms_begin + rid_size);
+  }
+  GetBounds(reinterpret_cast<Byte*>(rid_begin + N0) + sizeof(float) * N0,
+            center_size, *pointer);
+  if (HasVectors(center_size)) {
+    auto indices = reinterpret_cast<int*>(slot + byte_size - VectorsSize(center_size));
+    auto vectors = reinterpret_cast<float*>(indices + N0);
+    for (size_t i = 0; i < rid_size; ++i) {
+      auto data = vectors + i * center_size;
+      pointer->raw_data.push_back(Record::Create(
+          indices[i], std::vector<float>(data, data + center_size)));
+    }
+  }
+  return true;
+}
+
+/**
+ * same layout as Get(std::unique_ptr<Record>&), nothing is copied
+ */
+bool Slot::View(RecordView& view) const {
+  if (type != Rid::record) return false;
+  view.index = *reinterpret_cast<const int*>(slot);
+  view.size = *reinterpret_cast<const size_t*>(slot + sizeof(int));
+  view.data =
+      reinterpret_cast<const float*>(slot + sizeof(int) + sizeof(size_t));
+  return true;
+}
+
+/**
+ * same layouts as the branch and leaf Get, nothing is copied
+ */
+bool Slot::View(NodeView& view) const {
+  if (type != Rid::branch and type != Rid::leaf) return false;
+  view.type = type;
+  view.center_size = *reinterpret_cast<const size_t*>(slot);
+  view.center = reinterpret_cast<const float*>(slot + sizeof(size_t));
+  const Byte* radius_begin =
+      reinterpret_cast<const Byte*>(view.center + view.center_size);
+  view.radius = *reinterpret_cast<const double*>(radius_begin);
+  const Byte* bounds_begin = nullptr;
+  if (type == Rid::branch) {
+    view.left = *reinterpret_cast<const Rid*>(radius_begin + sizeof(double));
+    view.right = *reinterpret_cast<const Rid*>(
+        radius_begin + sizeof(double) + sizeof(Rid));
+    view.rids = nullptr;
+    view.norms = nullptr;
+    view.rid_size = 0;
+    view.indices = nullptr;
+    view.vectors = nullptr;
+    bounds_begin = radius_begin + sizeof(double) + sizeof(Rid) * 2;
+  } else {
+    view.rid_size =
+        *reinterpret_cast<const size_t*>(radius_begin + sizeof(double));
+    view.rids = reinterpret_cast<const Rid*>(
+        radius_begin + sizeof(double) + sizeof(size_t));
+    view.norms = HasNorms(view.center_size)
+        ? reinterpret_cast<const float*>(view.rids + N0) : nullptr;
+    bounds_begin =
+        reinterpret_cast<const Byte*>(view.rids + N0) + sizeof(float) * N0;
+    view.indices = nullptr;
+    view.vectors = nullptr;
+    if (HasVectors(view.center_size)) {
+      view.indices = reinterpret_cast<const int*>(
+          slot + byte_size - VectorsSize(view.center_size));
+      view.vectors = reinterpret_cast<const float*>(view.indices + N0);
+    }
+  }
+  auto bounds = reinterpret_cast<const double*>(bounds_begin);
+  view.min_norm = 0;
+  view.max_norm = kUnknownNorm;
+  if (HasNodeNorms(view.center_size)) {
+    view.min_norm = bounds[0];
+    view.max_norm = bounds[1];
+  }
+  view.axis = nullptr;
+  if (HasCone(view.center_size)) {
+    view.cos_spread = bounds[2];
+    view.sin_spread = bounds[3];
+    view.axis = reinterpret_cast<const float*>(bounds + 4);
+  }
   return true;
 }
 /**
@@ -88,12 +184,7 @@ bool Slot::Set(const Record& record) {
 }
 
 /**
- * A slot of BallTreeBranch
- * +-------------+---------------------+--------+------+-------+
- * |    size_t   | float [center_size] | double |  Rid |  Rid  |
- * +-------------+---------------------+--------+------+-------+
- * | center_size |    vector center    | radius | left | right |
- * +-------------+---------------------+--------+------+-------+
+ * same layout as Get(std::unique_ptr<BallTreeBranch>&)
  */
 bool Slot::Set(const BallTreeBranch& branch) {
   if (type != Rid::branch) return false;
@@ -113,16 +204,13 @@ bool Slot::Set(const BallTreeBranch& branch) {
   *radius = branch.radius;
   *left_addr = branch.r_left;
   *right_addr = branch.r_right;
+  SetBounds(reinterpret_cast<Byte*>(right_addr + 1), branch);
 
   return true;
 }
 /**
- * A slot of BallTreeLeaf
- * +-------------+---------------------+--------+----------+----------------+
- * |    size_t   | float [center_size] | double |  size_t  | Rid [rid_size] |
- * +-------------+---------------------+--------+----------+----------------+
- * | center_size |    vector center    | radius | rid_size |  vector rids   |
- * +-------------+---------------------+--------+----------+----------------+
+ * same layout as Get(std::unique_ptr<BallTreeLeaf>&), the norms and the
+ * records are only written if the slot has room for them
  */
 bool Slot::Set(const BallTreeLeaf& leaf) {
   if (type != Rid::leaf) return false;
@@ -144,22 +232,132 @@ bool Slot::Set(const BallTreeLeaf& leaf) {
                  [](const auto& data) { return data; });
   *reinterpret_cast<double*>(radius) = leaf.radius;
   *rid_size = leaf.data.size();
+  if (HasNorms(leaf.center.size())) {
+    assert(leaf.norms.size() == leaf.data.size());
+    std::copy(leaf.norms.begin(), leaf.norms.end(),
+              reinterpret_cast<float*>(rid_begin + N0));
+  }
+  SetBounds(reinterpret_cast<Byte*>(rid_begin + N0) + sizeof(float) * N0,
+            leaf);
+  if (HasVectors(leaf.center.size())) {
+    assert(leaf.raw_data.size() == leaf.data.size());
+    auto indices = reinterpret_cast<int*>(
+        slot + byte_size - VectorsSize(leaf.center.size()));
+    auto vectors = reinterpret_cast<float*>(indices + N0);
+    for (size_t i = 0; i < leaf.raw_data.size(); ++i) {
+      auto& record = *leaf.raw_data[i];
+      assert(record.Size() == leaf.center.size());
+      indices[i] = record.index;
+      std::copy(record.data.begin(), record.data.end(),
+                vectors + i * leaf.center.size());
+    }
+  }
+  return true;
+}
+
+/**
+ * A slot of QuantizedRecord
+ * +-------+-------+------+------------+-------------------+
+ * |  int  | float |  Rid |   size_t   | int8 [codes_size] |
+ * +-------+-------+------+------------+-------------------+
+ * | index | scale | full | codes_size |   vector codes    |
+ * +-------+-------+------+------------+-------------------+
+ */
+bool Slot::Set(const QuantizedRecord& record) {
+  if (type != Rid::quantized) return false;
+  assert(sizeof(int) + sizeof(float) + sizeof(Rid) + sizeof(size_t) +
+             record.codes.size() <=
+         byte_size);
+  *reinterpret_cast<int*>(slot) = record.index;
+  *reinterpret_cast<float*>(slot + sizeof(int)) = record.scale;
+  Byte* full_addr = slot + sizeof(int) + sizeof(float);
+  *reinterpret_cast<Rid*>(full_addr) = record.full;
+  *reinterpret_cast<size_t*>(full_addr + sizeof(Rid)) = record.codes.size();
+  std::copy(record.codes.begin(), record.codes.end(),
+            reinterpret_cast<std::int8_t*>(full_addr + sizeof(Rid) + sizeof(size_t)));
   return true;
 }
 
-size_t Slot::GetSize(Rid::DataType type, int dimension) {
+/**
+ * same layout as Set(const QuantizedRecord&), nothing is copied
+ */
+bool Slot::View(QuantizedRecordView& view) const {
+  if (type != Rid::quantized) return false;
+  view.index = *reinterpret_cast<const int*>(slot);
+  view.scale = *reinterpret_cast<const float*>(slot + sizeof(int));
+  const Byte* full_addr = slot + sizeof(int) + sizeof(float);
+  view.full = *reinterpret_cast<const Rid*>(full_addr);
+  view.size = *reinterpret_cast<const size_t*>(full_addr + sizeof(Rid));
+  view.codes = reinterpret_cast<const std::int8_t*>(
+      full_addr + sizeof(Rid) + sizeof(size_t));
+  return true;
+}
+
+/**
+ * The bounds of a branch or leaf
+ * +----------+----------+------------+------------+---------------------+
+ * |  double  |  double  |   double   |   double   | float [center_size] |
+ * +----------+----------+------------+------------+---------------------+
+ * | min_norm | max_norm | cos_spread | sin_spread |     cone axis       |
+ * +----------+----------+------------+------------+---------------------+
+ * the norms with node_norms or cone_bounds, the cone only with cone_bounds
+ */
+void Slot::GetBounds(
+    const Byte* bounds_begin, size_t center_size, BallTreeNode& node) const {
+  auto bounds = reinterpret_cast<const double*>(bounds_begin);
+  if (HasNodeNorms(center_size)) {
+    node.min_norm = bounds[0];
+    node.max_norm = bounds[1];
+  }
+  if (HasCone(center_size)) {
+    node.cone.cos_spread = bounds[2];
+    node.cone.sin_spread = bounds[3];
+    auto axis_begin = reinterpret_cast<const float*>(bounds + 4);
+    node.cone.axis.assign(axis_begin, axis_begin + center_size);
+  }
+}
+
+void Slot::SetBounds(Byte* bounds_begin, const BallTreeNode& node) {
+  auto bounds = reinterpret_cast<double*>(bounds_begin);
+  if (HasNodeNorms(node.center.size())) {
+    bounds[0] = node.min_norm;
+    bounds[1] = node.max_norm;
+  }
+  if (HasCone(node.center.size())) {
+    assert(not node.cone.Empty());
+    bounds[2] = node.cone.cos_spread;
+    bounds[3] = node.cone.sin_spread;
+    std::copy(node.cone.axis.begin(), node.cone.axis.end(),
+              reinterpret_cast<float*>(bounds + 4));
+  }
+}
+
+size_t Slot::GetSize(Rid::DataType type, int dimension, bool norms,
+                     bool node_norms, bool cones, bool vectors) {
     size_t node_size = sizeof(double) + sizeof(float) * dimension + sizeof(size_t);
+    // every part implies the ones before it, so that the sizes of the
+    // layouts tell them apart
+    node_norms = node_norms or cones;
+    norms = norms or node_norms;
+    size_t bounds_size = (node_norms ? sizeof(double) * 2 : 0) +
+        (cones ? sizeof(double) * 2 + sizeof(float) * dimension : 0);
     size_t ret = 0;
     switch (type) {
     case Rid::branch:
-        ret = node_size + sizeof(Rid) * 2 + sizeof(size_t);
+        ret = node_size + sizeof(Rid) * 2 + sizeof(size_t) + bounds_size;
         break;
     case Rid::leaf:
-        ret = node_size + sizeof(Rid) * N0 + sizeof(size_t);
+        ret = node_size + sizeof(Rid) * N0 + sizeof(size_t) +
+              (norms ? sizeof(float) * N0 : 0) + bounds_size +
+              (vectors ? (sizeof(int) + sizeof(float) * dimension) * N0 : 0);
         break;
     case Rid::record:
         ret = sizeof(float) * dimension + sizeof(size_t) + sizeof(int);
         break;
+    case Rid::quantized:
+        ret = sizeof(std::int8_t) * dimension + sizeof(size_t) + sizeof(Rid) +
+              sizeof(float) + sizeof(int);
+        break;
     default:
         ret = 0;
     }
@@ -1,26 +1,124 @@
 #include "storage.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 const char* root_file = "root";
 const char* dimension_file = "dimension.bin";
-NodeStorage::NodeStorage(const Path& dest_dir, int dimension = -1)
+// NodeStorage and NormalStorage both page in 64k
+constexpr std::size_t mapped_page_size = 64 * 1024;
+NodeStorage::NodeStorage(const Path& dest_dir, int dimension,
+                         const IndexFormat& format,
+                         const BufferPoolConfig& pool)
                         : m_dimension(dimension),
+                        m_format(format),
+                        root(0, 0),
                         branch_storage(nullptr),
                         leaf_storage(nullptr),
-                        dest_dir(dest_dir),
-                        root(0, 0) {
+                        dest_dir(dest_dir) {
     if (m_dimension == -1) {
-        std::ifstream others(dest_dir + root_file, std::ios_base::in | std::ios_base::binary);
-        others.seekg(std::ios_base::beg);
-        others.read(reinterpret_cast<char*>(&root), sizeof(Rid));
-        others.read(reinterpret_cast<char*>(&m_dimension), sizeof(m_dimension));
+        ReadRootFile();
+    } else {
+        // the root is filled in by PutRoot
+        WriteRootFile(dest_dir, root, m_dimension, m_format, m_next_index);
+    }
+    size_t branch_size = Slot::GetSize(
+        Rid::branch, m_dimension, false, m_format.node_norms,
+        m_format.cone_bounds);
+    size_t leaf_size = Slot::GetSize(
+        Rid::leaf, m_dimension, m_format.norm_sorted_leaves,
+        m_format.node_norms, m_format.cone_bounds, m_format.clustered_leaves);
+    branch_storage = std::make_unique<BranchStorage>(
+        branch_size, "branch", dest_dir, pool.node_frames, pool.policy);
+    leaf_storage = std::make_unique<LeafStorage>(
+        leaf_size, "leaf", dest_dir, pool.node_frames, pool.policy);
+}
+NodeStorage::NodeStorage(std::shared_ptr<IndexFile> file, int dimension,
+                         const IndexFormat& format,
+                         const BufferPoolConfig& pool)
+                        : m_dimension(dimension),
+                        m_format(format),
+                        root(0, 0),
+                        m_file(std::move(file)) {
+    if (m_dimension == -1) {
+        ReadRootFile();
     } else {
-        std::ofstream others(dest_dir + root_file, std::ios_base::out | std::ios_base::binary);
-        others.seekp(sizeof(Rid));
-        others.write(reinterpret_cast<char*>(&m_dimension), sizeof(m_dimension));
+        m_file->SetDimension(m_dimension);
+        m_file->SetFormat(m_format);
+    }
+    size_t branch_size = Slot::GetSize(
+        Rid::branch, m_dimension, false, m_format.node_norms,
+        m_format.cone_bounds);
+    size_t leaf_size = Slot::GetSize(
+        Rid::leaf, m_dimension, m_format.norm_sorted_leaves,
+        m_format.node_norms, m_format.cone_bounds, m_format.clustered_leaves);
+    branch_storage = std::make_unique<BranchStorage>(
+        branch_size, m_file.get(), pool.node_frames, pool.policy);
+    leaf_storage = std::make_unique<LeafStorage>(
+        leaf_size, m_file.get(), pool.node_frames, pool.policy);
+}
+NodeStorage::NodeStorage(const Path& dest_dir)
+                        : m_dimension(-1),
+                        root(0, 0),
+                        dest_dir(dest_dir) {
+    if (IndexFile::Exists(dest_dir)) {
+        // only the header is needed, the file is not kept open
+        IndexFile file(dest_dir, mapped_page_size, false);
+        root = file.GetRoot();
+        m_dimension = file.GetDimension();
+        m_format = file.GetFormat();
+        m_next_index = file.GetNextIndex();
+        return;
+    }
+    ReadRootFile();
+}
+void NodeStorage::WriteRootFile(const Path& dest_dir, const Rid& root,
+                                int dimension, const IndexFormat& format,
+                                int next_index) {
+    std::ofstream others(dest_dir + root_file, std::ios_base::out | std::ios_base::binary);
+    others.write(reinterpret_cast<const char*>(&root), sizeof(Rid));
+    others.write(reinterpret_cast<const char*>(&dimension), sizeof(dimension));
+    std::uint8_t clustered = format.clustered_leaves;
+    others.write(reinterpret_cast<const char*>(&clustered), sizeof(clustered));
+    std::uint8_t sorted = format.norm_sorted_leaves;
+    others.write(reinterpret_cast<const char*>(&sorted), sizeof(sorted));
+    std::uint8_t cones = format.cone_bounds;
+    others.write(reinterpret_cast<const char*>(&cones), sizeof(cones));
+    std::uint8_t node_norms = format.node_norms;
+    others.write(reinterpret_cast<const char*>(&node_norms), sizeof(node_norms));
+    std::int32_t next = next_index;
+    others.write(reinterpret_cast<const char*>(&next), sizeof(next));
+}
+void NodeStorage::ReadRootFile() {
+    if (m_file) {
+        root = m_file->GetRoot();
+        m_dimension = m_file->GetDimension();
+        m_format = m_file->GetFormat();
+        m_next_index = m_file->GetNextIndex();
+        return;
     }
-    size_t branch_size = Slot::GetSize(Rid::branch, dimension);
-    size_t leaf_size = Slot::GetSize(Rid::leaf, dimension);
-    branch_storage = std::make_unique<BranchStorage>(branch_size, "branch", dest_dir);
-    leaf_storage = std::make_unique<LeafStorage>(leaf_size, "leaf", dest_dir);
+    // root file: Rid root | int dimension | uint8 clustered_leaves |
+    // uint8 norm_sorted_leaves | uint8 cone_bounds | uint8 node_norms |
+    // int32 next_index
+    std::ifstream others(dest_dir + root_file, std::ios_base::in | std::ios_base::binary);
+    others.seekg(std::ios_base::beg);
+    others.read(reinterpret_cast<char*>(&root), sizeof(Rid));
+    others.read(reinterpret_cast<char*>(&m_dimension), sizeof(m_dimension));
+    // indexes written before a flag existed end before it
+    std::uint8_t clustered = 0;
+    others.read(reinterpret_cast<char*>(&clustered), sizeof(clustered));
+    m_format.clustered_leaves = others and clustered;
+    std::uint8_t sorted = 0;
+    others.read(reinterpret_cast<char*>(&sorted), sizeof(sorted));
+    m_format.norm_sorted_leaves = others and sorted;
+    std::uint8_t cones = 0;
+    others.read(reinterpret_cast<char*>(&cones), sizeof(cones));
+    m_format.cone_bounds = others and cones;
+    std::uint8_t node_norms = 0;
+    others.read(reinterpret_cast<char*>(&node_norms), sizeof(node_norms));
+    m_format.node_norms = others and node_norms;
+    std::int32_t next = 0;
+    others.read(reinterpret_cast<char*>(&next), sizeof(next));
+    m_next_index = others ? next : 0;
 }
 std::unique_ptr<BallTreeNode> NodeStorage::Get(Rid rid) {
     switch (rid.type) {
@@ -34,6 +132,24 @@ std::unique_ptr<BallTreeNode> NodeStorage::Get(Rid rid) {
     assert(false);
     return nullptr;
 }
+PoolStats NodeStorage::Stats(Rid::DataType type) const {
+    assert(type == Rid::branch or type == Rid::leaf);
+    return type == Rid::branch ? branch_storage->Stats() : leaf_storage->Stats();
+}
+Pinned<NodeView> NodeStorage::View(Rid rid) {
+    if (rid.type == Rid::branch) {
+        return branch_storage->View<NodeView>(rid);
+    }
+    assert(rid.type == Rid::leaf);
+    return leaf_storage->View<NodeView>(rid);
+}
+void NodeStorage::Prefetch(Rid rid) {
+    if (rid.type == Rid::branch) {
+        branch_storage->Prefetch(rid.page_id);
+    } else if (rid.type == Rid::leaf) {
+        leaf_storage->Prefetch(rid.page_id);
+    }
+}
 Rid NodeStorage::Put(const BallTreeNode& node) {
     auto c_node = dynamic_cast<const BallTreeBranch*>(&node);
     if (c_node != nullptr) {
@@ -43,33 +159,291 @@ Rid NodeStorage::Put(const BallTreeNode& node) {
     }
 }
 
+bool NodeStorage::Update(Rid rid, const BallTreeNode& node) {
+    if (rid.type == Rid::branch) {
+        auto branch = dynamic_cast<const BallTreeBranch*>(&node);
+        assert(branch);
+        branch_storage->Set<BallTreeBranch>(rid, *branch);
+        return true;
+    }
+    assert(rid.type == Rid::leaf);
+    auto leaf = dynamic_cast<const BallTreeLeaf*>(&node);
+    assert(leaf);
+    leaf_storage->Set<BallTreeLeaf>(rid, *leaf);
+    return true;
+}
+bool NodeStorage::Remove(Rid rid) {
+    if (rid.type == Rid::branch) {
+        return branch_storage->Remove(rid);
+    }
+    assert(rid.type == Rid::leaf);
+    return leaf_storage->Remove(rid);
+}
+void NodeStorage::Flush() {
+    branch_storage->Flush();
+    leaf_storage->Flush();
+    if (m_file and not m_file->Flush()) {
+        assert(false && "the index file could not be written");
+    }
+}
+
 std::unique_ptr<BallTreeNode> NodeStorage::GetRoot() {
-    return branch_storage->Get<BallTreeBranch>(root);
+    // a tree of at most N0 records is a single leaf
+    return Get(root);
 }
 Rid NodeStorage::PutRoot(const BallTreeNode& node) {
-    root = branch_storage->Put<BallTreeBranch>(*dynamic_cast<const BallTreeBranch*>(&node));
-    std::ofstream others(dest_dir + root_file, std::ios_base::out | std::ios_base::binary);
-    others.seekp(std::ios_base::beg);
-    others.write(reinterpret_cast<char*>(&root), sizeof(Rid));
-    others.flush();
+    root = Put(node);
+    if (m_file) {
+        m_file->SetRoot(root);
+        return root;
+    }
+    WriteRootFile(dest_dir, root, m_dimension, m_format, m_next_index);
     return root;
 }
+void NodeStorage::SetNextIndex(int index) {
+    m_next_index = index;
+    if (m_file) {
+        m_file->SetNextIndex(index);
+        return;
+    }
+    WriteRootFile(dest_dir, root, m_dimension, m_format, m_next_index);
+}
 
-NormalStorage::NormalStorage(const Path& dest_dir, int dimension = -1) {
+NormalStorage::NormalStorage(const Path& dest_dir, int dimension,
+                             const BufferPoolConfig& pool,
+                             const IndexFormat& format) {
+    bool quantized_records = format.quantized_records;
     if (dimension == -1) {
+        // dimension.bin: int dimension | uint8 quantized_records
         std::ifstream others(dest_dir + dimension_file, std::ios_base::in | std::ios_base::binary);
         others.seekg(std::ios_base::beg);
         others.read(reinterpret_cast<char*>(&dimension), sizeof(dimension));
+        // indexes written before the flag existed end here
+        std::uint8_t quantized_flag = 0;
+        others.read(reinterpret_cast<char*>(&quantized_flag), sizeof(quantized_flag));
+        quantized_records = others and quantized_flag;
     } else {
-        std::ofstream others(dest_dir + dimension_file, std::ios_base::out | std::ios_base::binary);
-        others.seekp(std::ios_base::beg);
-        others.write(reinterpret_cast<char*>(&dimension), sizeof(dimension));
+        WriteDimensionFile(dest_dir, dimension, format);
+    }
+    storage.reset(new RStorage(Slot::GetSize(Rid::record, dimension), "record", dest_dir,
+                               pool.record_frames, pool.policy));
+    if (quantized_records) {
+        quantized.reset(new QStorage(Slot::GetSize(Rid::quantized, dimension), "qrecord",
+                                     dest_dir, pool.record_frames, pool.policy));
     }
-    storage.reset(new RStorage(Slot::GetSize(Rid::record, dimension), "record", dest_dir));
+}
+NormalStorage::NormalStorage(std::shared_ptr<IndexFile> file, int dimension,
+                             const BufferPoolConfig& pool,
+                             const IndexFormat& format)
+    : file(std::move(file)) {
+    // the dimension and the format are written to the header by NodeStorage
+    bool quantized_records = format.quantized_records;
+    if (dimension == -1) {
+        dimension = this->file->GetDimension();
+        quantized_records = this->file->GetFormat().quantized_records;
+    }
+    storage.reset(new RStorage(Slot::GetSize(Rid::record, dimension), this->file.get(),
+                               pool.record_frames, pool.policy));
+    if (quantized_records) {
+        quantized.reset(new QStorage(Slot::GetSize(Rid::quantized, dimension),
+                                     this->file.get(), pool.record_frames, pool.policy));
+    }
+}
+void NormalStorage::WriteDimensionFile(const Path& dest_dir, int dimension,
+                                       const IndexFormat& format) {
+    std::ofstream others(dest_dir + dimension_file, std::ios_base::out | std::ios_base::binary);
+    others.write(reinterpret_cast<const char*>(&dimension), sizeof(dimension));
+    std::uint8_t quantized_flag = format.quantized_records;
+    others.write(reinterpret_cast<const char*>(&quantized_flag), sizeof(quantized_flag));
+}
+Rid NormalStorage::FullRid(const Rid& rid) {
+    if (rid.type != Rid::quantized) {
+        return rid;
+    }
+    return ViewQuantized(rid)->full;
 }
 Rid NormalStorage::Put(const Record& record) {
-    return std::move(storage->Put<Record>(record));
+    auto full = storage->Put<Record>(record);
+    if (not quantized) {
+        return full;
+    }
+    return quantized->Put<QuantizedRecord>(QuantizedRecord::Quantize(record, full));
 }
 std::unique_ptr<Record> NormalStorage::Get(const Rid& rid) {
-    return std::move(storage->Get<Record>(rid));
-}
\ No newline at end of file
+    return std::move(storage->Get<Record>(FullRid(rid)));
+}
+Pinned<RecordView> NormalStorage::View(const Rid& rid) {
+    return storage->View<RecordView>(FullRid(rid));
+}
+Pinned<QuantizedRecordView> NormalStorage::ViewQuantized(const Rid& rid) {
+    assert(quantized and rid.type == Rid::quantized);
+    return quantized->View<QuantizedRecordView>(rid);
+}
+NormalStorage::Records NormalStorage::GetAll(const std::vector<Rid>& rids) {
+    if (not quantized) {
+        return storage->GetRun<Record>(rids);
+    }
+    std::vector<Rid> full;
+    full.reserve(rids.size());
+    for (auto& rid : rids) {
+        full.push_back(FullRid(rid));
+    }
+    return storage->GetRun<Record>(full);
+}
+bool NormalStorage::Remove(const Rid& rid) {
+    if (rid.type != Rid::quantized) {
+        return storage->Remove(rid);
+    }
+    auto full = FullRid(rid);
+    return quantized->Remove(rid) and storage->Remove(full);
+}
+void NormalStorage::Flush() {
+    storage->Flush();
+    if (quantized) {
+        quantized->Flush();
+    }
+    if (file and not file->Flush()) {
+        assert(false && "the index file could not be written");
+    }
+}
+PoolStats NormalStorage::Stats() const {
+    auto ret = storage->Stats();
+    if (quantized) {
+        ret += quantized->Stats();
+    }
+    return ret;
+}
+
+MappedPages::MappedPages(const Path& dest_dir, const std::string& name,
+                         Rid::DataType type, std::size_t page_size, int advice)
+                        : page_size(page_size) {
+    if (IndexFile::Exists(dest_dir)) {
+        // one mapping of the whole file, the directory locates the pages
+        IndexFile file(dest_dir, page_size, false);
+        int fd = ::open((dest_dir + IndexFile::kFileName).data(), O_RDONLY);
+        if (not file.IsOpen() or fd == -1) return;
+        auto length = ::lseek(fd, 0, SEEK_END);
+        void* addr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) return;
+        mappings.emplace_back(addr, length);
+        auto base = static_cast<Byte*>(addr);
+        for (int page_id = 0; page_id < file.PageCount(type); ++page_id) {
+            auto page = base + file.PageOffset(type, page_id);
+            ::madvise(page, page_size, advice);
+            pages.push_back(page);
+        }
+    } else {
+        // name.index starts with the number of pages, page i lives in name.i
+        int page_num = 0;
+        std::ifstream index(dest_dir + name + ".index", std::ios_base::in | std::ios_base::binary);
+        index.read(reinterpret_cast<char*>(&page_num), sizeof(page_num));
+        pages.assign(page_num, nullptr);
+        for (int page_id = 0; page_id < page_num; ++page_id) {
+            auto filename = dest_dir + name + "." + std::to_string(page_id);
+            int fd = ::open(filename.data(), O_RDONLY);
+            if (fd == -1) continue;
+            void* addr = ::mmap(nullptr, page_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            // the mapping keeps the file alive
+            ::close(fd);
+            if (addr == MAP_FAILED) continue;
+            ::madvise(addr, page_size, advice);
+            mappings.emplace_back(addr, page_size);
+            pages[page_id] = static_cast<Byte*>(addr);
+        }
+    }
+    // same trailer as Page: ... | DataType type | size_t slot_size
+    for (auto page : pages) {
+        if (not page) continue;
+        Byte* slot_size_addr = page + page_size - sizeof(std::size_t);
+        slot_size = *reinterpret_cast<std::size_t*>(slot_size_addr);
+        this->type = *reinterpret_cast<Rid::DataType*>(slot_size_addr - sizeof(Rid::DataType));
+        break;
+    }
+}
+void MappedPages::Prefetch(const Rid& rid) const {
+    if (rid.page_id >= static_cast<int>(pages.size()) or not pages[rid.page_id]) {
+        return;
+    }
+    ::madvise(pages[rid.page_id], page_size, MADV_WILLNEED);
+}
+MappedPages::~MappedPages() {
+    for (auto& mapping : mappings) {
+        ::munmap(mapping.first, mapping.second);
+    }
+}
+
+MappedNodeStorage::MappedNodeStorage(const Path& dest_dir)
+                        : NodeStorage(dest_dir),
+                        // every search starts from the upper tree
+                        branch_pages(dest_dir, "branch", Rid::branch, mapped_page_size, MADV_WILLNEED),
+                        leaf_pages(dest_dir, "leaf", Rid::leaf, mapped_page_size, MADV_RANDOM) {}
+std::unique_ptr<BallTreeNode> MappedNodeStorage::Get(Rid rid) {
+    auto slot = PagesOf(rid).Select(rid);
+    if (rid.type == Rid::branch) {
+        std::unique_ptr<BallTreeBranch> branch;
+        slot.Get(branch);
+        return branch;
+    }
+    std::unique_ptr<BallTreeLeaf> leaf;
+    slot.Get(leaf);
+    return leaf;
+}
+Rid MappedNodeStorage::Put(const BallTreeNode&) {
+    assert(false && "mapped storage is read only");
+    return Rid(0, 0);
+}
+Pinned<NodeView> MappedNodeStorage::View(Rid rid) {
+    NodeView view;
+    PagesOf(rid).Select(rid).View(view);
+    return Pinned<NodeView>(view, nullptr);
+}
+void MappedNodeStorage::Prefetch(Rid rid) {
+    PagesOf(rid).Prefetch(rid);
+}
+std::unique_ptr<BallTreeNode> MappedNodeStorage::GetRoot() {
+    return Get(root);
+}
+Rid MappedNodeStorage::PutRoot(const BallTreeNode&) {
+    assert(false && "mapped storage is read only");
+    return root;
+}
+bool MappedNodeStorage::Update(Rid, const BallTreeNode&) {
+    assert(false && "mapped storage is read only");
+    return false;
+}
+bool MappedNodeStorage::Remove(Rid) {
+    assert(false && "mapped storage is read only");
+    return false;
+}
+
+MappedRecordStorage::MappedRecordStorage(const Path& dest_dir)
+    : pages(dest_dir, "record", Rid::record, mapped_page_size, MADV_RANDOM),
+      quantized_pages(dest_dir, "qrecord", Rid::quantized, mapped_page_size, MADV_RANDOM) {}
+Rid MappedRecordStorage::FullRid(const Rid& rid) const {
+    if (rid.type != Rid::quantized) {
+        return rid;
+    }
+    QuantizedRecordView view;
+    quantized_pages.Select(rid).View(view);
+    return view.full;
+}
+Rid MappedRecordStorage::Put(const Record&) {
+    assert(false && "mapped storage is read only");
+    return Rid(0, 0);
+}
+std::unique_ptr<Record> MappedRecordStorage::Get(const Rid& rid) {
+    std::unique_ptr<Record> record;
+    pages.Select(FullRid(rid)).Get(record);
+    return record;
+}
+Pinned<RecordView> MappedRecordStorage::View(const Rid& rid) {
+    RecordView view;
+    pages.Select(FullRid(rid)).View(view);
+    return Pinned<RecordView>(view, nullptr);
+}
+Pinned<QuantizedRecordView> MappedRecordStorage::ViewQuantized(const Rid& rid) {
+    QuantizedRecordView view;
+    quantized_pages.Select(rid).View(view);
+    return Pinned<QuantizedRecordView>(view, nullptr);
+}
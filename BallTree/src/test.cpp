@@ -1,6 +1,7 @@
 #include "BallTree.h"
 #include "Utility.h"
 #include <chrono>
+#include <functional>
 #include <iostream>
 #define NETFLIX
 
@@ -24,6 +25,7 @@ int qn = 1000;
 #endif
 
 constexpr int kQN = 1000;
+constexpr int kTopK = 10;
 
 template <const char *Name, int N, int D>
 struct DataSet {
@@ -68,6 +70,42 @@ void TimeAndPrint(const F &f, const std::string &prologue = "") {
     std::printf("DONE.\n It took %lf seconds\n\n", time.count() / 1000.);
 }
 
+void PrintPoolStats(const char *name, const PoolStats &pool) {
+    if (pool.hits + pool.misses == 0) return;
+    std::printf(
+        " %-7s hits %zu, misses %zu, evictions %zu, write-backs %zu, "
+        "read %zu KB, written %zu KB, prefetches %zu\n",
+        name, pool.hits, pool.misses, pool.evictions, pool.write_backs,
+        pool.bytes_read / 1024, pool.bytes_written / 1024, pool.prefetches);
+}
+
+/**
+ * TimeAndPrint, followed by the work the searches in f did on tree
+ */
+template <typename F>
+void TimeSearchAndPrint(
+    BallTree &tree, const F &f, const std::string &prologue = "") {
+    auto before = tree.stats();
+    std::cout << prologue;
+    auto time = Time(f);
+    auto stats = tree.stats();
+    stats -= before;
+    std::printf("DONE.\n It took %lf seconds\n", time.count() / 1000.);
+    auto queries = std::max<std::size_t>(stats.query.queries, 1);
+    std::printf(
+        " per query: %.1f branches, %.1f leaves, %.1f records scored, "
+        "%.1f re-ranked, %.1f subtrees pruned\n",
+        static_cast<double>(stats.query.branches_visited) / queries,
+        static_cast<double>(stats.query.leaves_scanned) / queries,
+        static_cast<double>(stats.query.records_scored) / queries,
+        static_cast<double>(stats.query.records_reranked) / queries,
+        static_cast<double>(stats.query.subtrees_pruned) / queries);
+    PrintPoolStats("record", stats.record);
+    PrintPoolStats("branch", stats.branch);
+    PrintPoolStats("leaf", stats.leaf);
+    std::printf("\n");
+}
+
 template <
     template <const char *, int, int> class DataSet, const char *Name,
     int Scale, int Dimension>
@@ -101,11 +139,20 @@ void TestRestoreTree(DataSet<Name, Scale, Dimension>, BallTree &tree) {
         "Restoring BallTree from " + index_path + " ... ");
 }
 
+/**
+ * the inner product of record and query as the searchers score it, with the
+ * float kernels
+ */
+double Score(const Record &record, const Record &query) {
+    return kernels::Dot(
+        record.data.data(), query.data.data(), query.data.size());
+}
+
 void CheckResult(const Records &data, const Record &query, int answer) {
     assert(data[answer - 1]->index == answer);
-    double res_innerproduct = InnerProduct(data[answer - 1]->data, query.data);
+    double res_innerproduct = Score(*data[answer - 1], query);
     for (auto &datap : data) {
-        double test_innerproduct = InnerProduct(datap->data, query.data);
+        double test_innerproduct = Score(*datap, query);
         if (test_innerproduct > res_innerproduct and datap->index != answer) {
             std::printf(
                 "WARNING! Query %d: Record %d has greater inner product(%lf), "
@@ -124,6 +171,183 @@ void CheckResults(
     }
 }
 
+void CheckTopKResult(
+    const Records &data, const Record &query, const std::vector<int> &answer) {
+    std::vector<double> innerproducts;
+    innerproducts.reserve(data.size());
+    for (auto &datap : data) {
+        innerproducts.push_back(Score(*datap, query));
+    }
+    std::partial_sort(
+        begin(innerproducts), begin(innerproducts) + answer.size(),
+        end(innerproducts), std::greater<double>());
+    for (std::size_t i = 0; i < answer.size(); ++i) {
+        double res_innerproduct = Score(*data[answer[i] - 1], query);
+        if (res_innerproduct < innerproducts[i]) {
+            std::printf(
+                "WARNING! Query %d: top-%zu answer(record: %d)(%lf) is worse "
+                "than expected(%lf)\n",
+                query.index, i + 1, answer[i], res_innerproduct,
+                innerproducts[i]);
+            return;
+        }
+    }
+}
+
+template <
+    template <const char *, int, int> class DataSet, const char *Name,
+    int Scale, int Dimension>
+std::vector<std::vector<int>> TestTopKSearchTree(
+    DataSet<Name, Scale, Dimension>, BallTree &tree, float **data,
+    float **queries) {
+    std::vector<std::vector<int>> result(kQN, std::vector<int>(kTopK));
+    TimeSearchAndPrint(
+        tree,
+        [&] {
+            for (int i = 0; i < kQN; ++i) {
+                int found = tree.mipSearchTopK(
+                    Dimension, queries[i], kTopK, result[i].data(), nullptr);
+                result[i].resize(std::max(found, 0));
+            }
+        },
+        "Searching top-" + std::to_string(kTopK) + " of " +
+            std::to_string(kQN) + " " + std::to_string(Dimension) +
+            "-dimension vector in " + std::to_string(Scale) + "records ... ");
+    Records data_records(BallTree::ArrayToVector(Scale, Dimension, data)),
+        query_records(BallTree::ArrayToVector(kQN, Dimension, queries));
+    std::printf("Checking Results...\n");
+    for (int i = 0; i < kQN; ++i) {
+        CheckTopKResult(data_records, *query_records[i], result[i]);
+    }
+    std::printf("Done.\n");
+    return result;
+}
+
+/**
+ * searches top-k under a few budgets and measures them against the exact
+ * top-k, results said to be exact are checked like the exact ones
+ */
+template <
+    template <const char *, int, int> class DataSet, const char *Name,
+    int Scale, int Dimension>
+void TestBudgetedTree(
+    DataSet<Name, Scale, Dimension>, BallTree &tree, float **data,
+    float **queries, const std::vector<std::vector<int>> &exact) {
+    Records data_records(BallTree::ArrayToVector(Scale, Dimension, data)),
+        query_records(BallTree::ArrayToVector(kQN, Dimension, queries));
+    auto test = [&](const std::string &description,
+                    const std::function<SearchBudget()> &budget) {
+        std::vector<std::vector<int>> result(kQN, std::vector<int>(kTopK));
+        std::vector<double> latencies(kQN);
+        std::vector<bool> exact_flags(kQN);
+        TimeSearchAndPrint(
+            tree,
+            [&] {
+                for (int i = 0; i < kQN; ++i) {
+                    bool is_exact = false;
+                    auto time = Time<std::chrono::microseconds>([&] {
+                        int found = tree.mipSearchTopK(
+                            Dimension, queries[i], kTopK, result[i].data(),
+                            nullptr, budget(), &is_exact);
+                        result[i].resize(std::max(found, 0));
+                    });
+                    latencies[i] = time.count() / 1000.;
+                    exact_flags[i] = is_exact;
+                }
+            },
+            "Searching top-" + std::to_string(kTopK) + " of " +
+                std::to_string(kQN) + " " + std::to_string(Dimension) +
+                "-dimension vector " + description + " ... ");
+        std::size_t exact_count = 0, hits_at_1 = 0;
+        for (int i = 0; i < kQN; ++i) {
+            if (exact_flags[i]) {
+                ++exact_count;
+                CheckTopKResult(data_records, *query_records[i], result[i]);
+            }
+            if (not result[i].empty() and not exact[i].empty() and
+                result[i].front() == exact[i].front()) {
+                ++hits_at_1;
+            }
+        }
+        std::sort(latencies.begin(), latencies.end());
+        std::printf(
+            "exact %.3f, recall@1 %.3f, p99 %.3lf ms, max %.3lf ms\n\n",
+            static_cast<double>(exact_count) / kQN,
+            static_cast<double>(hits_at_1) / kQN,
+            latencies[kQN * 99 / 100], latencies.back());
+    };
+    test("with no budget", [] { return SearchBudget(); });
+    test("within 16 leaves", [] {
+        SearchBudget budget;
+        budget.max_leaves = 16;
+        return budget;
+    });
+    test("with 10% slack", [] {
+        SearchBudget budget;
+        budget.slack = 0.1;
+        return budget;
+    });
+    test("within 0.2 ms", [] {
+        return SearchBudget::Within(std::chrono::microseconds(200));
+    });
+}
+
+/**
+ * quantizes the flat tree and measures the approximate top-k against the
+ * exact one
+ */
+template <
+    template <const char *, int, int> class DataSet, const char *Name,
+    int Scale, int Dimension>
+void TestApproximateTree(
+    DataSet<Name, Scale, Dimension>, BallTree &tree, float **queries,
+    const std::vector<std::vector<int>> &exact) {
+    std::vector<int> result(kTopK);
+    TimeSearchAndPrint(
+        tree,
+        [&] {
+            for (int i = 0; i < kQN; ++i) {
+                tree.mipSearchTopK(
+                    Dimension, queries[i], kTopK, result.data(), nullptr);
+            }
+        },
+        "Searching top-" + std::to_string(kTopK) + " of " +
+            std::to_string(kQN) + " " + std::to_string(Dimension) +
+            "-dimension vector in flat BallTree ... ");
+    TimeAndPrint(
+        [&] { tree.buildQuantizer(); },
+        "Training product quantizer on " + std::to_string(Scale) +
+            " records ... ");
+    std::vector<std::vector<int>> approximate(kQN, std::vector<int>(kTopK));
+    TimeSearchAndPrint(
+        tree,
+        [&] {
+            for (int i = 0; i < kQN; ++i) {
+                int found = tree.mipSearchApproximateTopK(
+                    Dimension, queries[i], kTopK, approximate[i].data(),
+                    nullptr);
+                approximate[i].resize(std::max(found, 0));
+            }
+        },
+        "Searching top-" + std::to_string(kTopK) + " of " +
+            std::to_string(kQN) + " " + std::to_string(Dimension) +
+            "-dimension vector approximately ... ");
+    std::size_t hits_at_1 = 0, hits_at_k = 0;
+    for (int i = 0; i < kQN; ++i) {
+        if (not approximate[i].empty() and not exact[i].empty() and
+            approximate[i].front() == exact[i].front()) {
+            ++hits_at_1;
+        }
+        for (auto index : approximate[i]) {
+            hits_at_k += std::count(exact[i].begin(), exact[i].end(), index);
+        }
+    }
+    std::printf(
+        "recall@1 %.3f, recall@%d %.3f\n\n",
+        static_cast<double>(hits_at_1) / kQN, kTopK,
+        static_cast<double>(hits_at_k) / (kQN * kTopK));
+}
+
 template <
     template <const char *, int, int> class DataSet, const char *Name,
     int Scale, int Dimension>
@@ -134,7 +358,8 @@ void TestSearchTree(
     read_data(Scale, Dimension, queries, query_path.data());
     std::vector<int> result;
     result.reserve(kQN);
-    TimeAndPrint(
+    TimeSearchAndPrint(
+        tree,
         [&] {
             for (int i = 0; i < kQN; ++i) {
                 result.push_back(tree.mipSearch(Dimension, queries[i]));
@@ -147,6 +372,234 @@ void TestSearchTree(
     std::printf("Checking Results...\n");
     CheckResults(result, data_records, query_records);
     std::printf("Done.\n");
+    auto top_k =
+        TestTopKSearchTree(DataSet<Name, Scale, Dimension>(), tree, data, queries);
+    std::printf("Best first:\n");
+    tree.setSearchOrder(SearchOrder::best_first);
+    TestTopKSearchTree(DataSet<Name, Scale, Dimension>(), tree, data, queries);
+    tree.setSearchOrder(SearchOrder::depth_first);
+    TestBudgetedTree(
+        DataSet<Name, Scale, Dimension>(), tree, data, queries, top_k);
+
+    std::vector<int> batch_result(kQN);
+    TimeSearchAndPrint(
+        tree,
+        [&] { tree.mipSearchBatch(kQN, Dimension, queries, batch_result.data()); },
+        "Batch searching " + std::to_string(kQN) + " " +
+            std::to_string(Dimension) + "-dimension vector in " +
+            std::to_string(Scale) + "records ... ");
+    std::printf("Checking Results...\n");
+    CheckResults(batch_result, data_records, query_records);
+    std::printf("Done.\n");
+
+    TimeAndPrint([&] { tree.flattenTree(); }, "Flattening BallTree ... ");
+    std::vector<int> flat_result;
+    flat_result.reserve(kQN);
+    TimeSearchAndPrint(
+        tree,
+        [&] {
+            for (int i = 0; i < kQN; ++i) {
+                flat_result.push_back(tree.mipSearch(Dimension, queries[i]));
+            }
+        },
+        "Searching " + std::to_string(kQN) + " " + std::to_string(Dimension) +
+            "-dimension vector in flat BallTree ... ");
+    std::printf("Checking Results...\n");
+    CheckResults(flat_result, data_records, query_records);
+    std::printf("Done.\n");
+    TestApproximateTree(DataSet<Name, Scale, Dimension>(), tree, queries, top_k);
+}
+
+/**
+ * searches tree one query at a time for the queries of the dataset and
+ * checks the answers against its records
+ * @param description of the tree, printed with the timing
+ */
+template <
+    template <const char *, int, int> class DataSet, const char *Name,
+    int Scale, int Dimension>
+void SearchAndCheck(
+    DataSet<Name, Scale, Dimension>, BallTree &tree, float **data,
+    const std::string &description) {
+    std::string query_path(QueryPath(Name));
+    float **queries(nullptr);
+    read_data(kQN, Dimension, queries, query_path.data());
+    std::vector<int> result;
+    result.reserve(kQN);
+    TimeSearchAndPrint(
+        tree,
+        [&] {
+            for (int i = 0; i < kQN; ++i) {
+                result.push_back(tree.mipSearch(Dimension, queries[i]));
+            }
+        },
+        "Searching " + std::to_string(kQN) + " " + std::to_string(Dimension) +
+            "-dimension vector in " + description + " ... ");
+    Records data_records(BallTree::ArrayToVector(Scale, Dimension, data)),
+        query_records(BallTree::ArrayToVector(kQN, Dimension, queries));
+    std::printf("Checking Results...\n");
+    CheckResults(result, data_records, query_records);
+    std::printf("Done.\n");
+}
+
+/**
+ * the bound a tree has to be built with to be stored in format
+ */
+NodeBound BoundOf(const IndexFormat &format) {
+    return format.cone_bounds ? NodeBound::cone : NodeBound::ball;
+}
+
+template <
+    template <const char *, int, int> class DataSet, const char *Name,
+    int Scale, int Dimension>
+void TestFormatTree(
+    DataSet<Name, Scale, Dimension>, float **data, const IndexFormat &format,
+    const std::string &sub_dir, const std::string &description) {
+    std::string index_path(IndexPath(Name) + sub_dir);
+    {
+        BallTree tree;
+        tree.buildTree(Scale, Dimension, data, 0, BoundOf(format));
+        TimeAndPrint(
+            [&] { tree.storeTree(index_path.data(), format); },
+            "Storing BallTree with " + description + " to " + index_path +
+                " ... ");
+    }
+    BallTree tree;
+    tree.restoreTree(index_path.data());
+    SearchAndCheck(
+        DataSet<Name, Scale, Dimension>(), tree, data,
+        "BallTree with " + description);
+}
+
+template <
+    template <const char *, int, int> class DataSet, const char *Name,
+    int Scale, int Dimension>
+void TestMappedTree(
+    DataSet<Name, Scale, Dimension>, float **data,
+    const std::string &sub_dir = "") {
+    std::string index_path(IndexPath(Name) + sub_dir);
+    BallTree tree;
+    TimeAndPrint(
+        [&] { tree.restoreTree(index_path.data(), StorageBackend::mapped); },
+        "Mapping BallTree from " + index_path + " ... ");
+    SearchAndCheck(
+        DataSet<Name, Scale, Dimension>(), tree, data, "mapped BallTree");
+}
+
+template <
+    template <const char *, int, int> class DataSet, const char *Name,
+    int Scale, int Dimension>
+void TestPrefetchTree(
+    DataSet<Name, Scale, Dimension>, float **data, StorageBackend backend,
+    const std::string &sub_dir, const std::string &description) {
+    std::string index_path(IndexPath(Name) + sub_dir);
+    BufferPoolConfig pool;
+    pool.prefetch = true;
+    BallTree tree;
+    tree.restoreTree(index_path.data(), backend, pool);
+    SearchAndCheck(
+        DataSet<Name, Scale, Dimension>(), tree, data,
+        description + " with prefetching");
+}
+
+/**
+ * inserts the first kInserted queries as records Scale + 1, ..., half into
+ * the built tree and half into the restored one, then deletes them again;
+ * a low merge threshold makes the updates merge in the background while
+ * they are searched
+ */
+template <
+    template <const char *, int, int> class DataSet, const char *Name,
+    int Scale, int Dimension>
+void TestUpdateTree(
+    DataSet<Name, Scale, Dimension>, float **data, const IndexFormat &format,
+    const std::string &sub_dir, const std::string &description) {
+    constexpr int kInserted = 200;
+    constexpr std::size_t kMergeThreshold = 64;
+    std::string index_path(IndexPath(Name) + sub_dir);
+    std::string query_path(QueryPath(Name));
+    float **queries(nullptr);
+    read_data(kQN, Dimension, queries, query_path.data());
+    Records data_records(BallTree::ArrayToVector(Scale, Dimension, data)),
+        query_records(BallTree::ArrayToVector(kQN, Dimension, queries)),
+        updated_records(BallTree::ArrayToVector(Scale, Dimension, data));
+    for (int i = 0; i < kInserted; ++i) {
+        updated_records.push_back(Record::Create(
+            Scale + 1 + i,
+            std::vector<float>(queries[i], queries[i] + Dimension)));
+    }
+    auto insert = [&](BallTree &tree, int first, int last) {
+        for (int i = first; i < last; ++i) {
+            if (not tree.insertData(Dimension, queries[i])) {
+                std::printf("WARNING! Query %d was not inserted\n", i + 1);
+            }
+        }
+    };
+    auto search = [&](BallTree &tree, const Records &expected,
+                      const std::string &what) {
+        std::vector<int> result(kQN);
+        TimeSearchAndPrint(
+            tree,
+            [&] {
+                tree.mipSearchParallel(kQN, Dimension, queries, result.data());
+            },
+            "Searching " + std::to_string(kQN) + " " +
+                std::to_string(Dimension) + "-dimension vector in " + what +
+                " ... ");
+        std::printf("Checking Results...\n");
+        CheckResults(result, expected, query_records);
+        // one at a time, only the queries that were inserted
+        for (int i = 0; i < kInserted; ++i) {
+            CheckResult(
+                expected, *query_records[i],
+                tree.mipSearch(Dimension, queries[i]));
+        }
+        std::printf("Done.\n");
+    };
+    {
+        BallTree tree;
+        tree.buildTree(Scale, Dimension, data, 0, BoundOf(format));
+        tree.setMergeThreshold(kMergeThreshold);
+        TimeAndPrint(
+            [&] { insert(tree, 0, kInserted / 2); },
+            "Inserting " + std::to_string(kInserted / 2) +
+                " records into the built BallTree ... ");
+        tree.storeTree(index_path.data(), format);
+    }
+    {
+        BallTree tree;
+        tree.restoreTree(index_path.data());
+        tree.setMergeThreshold(kMergeThreshold);
+        TimeAndPrint(
+            [&] { insert(tree, kInserted / 2, kInserted); },
+            "Inserting " + std::to_string(kInserted - kInserted / 2) +
+                " records into the BallTree with " + description + " ... ");
+        search(tree, updated_records, "the BallTree after insertions");
+    }
+    {
+        BallTree tree;
+        tree.restoreTree(index_path.data());
+        search(tree, updated_records, "the restored BallTree after insertions");
+        tree.setMergeThreshold(kMergeThreshold);
+        TimeAndPrint(
+            [&] {
+                for (int i = 0; i < kInserted; ++i) {
+                    if (not tree.deleteData(Dimension, queries[i])) {
+                        std::printf(
+                            "WARNING! Query %d was not deleted\n", i + 1);
+                    }
+                }
+            },
+            "Deleting " + std::to_string(kInserted) +
+                " records from the BallTree with " + description + " ... ");
+        if (tree.deleteData(Dimension, queries[0])) {
+            std::printf("WARNING! Query 1 was deleted twice\n");
+        }
+        search(tree, data_records, "the BallTree after deletions");
+    }
+    BallTree tree;
+    tree.restoreTree(index_path.data());
+    search(tree, data_records, "the restored BallTree after deletions");
 }
 
 template <
@@ -160,6 +613,56 @@ void TestDataSet(DataSet<Name, Scale, Dimension> tag) {
     BallTree tree2;
     TestRestoreTree(tag, tree2);
     TestSearchTree(tag, tree2, data);
+    IndexFormat clustered;
+    clustered.clustered_leaves = true;
+    TestFormatTree(tag, data, clustered, "clustered/", "clustered leaves");
+    IndexFormat single;
+    single.single_file = true;
+    TestFormatTree(tag, data, single, "single/", "a single index file");
+    IndexFormat blocked;
+    blocked.clustered_subtrees = true;
+    TestFormatTree(tag, data, blocked, "blocked/", "clustered subtrees");
+    IndexFormat quantized;
+    quantized.quantized_records = true;
+    TestFormatTree(tag, data, quantized, "quantized/", "quantized records");
+    IndexFormat quantized_single(quantized);
+    quantized_single.single_file = true;
+    TestFormatTree(
+        tag, data, quantized_single, "quantized-single/",
+        "quantized records in a single index file");
+    IndexFormat unsorted;
+    unsorted.norm_sorted_leaves = false;
+    TestFormatTree(
+        tag, data, unsorted, "unsorted/", "leaves not sorted by norm");
+    IndexFormat cones;
+    cones.cone_bounds = true;
+    TestFormatTree(tag, data, cones, "cone/", "cone bounds");
+    IndexFormat ball_only;
+    ball_only.node_norms = false;
+    TestFormatTree(
+        tag, data, ball_only, "ball-only/", "nodes bounded by their balls only");
+    TestMappedTree(tag, data);
+    TestMappedTree(tag, data, "single/");
+    TestMappedTree(tag, data, "cone/");
+    TestMappedTree(tag, data, "clustered/");
+    TestMappedTree(tag, data, "quantized-single/");
+    TestPrefetchTree(
+        tag, data, StorageBackend::buffered, "single/",
+        "BallTree with a single index file");
+    TestPrefetchTree(
+        tag, data, StorageBackend::mapped, "single/", "mapped BallTree");
+    TestUpdateTree(tag, data, IndexFormat(), "updated/", "one file per page");
+    TestUpdateTree(
+        tag, data, clustered, "updated-clustered/", "clustered leaves");
+    TestUpdateTree(tag, data, single, "updated-single/", "a single index file");
+    TestUpdateTree(
+        tag, data, quantized, "updated-quantized/", "quantized records");
+    TestUpdateTree(
+        tag, data, unsorted, "updated-unsorted/", "leaves not sorted by norm");
+    TestUpdateTree(tag, data, cones, "updated-cone/", "cone bounds");
+    TestUpdateTree(
+        tag, data, ball_only, "updated-ball-only/",
+        "nodes bounded by their balls only");
     std::printf("\n");
 }
 
@@ -1,6 +1,8 @@
 #define BALLTREE_TESTING_ALGORITHM
 
 #include <gtest/gtest.h>
+#include <cstdlib>
+#include <limits>
 #include <utility>
 #include "BallTree.h"
 #include "Utility.h"
@@ -12,6 +14,24 @@ using std::tuple;
 
 namespace {
 
+/**
+ * expects the records of every leaf of an in-memory tree to be sorted by
+ * descending norm
+ */
+class LeafOrderChecker : public BallTreeVisitor {
+  public:
+    virtual void Visit(BallTreeBranch* branch) {
+        branch->left->Accept(*this);
+        branch->right->Accept(*this);
+    }
+    virtual void Visit(BallTreeLeaf* leaf) {
+        auto& records = leaf->raw_data;
+        for (std::size_t i = 1; i < records.size(); ++i) {
+            EXPECT_GE(Norm(records[i - 1]->data), Norm(records[i]->data));
+        }
+    }
+};
+
 vector<Record::Pointer> ReadRecords(const string& p, int d, int n) {
     float** temp = nullptr;
     read_data(n, d, temp, p.data());
@@ -23,7 +43,9 @@ pair<int, double> GetRightAnswer(
     double innerproduct = -1E9;
     int index;
     for (auto& rp : data) {
-        double new_ip = InnerProduct(rp->data, query->data);
+        // scored as the searchers score records
+        double new_ip = kernels::Dot(
+            rp->data.data(), query->data.data(), query->data.size());
         if (new_ip > innerproduct) {
             innerproduct = new_ip;
             index = rp->index;
@@ -32,6 +54,69 @@ pair<int, double> GetRightAnswer(
     return {index, innerproduct};
 }
 
+vector<Record::Pointer> CopyRecords(const vector<Record::Pointer>& records) {
+    vector<Record::Pointer> copy;
+    for (auto& record : records) {
+        copy.push_back(
+            Record::Create(record->index, vector<float>(record->data)));
+    }
+    return copy;
+}
+
+/**
+ * expects tree to find records as good as those rebuilt finds, best first
+ */
+void ExpectSameTopK(
+    BallTreeImpl& tree, BallTreeImpl& rebuilt,
+    const vector<Record::Pointer>& queries) {
+    for (auto& query : queries) {
+        auto got = tree.SearchTopK(query->data, 5);
+        auto want = rebuilt.SearchTopK(query->data, 5);
+        ASSERT_EQ(got.size(), want.size());
+        for (std::size_t j = 0; j < got.size(); ++j) {
+            EXPECT_DOUBLE_EQ(got[j].second, want[j].second);
+        }
+    }
+}
+
+/**
+ * the first leaf at least two levels below the root of an in-memory tree,
+ * emptying it unlinks its parent
+ */
+const BallTreeLeaf* DeepLeaf(const BallTreeNode* node, int depth = 0) {
+    auto branch = dynamic_cast<const BallTreeBranch*>(node);
+    if (not branch) {
+        return depth >= 2 ? static_cast<const BallTreeLeaf*>(node) : nullptr;
+    }
+    if (auto leaf = DeepLeaf(branch->left.get(), depth + 1)) {
+        return leaf;
+    }
+    return DeepLeaf(branch->right.get(), depth + 1);
+}
+
+/**
+ * a new empty directory to store an index in
+ */
+Path TempIndexPath() {
+    char dir[] = "/tmp/balltree-test-XXXXXX";
+    EXPECT_NE(mkdtemp(dir), nullptr);
+    return Path(dir) + "/";
+}
+
+void RemoveIndex(const Path& index_path) {
+    std::system(("rm -rf " + index_path).data());
+}
+
+/**
+ * the formats an index updated in place is checked in
+ */
+vector<IndexFormat> StoredFormats() {
+    vector<IndexFormat> formats(3);
+    formats[1].single_file = true;
+    formats[2].clustered_leaves = true;
+    return formats;
+}
+
 vector<pair<int, double>> GetStandardardAnswer(
     const vector<Record::Pointer>& data,
     const vector<Record::Pointer>& queries) {
@@ -97,11 +182,210 @@ TEST(MathPrimitiveTest, TestDistance) {
     ASSERT_DOUBLE_EQ(dist4, 8.0);
 }
 
+TEST(MathPrimitiveTest, TestKernels) {
+    for (auto isa : {kernels::Isa::scalar, kernels::Isa::sse,
+                     kernels::Isa::avx2, kernels::Isa::avx512}) {
+        auto kernel_set = kernels::Select(isa);
+        if (not kernel_set) {
+            continue;
+        }
+        // odd lengths exercise the tails of every unrolled loop
+        for (std::size_t n : {0, 1, 7, 17, 50, 63, 300}) {
+            vector<float> v1(n), v2(n);
+            for (std::size_t i = 0; i < n; ++i) {
+                v1[i] = std::sin(i * 0.7f);
+                v2[i] = std::cos(i * 1.3f);
+            }
+            EXPECT_NEAR(kernel_set->dot(v1.data(), v2.data(), n),
+                        (InnerProduct<double, vector<float>>(v1, v2)), 1E-4)
+                << kernel_set->name << ' ' << n;
+            EXPECT_NEAR(std::sqrt(kernel_set->squared_l2(v1.data(), v2.data(), n)),
+                        (Distance<double, vector<float>>(v1, v2)), 1E-4)
+                << kernel_set->name << ' ' << n;
+            vector<std::int8_t> codes(n);
+            double expected = 0;
+            for (std::size_t i = 0; i < n; ++i) {
+                codes[i] = static_cast<std::int8_t>(127 * v2[i]);
+                expected += v1[i] * codes[i];
+            }
+            EXPECT_NEAR(kernel_set->dot_int8(v1.data(), codes.data(), n),
+                        expected, 1E-2)
+                << kernel_set->name << ' ' << n;
+        }
+    }
+}
+
 std::ostream& operator<<(std::ostream& os, pair<int, double>& p) {
     os << '(' << p.first << ',' << p.second << ')';
     return os;
 }
 
+TEST(ReplacerTest, TestClock) {
+    ClockReplacer replacer(3);
+    for (std::size_t frame = 0; frame < 3; ++frame) {
+        replacer.Insert(frame);
+    }
+    // the first sweep clears every reference bit
+    EXPECT_EQ(replacer.Victim({0, 0, 0}), 0);
+    replacer.Insert(0);
+    EXPECT_EQ(replacer.Victim({0, 0, 0}), 1);
+    replacer.Insert(1);
+    // frame 2 is pinned, 0 and 1 lose their reference bits
+    EXPECT_EQ(replacer.Victim({0, 0, 1}), 0);
+    EXPECT_EQ(replacer.Victim({1, 1, 1}), -1);
+}
+
+TEST(ReplacerTest, TestLru) {
+    LruReplacer replacer(3);
+    for (std::size_t frame = 0; frame < 3; ++frame) {
+        replacer.Insert(frame);
+    }
+    replacer.Touch(0);
+    EXPECT_EQ(replacer.Victim({0, 0, 0}), 1);
+    EXPECT_EQ(replacer.Victim({0, 1, 0}), 2);
+    EXPECT_EQ(replacer.Victim({0, 1, 1}), 0);
+    EXPECT_EQ(replacer.Victim({1, 1, 1}), -1);
+}
+
+TEST(ReplacerTest, TestTwoQueue) {
+    TwoQueueReplacer replacer(3);
+    for (std::size_t frame = 0; frame < 3; ++frame) {
+        replacer.Insert(frame);
+    }
+    // frame 0 is hit again, the frames seen once go first, oldest first
+    replacer.Touch(0);
+    EXPECT_EQ(replacer.Victim({0, 0, 0}), 1);
+    EXPECT_EQ(replacer.Victim({0, 1, 0}), 2);
+    EXPECT_EQ(replacer.Victim({0, 1, 1}), 0);
+    EXPECT_EQ(replacer.Victim({1, 1, 1}), -1);
+}
+
+TEST(ReplacerTest, TestPoolWithoutFrames) {
+    constexpr int kSize = 50;
+    using Storage = FixedLengthStorage<4, Rid::record, 2>;
+    auto dir = testing::TempDir();
+    std::remove((dir + "no-frames.index").data());
+    for (auto policy : {ReplacementPolicy::clock, ReplacementPolicy::lru,
+                        ReplacementPolicy::two_queue}) {
+        // 0 frames count as 1, the pool still swaps page after page
+        Storage storage(Slot::GetSize(Rid::record, kSize), "no-frames", dir,
+                        0, policy);
+        EXPECT_EQ(storage.FrameNum(), 1u);
+        vector<Rid> rids;
+        for (int i = 0; i < 100; ++i) {
+            rids.push_back(storage.Put(Record(i, vector<float>(kSize, i))));
+        }
+        for (int i = 0; i < 100; ++i) {
+            EXPECT_EQ(storage.Get<Record>(rids[i])->data[0], i);
+        }
+    }
+}
+
+TEST(BufferPoolTest, TestEveryFramePinned) {
+    constexpr int kSize = 50;
+    using Storage = FixedLengthStorage<4, Rid::record, 2>;
+    auto dir = testing::TempDir();
+    std::remove((dir + "pinned.index").data());
+    Storage storage(Slot::GetSize(Rid::record, kSize), "pinned", dir, 1);
+    vector<Rid> rids;
+    for (int i = 0; i < 100; ++i) {
+        rids.push_back(storage.Put(Record(i, vector<float>(kSize, i))));
+    }
+    ASSERT_NE(rids.front().page_id, rids.back().page_id);
+    auto view = storage.View<RecordView>(rids.front());
+    EXPECT_THROW(storage.Get<Record>(rids.back()), std::runtime_error);
+}
+
+TEST(SlotTest, TestLeafVectors) {
+    auto records = ReadRecords(DataPath(), kDimension, N0);
+    vector<Rid> rids;
+    for (int i = 0; i < N0; ++i) {
+        rids.push_back(Rid(i / 4, i % 4, Rid::record));
+    }
+    auto leaf = BallTreeLeaf::Create(
+        vector<float>(records.front()->data), 1, std::move(rids));
+    leaf->raw_data = CopyRecords(records);
+    for (auto& record : records) {
+        leaf->norms.push_back(Norm(record->data));
+    }
+    leaf->max_norm = *std::max_element(begin(leaf->norms), end(leaf->norms));
+    auto size = Slot::GetSize(Rid::leaf, kDimension, true, true, false, true);
+    vector<Byte> bytes(size);
+    Slot slot(bytes.data(), size, Rid::leaf);
+    ASSERT_TRUE(slot.Set(*leaf));
+
+    NodeView view;
+    ASSERT_TRUE(slot.View(view));
+    ASSERT_EQ(view.rid_size, static_cast<std::size_t>(N0));
+    ASSERT_NE(view.norms, nullptr);
+    ASSERT_NE(view.vectors, nullptr);
+    EXPECT_EQ(view.axis, nullptr);
+    EXPECT_EQ(view.max_norm, leaf->max_norm);
+    std::unique_ptr<BallTreeLeaf> copy;
+    ASSERT_TRUE(slot.Get(copy));
+    ASSERT_EQ(copy->raw_data.size(), records.size());
+    for (int i = 0; i < N0; ++i) {
+        EXPECT_EQ(view.norms[i], leaf->norms[i]);
+        EXPECT_EQ(view.indices[i], records[i]->index);
+        EXPECT_EQ(vector<float>(view.vectors + i * kDimension,
+                                view.vectors + (i + 1) * kDimension),
+                  records[i]->data);
+        EXPECT_EQ(copy->raw_data[i]->index, records[i]->index);
+        EXPECT_EQ(copy->raw_data[i]->data, records[i]->data);
+    }
+
+    // the same leaf in a slot without room for the vectors
+    Slot plain(bytes.data(),
+               Slot::GetSize(Rid::leaf, kDimension, true, true), Rid::leaf);
+    ASSERT_TRUE(plain.View(view));
+    EXPECT_NE(view.norms, nullptr);
+    EXPECT_EQ(view.vectors, nullptr);
+    EXPECT_EQ(view.max_norm, leaf->max_norm);
+}
+
+TEST(StoredTreeTest, TestSmallIndex) {
+    // no more than N0 records, the root of the index is a leaf
+    auto records = ReadRecords(DataPath(), kDimension, N0 / 2);
+    for (auto& format : StoredFormats()) {
+        auto index_path = TempIndexPath();
+        {
+            BallTreeImpl built(CopyRecords(records));
+            built.SetDimension(kDimension);
+            ASSERT_TRUE(built.StoreTree(index_path, format));
+        }
+        auto current = CopyRecords(records);
+        {
+            BallTreeImpl restored(index_path);
+            ASSERT_NE(restored.Root(), nullptr);
+            restored.SetMergeThreshold(2 * N0);
+            ASSERT_TRUE(restored.Delete(current.back()->data));
+            current.pop_back();
+            ASSERT_TRUE(restored.Merge());
+            BallTreeImpl rebuilt(CopyRecords(current));
+            ASSERT_TRUE(rebuilt.Flatten());
+            ExpectSameTopK(restored, rebuilt, records);
+            // close to the first record, they split the root
+            for (int i = 1; i <= N0; ++i) {
+                vector<float> v(records.front()->data);
+                for (auto& x : v) {
+                    x *= 1 + i * 1E-3f;
+                }
+                int index = 10 * kRecordSize + i;
+                ASSERT_TRUE(restored.Insert(v, index));
+                current.push_back(Record::Create(index, std::move(v)));
+            }
+            ASSERT_TRUE(restored.Merge());
+            EXPECT_NE(dynamic_cast<const BallTreeBranch*>(restored.Root()),
+                      nullptr);
+        }
+        BallTreeImpl reopened(index_path);
+        BallTreeImpl rebuilt(CopyRecords(current));
+        ASSERT_TRUE(rebuilt.Flatten());
+        ExpectSameTopK(reopened, rebuilt, current);
+        RemoveIndex(index_path);
+    }
+}
+
 TEST_P(TreeAlgorithmTest, HelloWorld) {
     ASSERT_EQ(records_.size(), kRecordSize);
     ASSERT_EQ(queries_.size(), kQuerySize);
@@ -192,6 +476,46 @@ TEST_P(TreeAlgorithmTest, TestSplitRecord) {
     }
 }
 
+testing::AssertionResult IsSameTree(
+    const BallTreeNode* lhs, const BallTreeNode* rhs) {
+    if (lhs->center != rhs->center or lhs->radius != rhs->radius) {
+        return testing::AssertionFailure() << "different center or radius";
+    }
+    auto lhs_branch = dynamic_cast<const BallTreeBranch*>(lhs);
+    auto rhs_branch = dynamic_cast<const BallTreeBranch*>(rhs);
+    if (lhs_branch and rhs_branch) {
+        auto left = IsSameTree(lhs_branch->left.get(), rhs_branch->left.get());
+        if (not left) {
+            return left;
+        }
+        return IsSameTree(lhs_branch->right.get(), rhs_branch->right.get());
+    }
+    auto lhs_leaf = dynamic_cast<const BallTreeLeaf*>(lhs);
+    auto rhs_leaf = dynamic_cast<const BallTreeLeaf*>(rhs);
+    if (not lhs_leaf or not rhs_leaf or
+        lhs_leaf->raw_data.size() != rhs_leaf->raw_data.size()) {
+        return testing::AssertionFailure() << "different node shape";
+    }
+    for (std::size_t i = 0; i < lhs_leaf->raw_data.size(); ++i) {
+        if (lhs_leaf->raw_data[i]->index != rhs_leaf->raw_data[i]->index) {
+            return testing::AssertionFailure() << "different leaf records";
+        }
+    }
+    return testing::AssertionSuccess();
+}
+
+TEST_P(TreeAlgorithmTest, TestParallelBuild) {
+    vector<Record::Pointer> copy;
+    for (auto& record : records_) {
+        copy.push_back(std::make_unique<Record>(*record));
+    }
+    ThreadPool pool(4);
+    BallTreeImpl serial(std::move(records_));
+    // tiny cutoffs so that every level forks and scans in parallel
+    BallTreeImpl parallel(std::move(copy), &pool, 0, 0);
+    EXPECT_TRUE(IsSameTree(serial.Root(), parallel.Root()));
+}
+
 TEST_P(TreeAlgorithmTest, TestSearch) {
     BallTreeImpl ball_tree(std::move(records_));
     for (int i = 0; i < queries_.size(); ++i) {
@@ -202,5 +526,239 @@ TEST_P(TreeAlgorithmTest, TestSearch) {
     std::cout << '\n';
 }
 
+
+TEST_P(TreeAlgorithmTest, TestFlatSearch) {
+    BallTreeImpl ball_tree(std::move(records_));
+    ASSERT_TRUE(ball_tree.Flatten());
+    for (int i = 0; i < queries_.size(); ++i) {
+        pair<int, double> search_answer = ball_tree.Search(queries_[i]->data);
+        EXPECT_NEAR(search_answer.second, standard_answers_[i].second, 1E-4);
+        auto top_k = ball_tree.SearchTopK(queries_[i]->data, 5);
+        ASSERT_EQ(top_k.size(), 5);
+        EXPECT_EQ(top_k.front().first, search_answer.first);
+        EXPECT_TRUE(std::is_sorted(
+            begin(top_k), end(top_k),
+            [](const pair<int, double>& a, const pair<int, double>& b) {
+                return a.second > b.second;
+            }));
+    }
+}
+
+TEST_P(TreeAlgorithmTest, TestParallelSearchFromWorker) {
+    BallTreeImpl ball_tree(std::move(records_));
+    ASSERT_TRUE(ball_tree.Flatten());
+    vector<vector<float>> vs;
+    for (auto& query : queries_) {
+        vs.push_back(query->data);
+    }
+    auto expected = ball_tree.SearchBatch(vs);
+    // the only worker runs the search, it has to run the tasks too
+    ThreadPool pool(1);
+    auto search = pool.Submit([&] { return ball_tree.SearchParallel(vs, pool); });
+    EXPECT_EQ(search.get(), expected);
+}
+
+TEST_P(TreeAlgorithmTest, TestBudgetedSearch) {
+    BallTreeImpl ball_tree(std::move(records_));
+    ASSERT_TRUE(ball_tree.Flatten());
+    SearchBudget one_leaf;
+    one_leaf.max_leaves = 1;
+    for (int i = 0; i < queries_.size(); ++i) {
+        bool exact = false;
+        auto unlimited =
+            ball_tree.SearchTopK(queries_[i]->data, 5, SearchBudget(), &exact);
+        EXPECT_TRUE(exact);
+        ASSERT_EQ(unlimited.size(), 5);
+        EXPECT_DOUBLE_EQ(unlimited.front().second, standard_answers_[i].second);
+        auto stopped = ball_tree.SearchTopK(queries_[i]->data, 5, one_leaf, &exact);
+        EXPECT_FALSE(stopped.empty());
+        if (exact) {
+            EXPECT_DOUBLE_EQ(stopped.front().second, standard_answers_[i].second);
+        }
+    }
+}
+
+TEST_P(TreeAlgorithmTest, TestBestFirstSearch) {
+    BallTreeImpl ball_tree(std::move(records_));
+    ASSERT_TRUE(ball_tree.Flatten());
+    for (int i = 0; i < queries_.size(); ++i) {
+        auto depth_first = ball_tree.SearchTopK(queries_[i]->data, 5);
+        ball_tree.SetSearchOrder(SearchOrder::best_first);
+        auto best_first = ball_tree.SearchTopK(queries_[i]->data, 5);
+        ball_tree.SetSearchOrder(SearchOrder::depth_first);
+        ASSERT_EQ(best_first.size(), depth_first.size());
+        for (std::size_t j = 0; j < best_first.size(); ++j) {
+            EXPECT_DOUBLE_EQ(best_first[j].second, depth_first[j].second);
+        }
+    }
+}
+
+TEST_P(TreeAlgorithmTest, TestNormSortedLeaves) {
+    BallTreeImpl ball_tree(std::move(records_));
+    ball_tree.SetMergeThreshold(queries_.size() + 1);
+    // the queries land in leaves of the tree when they are merged
+    for (auto& query : queries_) {
+        ASSERT_TRUE(ball_tree.Insert(query->data));
+    }
+    ASSERT_TRUE(ball_tree.Merge());
+    LeafOrderChecker checker;
+    const_cast<BallTreeNode*>(ball_tree.Root())->Accept(checker);
+}
+
+TEST_P(TreeAlgorithmTest, TestConeBound) {
+    auto cone = ConeBound::Of(records_);
+    double min_norm = std::numeric_limits<double>::max(), max_norm = 0;
+    for (auto& record : records_) {
+        min_norm = std::min(min_norm, Norm(record->data));
+        max_norm = std::max(max_norm, Norm(record->data));
+    }
+    for (auto& query : queries_) {
+        double bound =
+            cone.Mip(query->data, Norm(query->data), min_norm, max_norm);
+        for (auto& record : records_) {
+            EXPECT_LE(
+                kernels::Dot(query->data.data(), record->data.data(),
+                             record->data.size()),
+                bound);
+        }
+    }
+}
+
+TEST_P(TreeAlgorithmTest, TestConeSearch) {
+    BallTreeImpl ball_tree(
+        std::move(records_), nullptr, BallTreeImpl::kParallelBuildCutoff,
+        BallTreeImpl::kParallelScanCutoff, NodeBound::cone);
+    ASSERT_FALSE(ball_tree.Root()->cone.Empty());
+    ASSERT_TRUE(ball_tree.Flatten());
+    for (int i = 0; i < queries_.size(); ++i) {
+        auto top_k = ball_tree.SearchTopK(queries_[i]->data, 5);
+        ASSERT_EQ(top_k.size(), 5);
+        EXPECT_NEAR(top_k.front().second, standard_answers_[i].second, 1E-4);
+    }
+}
+
+TEST_P(TreeAlgorithmTest, TestNodeNorms) {
+    double max_norm = 0;
+    for (auto& record : records_) {
+        max_norm = std::max(max_norm, Norm(record->data));
+    }
+    BallTreeImpl ball_tree(std::move(records_));
+    EXPECT_DOUBLE_EQ(ball_tree.Root()->max_norm, max_norm);
+    ball_tree.SetMergeThreshold(queries_.size() + 1);
+    for (auto& query : queries_) {
+        ASSERT_TRUE(ball_tree.Insert(query->data));
+        max_norm = std::max(max_norm, Norm(query->data));
+    }
+    ASSERT_TRUE(ball_tree.Merge());
+    EXPECT_DOUBLE_EQ(ball_tree.Root()->max_norm, max_norm);
+}
+
+TEST_P(TreeAlgorithmTest, TestUpdatesMatchRebuild) {
+    BallTreeImpl ball_tree(CopyRecords(records_));
+    ASSERT_TRUE(ball_tree.Flatten());
+    ball_tree.SetMergeThreshold(queries_.size() + records_.size());
+    // tombstones go by index, a new record may not take one over
+    ASSERT_TRUE(ball_tree.Delete(records_.back()->data));
+    EXPECT_FALSE(ball_tree.Insert(queries_.front()->data, records_.back()->index));
+    records_.pop_back();
+    ASSERT_TRUE(ball_tree.Merge());
+
+    // merges run in the background while the updates come in
+    ball_tree.SetMergeThreshold(8);
+    vector<Record::Pointer> current;
+    for (std::size_t i = 0; i < records_.size(); ++i) {
+        if (i % 5 == 0) {
+            ASSERT_TRUE(ball_tree.Delete(records_[i]->data));
+        } else {
+            current.push_back(std::move(records_[i]));
+        }
+    }
+    for (std::size_t i = 0; i < queries_.size(); i += 2) {
+        int index = 10 * kRecordSize + i;
+        ASSERT_TRUE(ball_tree.Insert(queries_[i]->data, index));
+        current.push_back(Record::Create(index, vector<float>(queries_[i]->data)));
+    }
+
+    BallTreeImpl rebuilt(CopyRecords(current));
+    ASSERT_TRUE(rebuilt.Flatten());
+    ExpectSameTopK(ball_tree, rebuilt, queries_);
+    ASSERT_TRUE(ball_tree.Merge());
+    ExpectSameTopK(ball_tree, rebuilt, queries_);
+}
+
+TEST_P(TreeAlgorithmTest, TestQuantizedAfterMerge) {
+    BallTreeImpl ball_tree(std::move(records_));
+    ASSERT_TRUE(ball_tree.Quantize());
+    ball_tree.SetMergeThreshold(queries_.size() + 1);
+    // far out along the query, the best record of the query once merged
+    auto& query = queries_.front()->data;
+    vector<float> far(query);
+    for (auto& x : far) {
+        x *= 100;
+    }
+    int index = 10 * kRecordSize;
+    ASSERT_TRUE(ball_tree.Insert(far, index));
+    ASSERT_TRUE(ball_tree.Merge());
+    auto results = ball_tree.SearchApproximate(query, 5);
+    ASSERT_EQ(results.size(), 5);
+    EXPECT_EQ(results.front().first, index);
+    EXPECT_DOUBLE_EQ(
+        results.front().second,
+        kernels::Dot(query.data(), far.data(), far.size()));
+}
+
+TEST_P(TreeAlgorithmTest, TestStoredUpdatesMatchRebuild) {
+    for (auto& format : StoredFormats()) {
+        auto index_path = TempIndexPath();
+        vector<Record::Pointer> emptied;
+        {
+            BallTreeImpl built(CopyRecords(records_));
+            built.SetDimension(GetParam().second);
+            auto leaf = DeepLeaf(built.Root());
+            ASSERT_NE(leaf, nullptr);
+            emptied = CopyRecords(leaf->raw_data);
+            ASSERT_TRUE(built.StoreTree(index_path, format));
+        }
+        Tombstones deleted;
+        for (auto& record : emptied) {
+            deleted.insert(record->index);
+        }
+        vector<Record::Pointer> current;
+        for (auto& record : records_) {
+            if (not deleted.count(record->index)) {
+                current.push_back(
+                    Record::Create(record->index, vector<float>(record->data)));
+            }
+        }
+        {
+            BallTreeImpl restored(index_path);
+            restored.SetMergeThreshold(records_.size());
+            for (auto& record : emptied) {
+                ASSERT_TRUE(restored.Delete(record->data));
+            }
+            // close to one record, they split its leaf
+            for (int i = 1; i <= N0; ++i) {
+                vector<float> v(records_.front()->data);
+                for (auto& x : v) {
+                    x *= 1 + i * 1E-3f;
+                }
+                int index = 10 * kRecordSize + i;
+                ASSERT_TRUE(restored.Insert(v, index));
+                current.push_back(Record::Create(index, std::move(v)));
+            }
+            BallTreeImpl rebuilt(CopyRecords(current));
+            ASSERT_TRUE(rebuilt.Flatten());
+            ExpectSameTopK(restored, rebuilt, queries_);
+            ASSERT_TRUE(restored.Merge());
+            ExpectSameTopK(restored, rebuilt, queries_);
+        }
+        BallTreeImpl reopened(index_path);
+        BallTreeImpl rebuilt(CopyRecords(current));
+        ASSERT_TRUE(rebuilt.Flatten());
+        ExpectSameTopK(reopened, rebuilt, queries_);
+        RemoveIndex(index_path);
+    }
+}
+
 INSTANTIATE_TEST_CASE_P(TestAlgorithmWithThreeDatasets, TreeAlgorithmTest, 
         testing::Values(std::make_pair("Mnist", 50), std::make_pair("Yahoo", 300), std::make_pair("Netflix", 50)));
@@ -32,5 +32,31 @@ int main() {
     std::cout << ptr->data[0] << " " << ptr->data[1] << std::endl;
     continue;
   }
+
+  for (int index = 0; index < 20; ++index) {
+    auto view = storage.View<RecordView>(rids[index]);
+    std::cout << view->data[0] << " " << view->data[1] << std::endl;
+  }
+
+  // the free-space map outlives the storage, a reopened one fills the page
+  // left with free slots instead of starting a new page
+  Rid before(0, 0);
+  {
+    FixedLengthStorage<1024, Rid::record, 5> first(slotSize, "free.txt", "./tt/");
+    before = first.Put(record);
+  }
+  {
+    FixedLengthStorage<1024, Rid::record, 5> reopened(slotSize, "free.txt", "./tt/");
+    auto after = reopened.Put(record);
+    std::cout << "page " << before.page_id << " reused: "
+              << (after.page_id == before.page_id) << std::endl;
+  }
+
+  // a removed slot is handed out again, a second remove finds nothing
+  auto removed = rids[3];
+  std::cout << "removed: " << storage.Remove(removed)
+            << ", again: " << storage.Remove(removed) << std::endl;
+  auto refilled = storage.Put(record);
+  std::cout << "slot reused: " << (refilled == removed) << std::endl;
   return 0;
 }